@@ -7,8 +7,35 @@
 
    4 commands are sent from the driver to this firmware, [ABORT,OPEN,CLOSE,QUERY].
    'QUERY' is used to determine if the roof is fully open or fully closed.
+   The shutter actuator has its own commands [SHUTTEROPEN,SHUTTERCLOSE,SHUTTERQUERY] and runs independently of
+   the roof. ABORT stops both; STOP stops only the roof, so the driver can stop the roof at a limit while the
+   shutter carries on.
    Unlike the usual firmata scenario, the client does not have direct control over the pins.
 
+   State changes are also pushed to the driver without being asked. Whenever the limit switches settle in a new
+   state the same string a QUERY would return (OPEN, CLOSED or UNKNOWN) is sent, and whenever the shutter
+   changes state the SHUTTERQUERY reply (SHUTTEROPEN, SHUTTERCLOSED or SHUTTERUNKNOWN) is sent.
+
+   The same commands are also accepted as a one byte opcode in a ROOF_SYSEX_COMMAND sysex. A binary QUERY is
+   answered with a ROOF_SYSEX_STATUS sysex holding a status byte (both limit switches, the shutter state and
+   whether the roof motor is on) and a features byte listing the opcodes added since the first binary firmware,
+   so the driver knows it can send STOP. Once a binary command has been received, state changes are pushed as status
+   frames instead of strings; a string command switches back. The driver's roofprotocol.h holds the same values.
+
+   Limit switch edges are caught by a pin change interrupt rather than polled from loop(). The interrupt debounces
+   each switch, latches the time of the edge and, when the roof is running into that switch, cuts the roof relays
+   there and then, so the stop doesn't wait on whatever loop() is doing. A binary host is sent each latched edge
+   as a ROOF_SYSEX_EDGE frame (board time of the edge and its age) so it can time the travel exactly. The pin
+   change setup assumes an ATmega328 board (Uno, Nano) where pins 8 and 9 share PCINT0.
+
+   The serial link starts at 57600 baud. A binary host can ask for a faster rate with a ROOF_SYSEX_BAUD sysex: the
+   sketch echoes the rate, switches, and goes back to 57600 unless the host repeats the request at the new rate
+   within baudTrialTime.
+
+   loop() never blocks. Motor and actuator relays are switched off immediately, and a new direction is only
+   energised after every relay in the set has been off for an interlock dwell (1s roof, 200ms shutter) which is
+   timed with millis(), so commands and the limit switches are still handled while it passes.
+
 
    Plug pins to motor controller (this is a custom plug wired beween contactors and motor to enable easy maintenance, not used in code)
    1 Live Supply
@@ -58,11 +85,74 @@ volatile int previousShutterMotorState = shutterStopped;
 volatile bool shutterClosed = true;
 
 const unsigned long maxActuatorTime = 40000;
-unsigned long motorOnTime = 0;
-unsigned long shutterActuatorStartTime = 0;
+const unsigned long limitSwitchSettleTime = 50;
 unsigned long ledToggleTime = 0;
 bool ledState;
 
+//binary protocol, see roofprotocol.h in the driver
+const byte ROOF_SYSEX_COMMAND = 0x01;
+const byte ROOF_SYSEX_STATUS = 0x02;
+const byte ROOF_OP_OPEN = 0x01;
+const byte ROOF_OP_CLOSE = 0x02;
+const byte ROOF_OP_ABORT = 0x03;
+const byte ROOF_OP_SHUTTER_OPEN = 0x04;
+const byte ROOF_OP_SHUTTER_CLOSE = 0x05;
+const byte ROOF_OP_QUERY = 0x06;
+const byte ROOF_OP_STOP = 0x07;
+const byte ROOF_STATUS_OPEN_LIMIT = 0x01;
+const byte ROOF_STATUS_CLOSED_LIMIT = 0x02;
+const byte ROOF_STATUS_SHUTTER_CLOSED = 0x00;
+const byte ROOF_STATUS_SHUTTER_OPEN = 0x04;
+const byte ROOF_STATUS_SHUTTER_MOVING = 0x08;
+const byte ROOF_STATUS_MOTOR_ON = 0x10;
+const byte ROOF_FEATURE_STOP = 0x01;
+const byte roofFeatures = ROOF_FEATURE_STOP;
+const byte ROOF_SYSEX_EDGE = 0x03;
+const byte ROOF_EDGE_MADE = 0x04;
+const byte ROOF_EDGE_CUT = 0x08;
+const unsigned long ROOF_EDGE_AGE_MAX = 0x1FFFFF;
+const byte ROOF_SYSEX_BAUD = 0x04;
+
+//serial link rate
+const long defaultBaud = 57600;
+const long supportedBauds[] = { 57600, 115200, 230400, 250000, 500000, 1000000 };
+const unsigned long baudTrialTime = 2000;
+long linkBaud = defaultBaud;
+bool baudOnTrial = false;     //switched, waiting for the host to confirm at the new rate
+unsigned long baudTrialStart = 0;
+const byte NO_STATUS = 0xFF;
+bool binaryHost = false;
+
+//last state pushed to the driver
+byte pendingLimits = 0;
+unsigned long pendingLimitsTime = 0;
+byte settledLimits = 0;
+const char *reportedRoofState = NULL;
+const char *reportedShutterState = NULL;
+byte reportedStatus = NO_STATUS;
+
+//limit switches as seen by the pin change interrupt, index 0 is the fully open switch and 1 the fully closed one
+const unsigned long limitDebounceTime = 20;
+volatile byte limitLevels = 0;                //debounced switch bits
+volatile unsigned long limitEdgeTime[2] = { 0, 0 };
+volatile byte limitEdgeReport[2] = { 0, 0 };  //edge byte waiting to be sent, 0 if none
+
+//relay sequencing. Switching off is immediate; a new direction is only energised after every relay
+//has been off for the interlock dwell, without blocking loop()
+const byte relaysOff = 0;
+const byte relaysDwell = 1;   //all off, waiting to energise relaySequence.direction
+const byte relaysOn = 2;
+
+typedef struct {
+  byte state;
+  int direction;              //roof or shutter state being switched to
+  unsigned long since;        //when state was entered
+  unsigned long dwell;
+} relaySequence;
+
+volatile relaySequence roofRelays = { relaysOff, roofStopped, 0, 1000 };
+volatile relaySequence shutterRelays = { relaysOff, shutterStopped, 0, 200 };
+
 /*==============================================================================
    SETUP()
   ============================================================================*/
@@ -70,7 +160,8 @@ void setup()
 {
   Firmata.setFirmwareVersion(FIRMATA_MAJOR_VERSION, FIRMATA_MINOR_VERSION);
   Firmata.attach(STRING_DATA, stringCallback);
-  Firmata.begin(57600);
+  Firmata.attach(START_SYSEX, sysexCallback);
+  Firmata.begin(defaultBaud);
   pinMode(relayRoofOpenPin1, OUTPUT);
   pinMode(relayRoofClosePin1, OUTPUT);
   pinMode(relayRoofOpenPin2, OUTPUT);
@@ -80,6 +171,11 @@ void setup()
   pinMode(fullyOpenStopSwitchPin, INPUT);
   pinMode(fullyClosedStopSwitchPin, INPUT);
   pinMode(ledPin, OUTPUT);
+  limitLevels = readLimitSwitches();
+  *digitalPinToPCMSK(fullyOpenStopSwitchPin) |= bit(digitalPinToPCMSKbit(fullyOpenStopSwitchPin));
+  *digitalPinToPCMSK(fullyClosedStopSwitchPin) |= bit(digitalPinToPCMSKbit(fullyClosedStopSwitchPin));
+  PCIFR |= bit(digitalPinToPCICRbit(fullyOpenStopSwitchPin));
+  PCICR |= bit(digitalPinToPCICRbit(fullyOpenStopSwitchPin));
 }
 
 /*==============================================================================
@@ -90,6 +186,11 @@ void loop()
   while (Firmata.available()) {
     Firmata.processInput();
   }
+  if (baudOnTrial && millis() - baudTrialStart >= baudTrialTime) {
+    //the host never confirmed, it may not be able to hear us at this rate
+    switchBaud(defaultBaud);
+    baudOnTrial = false;
+  }
   handleState();
 }
 
@@ -98,36 +199,292 @@ void loop()
   ============================================================================*/
 void stringCallback(char *myString)
 {
-  String commandString = String(myString);
-  if (commandString.equals("OPEN")) {
+  binaryHost = false;
+  if (strcmp(myString, "OPEN") == 0) {
     roofState = roofOpening;
-  } else if (commandString.equals("CLOSE")) {
+  } else if (strcmp(myString, "CLOSE") == 0) {
     roofState = roofClosing;
-  } else if (commandString.equals("ABORT")) {
+  } else if (strcmp(myString, "ABORT") == 0) {
     roofState = roofStopped;
     shutterMotorState = shutterStopped;
-  } else if (commandString.equals("SHUTTEROPEN")) {
+  } else if (strcmp(myString, "STOP") == 0) {
+    roofState = roofStopped;
+  } else if (strcmp(myString, "SHUTTEROPEN") == 0) {
     shutterMotorState = shutterOpening;
-  } else if (commandString.equals("SHUTTERCLOSE")) {
+  } else if (strcmp(myString, "SHUTTERCLOSE") == 0) {
     shutterMotorState = shutterClosing;
-  } else if (commandString.equals("SHUTTERQUERY")) {
-    if (shutterMotorState == shutterStopped) {
-      if (shutterClosed==true) {
-        Firmata.sendString("SHUTTERCLOSED");
-      } else {
-        Firmata.sendString("SHUTTEROPEN");
-      }
-    } else {
-      Firmata.sendString("SHUTTERUNKNOWN");
+  } else if (strcmp(myString, "SHUTTERQUERY") == 0) {
+    Firmata.sendString(shutterStateString());
+  } else if (strcmp(myString, "QUERY") == 0) {
+    Firmata.sendString(roofLimitStateString());
+  }
+}
+
+/**
+   Binary commands, one opcode per ROOF_SYSEX_COMMAND sysex
+*/
+void sysexCallback(byte command, byte argc, byte *argv)
+{
+  if (command == ROOF_SYSEX_BAUD && argc >= 3) {
+    baudRequest(argv[0] | ((long)argv[1] << 7) | ((long)argv[2] << 14));
+    return;
+  }
+  if (command != ROOF_SYSEX_COMMAND || argc < 1) {
+    return;
+  }
+  if (!binaryHost) {
+    binaryHost = true;
+    reportedStatus = NO_STATUS;
+  }
+  switch (argv[0]) {
+    case ROOF_OP_OPEN:
+      roofState = roofOpening;
+      break;
+    case ROOF_OP_CLOSE:
+      roofState = roofClosing;
+      break;
+    case ROOF_OP_ABORT:
+      roofState = roofStopped;
+      shutterMotorState = shutterStopped;
+      break;
+    case ROOF_OP_STOP:
+      roofState = roofStopped;
+      break;
+    case ROOF_OP_SHUTTER_OPEN:
+      shutterMotorState = shutterOpening;
+      break;
+    case ROOF_OP_SHUTTER_CLOSE:
+      shutterMotorState = shutterClosing;
+      break;
+    case ROOF_OP_QUERY:
+      sendStatus(roofStatus(limitSwitchBits()));
+      break;
+  }
+}
+
+/**
+   A host asking for a link rate. Repeating the request at the new rate confirms it.
+*/
+void baudRequest(long baud) {
+  if (baud == linkBaud) {
+    baudOnTrial = false;
+    sendBaud(linkBaud);
+    return;
+  }
+  bool supported = false;
+  for (byte i = 0; i < sizeof(supportedBauds) / sizeof(supportedBauds[0]); i++) {
+    if (supportedBauds[i] == baud) {
+      supported = true;
+    }
+  }
+  if (!supported) {
+    sendBaud(linkBaud);
+    return;
+  }
+  sendBaud(baud);
+  switchBaud(baud);
+  baudOnTrial = baud != defaultBaud;
+  baudTrialStart = millis();
+}
+
+void sendBaud(long baud) {
+  Firmata.write(START_SYSEX);
+  Firmata.write(ROOF_SYSEX_BAUD);
+  for (byte i = 0; i < 3; i++) {
+    Firmata.write((baud >> (7 * i)) & 0x7F);
+  }
+  Firmata.write(END_SYSEX);
+}
+
+/**
+   Change the serial rate once everything queued has gone at the old one
+*/
+void switchBaud(long baud) {
+  Serial.flush();
+  Serial.end();
+  Serial.begin(baud);
+  linkBaud = baud;
+}
+
+/**
+   Send a status byte and the features byte as is. Firmata.sendSysex() would split each into two 7-bit bytes.
+*/
+void sendStatus(byte status) {
+  Firmata.write(START_SYSEX);
+  Firmata.write(ROOF_SYSEX_STATUS);
+  Firmata.write(status);
+  Firmata.write(roofFeatures);
+  Firmata.write(END_SYSEX);
+}
+
+/**
+   Send a limit switch edge latched by the interrupt. Times are split into 7-bit bytes, least significant first.
+*/
+void sendEdge(byte edge, unsigned long edgeTime) {
+  unsigned long age = millis() - edgeTime;
+  if (age > ROOF_EDGE_AGE_MAX) {
+    age = ROOF_EDGE_AGE_MAX;
+  }
+  Firmata.write(START_SYSEX);
+  Firmata.write(ROOF_SYSEX_EDGE);
+  Firmata.write(edge);
+  for (byte i = 0; i < 5; i++) {
+    Firmata.write((edgeTime >> (7 * i)) & 0x7F);
+  }
+  for (byte i = 0; i < 3; i++) {
+    Firmata.write((age >> (7 * i)) & 0x7F);
+  }
+  Firmata.write(END_SYSEX);
+}
+
+/**
+   Pin change interrupt for the limit switch pins
+*/
+ISR(PCINT0_vect) {
+  captureLimitEdges();
+}
+
+/**
+   Latch a change of either limit switch. Runs in the interrupt, and from loop() with interrupts off to pick up
+   a change the debounce ignored because the switch was still bouncing.
+*/
+void captureLimitEdges() {
+  captureLimitEdge(0, fullyOpenStopSwitchPin, ROOF_STATUS_OPEN_LIMIT, roofOpening);
+  captureLimitEdge(1, fullyClosedStopSwitchPin, ROOF_STATUS_CLOSED_LIMIT, roofClosing);
+}
+
+void captureLimitEdge(byte i, int pin, byte limitBit, int stoppedState) {
+  byte level = digitalRead(pin) == HIGH ? limitBit : 0;
+  if (level == (limitLevels & limitBit)) {
+    return;
+  }
+  unsigned long now = millis();
+  if (now - limitEdgeTime[i] < limitDebounceTime) {
+    return;
+  }
+  limitLevels ^= limitBit;
+  limitEdgeTime[i] = now;
+  byte edge = limitBit;
+  if (level) {
+    edge |= ROOF_EDGE_MADE;
+    //monitorRoofLimitSwitches() without waiting for loop()
+    if (roofState == stoppedState && roofMotorRunDuration() > 1000) {
+      motorOff();
+      roofState = roofStopped;
+      edge |= ROOF_EDGE_CUT;
     }
-  } else if (commandString.equals("QUERY")) {
-    if (digitalRead(fullyOpenStopSwitchPin) == HIGH) {
-      Firmata.sendString("OPEN");
-    } else if (digitalRead(fullyClosedStopSwitchPin) == HIGH) {
-      Firmata.sendString("CLOSED");
+  }
+  limitEdgeReport[i] = edge;
+}
+
+/**
+   Both limit switches as status bits, as last latched by the interrupt
+*/
+byte limitSwitchBits() {
+  return limitLevels;
+}
+
+/**
+   Read both limit switches as status bits
+*/
+byte readLimitSwitches() {
+  byte bits = 0;
+  if (digitalRead(fullyOpenStopSwitchPin) == HIGH) {
+    bits |= ROOF_STATUS_OPEN_LIMIT;
+  }
+  if (digitalRead(fullyClosedStopSwitchPin) == HIGH) {
+    bits |= ROOF_STATUS_CLOSED_LIMIT;
+  }
+  return bits;
+}
+
+/**
+   The packed status byte for the given limit switch bits
+*/
+byte roofStatus(byte limits) {
+  byte status = limits;
+  if (shutterMotorState != shutterStopped) {
+    status |= ROOF_STATUS_SHUTTER_MOVING;
+  } else if (!shutterClosed) {
+    status |= ROOF_STATUS_SHUTTER_OPEN;
+  }
+  if (roofState == roofOpening || roofState == roofClosing) {
+    status |= ROOF_STATUS_MOTOR_ON;
+  }
+  return status;
+}
+
+/**
+   The roof state as reported to the driver, from the limit switches
+*/
+const char *roofLimitStateString() {
+  return roofLimitStateString(limitSwitchBits());
+}
+
+const char *roofLimitStateString(byte limits) {
+  if (limits & ROOF_STATUS_OPEN_LIMIT) {
+    return "OPEN";
+  } else if (limits & ROOF_STATUS_CLOSED_LIMIT) {
+    return "CLOSED";
+  } else {
+    return "UNKNOWN";
+  }
+}
+
+/**
+   The shutter state as reported to the driver
+*/
+const char *shutterStateString() {
+  if (shutterMotorState == shutterStopped) {
+    if (shutterClosed == true) {
+      return "SHUTTERCLOSED";
     } else {
-      Firmata.sendString("UNKNOWN");
+      return "SHUTTEROPEN";
+    }
+  }
+  return "SHUTTERUNKNOWN";
+}
+
+/**
+   Push roof and shutter state changes to the driver. Limit switch changes must be stable for
+   limitSwitchSettleTime before they are sent so a bouncing switch doesn't flood the serial line.
+*/
+void reportStateChanges() {
+  for (byte i = 0; i < 2; i++) {
+    noInterrupts();
+    byte edge = limitEdgeReport[i];
+    unsigned long edgeTime = limitEdgeTime[i];
+    limitEdgeReport[i] = 0;
+    interrupts();
+    if (edge != 0 && binaryHost) {
+      sendEdge(edge, edgeTime);
+    }
+  }
+  byte limits = limitSwitchBits();
+  if (limits != pendingLimits) {
+    pendingLimits = limits;
+    pendingLimitsTime = millis();
+  }
+  if (millis() - pendingLimitsTime >= limitSwitchSettleTime) {
+    settledLimits = pendingLimits;
+  }
+  if (binaryHost) {
+    byte status = roofStatus(settledLimits);
+    if (status != reportedStatus) {
+      reportedStatus = status;
+      sendStatus(status);
     }
+    return;
+  }
+  const char *roofLimitState = roofLimitStateString(settledLimits);
+  if (roofLimitState != reportedRoofState) {
+    reportedRoofState = roofLimitState;
+    Firmata.sendString(reportedRoofState);
+  }
+  const char *shutterState = shutterStateString();
+  if (shutterState != reportedShutterState) {
+    reportedShutterState = shutterState;
+    Firmata.sendString(reportedShutterState);
   }
 }
 
@@ -135,30 +492,64 @@ void stringCallback(char *myString)
    Handle the state of the roof. Act on state change
 */
 void handleState() {
+  noInterrupts();
+  captureLimitEdges();
+  interrupts();
   handleLEDs();
   monitorRoofLimitSwitches();
   if (roofState != previousRoofState) {
     previousRoofState = roofState;
-    if (roofState == roofOpening) {
+    motorOff();
+    startRelaySequence(roofRelays, roofState, roofState == roofOpening || roofState == roofClosing);
+  }
+  if (relayDwellOver(roofRelays)) {
+    //the interrupt may cut the relays as soon as they are on, don't let it land between the two relays of a pair
+    noInterrupts();
+    if (roofRelays.direction == roofOpening) {
       motorFwd();
-    } else if (roofState == roofClosing) {
+    } else {
       motorReverse();
-    }  else {
-      motorOff();
     }
+    interrupts();
   }
   if (shutterMotorState != previousShutterMotorState) {
     previousShutterMotorState = shutterMotorState;
-    if (shutterMotorState == shutterOpening) {
+    stopShutter();
+    startRelaySequence(shutterRelays, shutterMotorState, shutterMotorState != shutterStopped);
+  }
+  if (relayDwellOver(shutterRelays)) {
+    if (shutterRelays.direction == shutterOpening) {
       openShutter();
-    } else if (shutterMotorState == shutterClosing) {
-      closeShutter();
     } else {
-      stopShutter();
+      closeShutter();
     }
   }
   linearActuatorTimedCutout();
   roofMotorSafetyTimeoutCutout();
+  reportStateChanges();
+}
+
+/**
+ * Begin switching a set of relays to a new direction. The caller has already switched them all off;
+ * if moving, relayDwellOver() says when the interlock dwell has passed and the direction can be energised.
+ */
+void startRelaySequence(volatile relaySequence &relays, int direction, bool moving) {
+  //state first, the interrupt only looks at since while the relays are on
+  relays.state = moving ? relaysDwell : relaysOff;
+  relays.direction = direction;
+  relays.since = millis();
+}
+
+/**
+ * True once, when the dwell after switching off is over and the new direction should be energised
+ */
+bool relayDwellOver(volatile relaySequence &relays) {
+  if (relays.state == relaysDwell && millis() - relays.since >= relays.dwell) {
+    relays.since = millis();
+    relays.state = relaysOn;
+    return true;
+  }
+  return false;
 }
 
 /**
@@ -167,15 +558,12 @@ void handleState() {
 void stopShutter() {
   digitalWrite(linearActuatorOpenPin, LOW);
   digitalWrite(linearActuatorClosePin, LOW);
-  delay(200);
 }
 
 /**
  * Extend the linear actuator for shutter
  */
 void openShutter() {
-  stopShutter();
-  shutterActuatorStartTime = millis();
   digitalWrite(linearActuatorOpenPin, HIGH);  
 }
 
@@ -184,8 +572,6 @@ void openShutter() {
  * Retract the linear actuator for shutter
  */
 void closeShutter() {
-  stopShutter();
-  shutterActuatorStartTime = millis();
   digitalWrite(linearActuatorClosePin, HIGH);
 }
 
@@ -197,35 +583,30 @@ void motorOff() {
   digitalWrite(relayRoofClosePin1, LOW);
   digitalWrite(relayRoofOpenPin2, LOW);
   digitalWrite(relayRoofClosePin2, LOW);
-  delay(1000);
 }
 
 /**
    Switch on relays to move motor rev
 */
 void motorReverse() {
-  motorOff();
   digitalWrite(relayRoofOpenPin1, HIGH);
   digitalWrite(relayRoofOpenPin2, HIGH);
-  motorOnTime = millis();
 }
 
 /**
    Switch on relays to motor forwards
 */
 void motorFwd() {
-  motorOff();
   digitalWrite(relayRoofClosePin1, HIGH);
   digitalWrite(relayRoofClosePin2, HIGH);
-  motorOnTime = millis();
 }
 
 /**
-   Return the duration in miliseconds that the roof motors have been running
+   Return the duration in miliseconds that the roof motors have been running. The interlock dwell before the relays close doesn't count.
 */
 unsigned long roofMotorRunDuration() {
-  if (roofState == roofOpening || roofState == roofClosing) {
-    return millis() - motorOnTime;
+  if (roofRelays.state == relaysOn && (roofState == roofOpening || roofState == roofClosing)) {
+    return millis() - roofRelays.since;
   } else {
     return 0;
   }
@@ -235,8 +616,8 @@ unsigned long roofMotorRunDuration() {
    Return true if actuators have been on for more than max time (40seconds)
 */
 bool maximumActuatorRunTimeExceeded() {
-  if (shutterMotorState == shutterOpening || shutterMotorState == shutterClosing) {
-    if (  millis() - shutterActuatorStartTime > maxActuatorTime ) {
+  if (shutterRelays.state == relaysOn && (shutterMotorState == shutterOpening || shutterMotorState == shutterClosing)) {
+    if (  millis() - shutterRelays.since > maxActuatorTime ) {
       return true;
     }    
   }
@@ -245,11 +626,13 @@ bool maximumActuatorRunTimeExceeded() {
 
 
 /**
- * Check limit switches for the roof. If fully open or fully closed then set state to stop the motors
+ * Check limit switches for the roof. If fully open or fully closed then set state to stop the motors.
+ * The interrupt normally does this on the edge; this catches a run started with the roof already on the limit.
  */
 void monitorRoofLimitSwitches() {
   if (roofMotorRunDuration() > 1000) {
-    if ((roofState == roofOpening && digitalRead(fullyOpenStopSwitchPin) == HIGH) || (roofState == roofClosing && digitalRead(fullyClosedStopSwitchPin) == HIGH)) {
+    byte limits = limitSwitchBits();
+    if ((roofState == roofOpening && (limits & ROOF_STATUS_OPEN_LIMIT)) || (roofState == roofClosing && (limits & ROOF_STATUS_CLOSED_LIMIT))) {
       roofState = roofStopped;
     }    
   }
@@ -285,9 +668,9 @@ void linearActuatorTimedCutout() {
 */
 void handleLEDs() {
   //Set an LED on if the corresponding fully open switch is on.
-  if (digitalRead(fullyClosedStopSwitchPin) == HIGH && digitalRead(fullyOpenStopSwitchPin) == LOW) {
+  if (settledLimits == ROOF_STATUS_CLOSED_LIMIT) {
     toggleLed(50);
-  } else if (digitalRead(fullyOpenStopSwitchPin) == HIGH && digitalRead(fullyClosedStopSwitchPin) == LOW) {
+  } else if (settledLimits == ROOF_STATUS_OPEN_LIMIT) {
     toggleLed(1000);
   } else {
     digitalWrite(ledPin, LOW);
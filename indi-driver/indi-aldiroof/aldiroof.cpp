@@ -20,18 +20,78 @@ Sept 2015 Derek OKeeffe
 #include <unistd.h>
 #include <math.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #include <memory>
+#include <algorithm>
 
 #include <indicom.h>
+#include <eventloop.h>
 #include "connectionplugins/connectionserial.h"
 
-std::unique_ptr<AldiRoof> rollOff(new AldiRoof());
+static std::vector<std::unique_ptr<AldiRoof> > roofs;
+// Reads the serial ports of all the roofs on one thread
+static FirmataIoLoop serialLoop;
 
 #define MAX_ROLLOFF_DURATION    19      // This is the max ontime for the motors. Safety cut out. Although a lot of damage can be done on this time!!
+#define REPLY_TIMEOUT_MS        250     // How long to wait for the arduino to answer a QUERY
+#define CONNECT_TIMEOUT_MS      3000    // Give up connecting if the board hasn't reported its firmware by then
+#define MAX_REPLY_TIMEOUTS      3       // Consecutive unanswered QUERYs before the link is considered dead
+#define RECONNECT_DELAY_MS      1000    // First reconnect attempt, doubled after each failure
+#define MAX_RECONNECT_DELAY_MS  30000
+#define STATE_CACHE_MS          400     // Default age before a cached QUERY reply is refreshed. Below the 500ms timer so each tick queries once
+#define LINK_STATS_PERIOD_MS    5000    // How often the link statistics are published
+#define EXPECTED_TRAVEL_S       17      // Typical time from the limit switch at one end to the other
+#define MOTION_POLL_MS          1000    // QUERY rate while moving. Limit switch changes are also pushed as they happen
+#define END_OF_TRAVEL_WINDOW_S  3       // Poll fast from this long before travel is expected to end
+#define END_OF_TRAVEL_POLL_MS   100
+#define IDLE_POLL_MS            10000   // QUERY rate at rest, enough to notice a dead link or the roof being moved by hand
+#define LIMIT_SETTLE_MS         1000    // Re-read the roof state this long after motion ends, once the hoist has stopped
+#define TRAVEL_TIMEOUT_MARGIN_S 2       // Least slack above the learned travel time before the motors are cut
+#define TRAVEL_DRIFT_MIN_S      1.5     // A run this much (or 3 sd) slower than predicted is reported as drift
+#define TEMPERATURE_STALE_S     3600    // Ignore a temperature the weather device hasn't updated for this long
+#define BAUD_CONFIRM_TRIES      3       // Round trips tried at a new link rate before giving up on it
+#define SHUTTER_RUN_S           40      // The arduino runs the shutter actuator this long (maxActuatorTime in the sketch)
+#define SHUTTER_TIMEOUT_MARGIN_S 5      // Slack after SHUTTER_RUN_S before a run the board never reported finished is given up on
+#define WEATHER_CLOSE_ATTEMPTS  3       // Closes made for one weather alert when the link keeps dropping part way through
+
+static const int linkBauds[] = { 57600, 115200, 230400, 500000 };
 
 void ISPoll(void *p);
 
+/**
+ * Binary opcode for a string command, 0 if there is none.
+ **/
+static uint8_t roofOpcode(const char *cmd)
+{
+    if (strcmp(cmd, "OPEN") == 0) return ROOF_OP_OPEN;
+    if (strcmp(cmd, "CLOSE") == 0) return ROOF_OP_CLOSE;
+    if (strcmp(cmd, "ABORT") == 0) return ROOF_OP_ABORT;
+    if (strcmp(cmd, "SHUTTEROPEN") == 0) return ROOF_OP_SHUTTER_OPEN;
+    if (strcmp(cmd, "SHUTTERCLOSE") == 0) return ROOF_OP_SHUTTER_CLOSE;
+    if (strcmp(cmd, "QUERY") == 0) return ROOF_OP_QUERY;
+    if (strcmp(cmd, "STOP") == 0) return ROOF_OP_STOP;
+    return 0;
+}
+
+/**
+ * Rate carried by a ROOF_SYSEX_BAUD message, 0 if it is too short.
+ **/
+static int baudFromSysex(const std::vector<uint8_t> &data)
+{
+    if (data.size() < ROOF_BAUD_BYTES) return 0;
+    int baud = 0;
+    for (int i = 0; i < ROOF_BAUD_BYTES; i++) {
+        baud |= (data[i] & 0x7F) << (7 * i);
+    }
+    return baud;
+}
+
+/**
+ * One device per roof controller. ALDIROOF_PORTS lists the serial ports, comma separated, to run several roofs from this
+ * process as "Aldi Roof 1", "Aldi Roof 2" and so on. Without it there is the single "Aldi Roof" device.
+ **/
 void ISInit()
 {
    static int isInit =0;
@@ -40,32 +100,64 @@ void ISInit()
        return;
 
     isInit = 1;
-    if(rollOff.get() == 0) rollOff.reset(new AldiRoof());
+    const char *ports = getenv("ALDIROOF_PORTS");
+    if (ports != NULL && ports[0] != 0) {
+        std::string list(ports);
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos) end = list.size();
+            std::string port = list.substr(start, end - start);
+            if (!port.empty()) {
+                AldiRoof *roof = new AldiRoof();
+                roof->setInstance(roofs.size() + 1, port.c_str());
+                roofs.push_back(std::unique_ptr<AldiRoof>(roof));
+            }
+            start = end + 1;
+        }
+    }
+    if (roofs.empty()) roofs.push_back(std::unique_ptr<AldiRoof>(new AldiRoof()));
 
 }
 
+/**
+ * Does a call for dev concern roof? A NULL dev is for every device.
+ **/
+static bool forRoof(const char *dev, AldiRoof *roof)
+{
+    return dev == NULL || strcmp(dev, roof->getDeviceName()) == 0;
+}
+
 void ISGetProperties(const char *dev)
 {
         ISInit();
-        rollOff->ISGetProperties(dev);
+        for (size_t i = 0; i < roofs.size(); i++) {
+            if (forRoof(dev, roofs[i].get())) roofs[i]->ISGetProperties(dev);
+        }
 }
 
 void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int num)
 {
         ISInit();
-        rollOff->ISNewSwitch(dev, name, states, names, num);
+        for (size_t i = 0; i < roofs.size(); i++) {
+            if (forRoof(dev, roofs[i].get())) roofs[i]->ISNewSwitch(dev, name, states, names, num);
+        }
 }
 
 void ISNewText(	const char *dev, const char *name, char *texts[], char *names[], int num)
 {
         ISInit();
-        rollOff->ISNewText(dev, name, texts, names, num);
+        for (size_t i = 0; i < roofs.size(); i++) {
+            if (forRoof(dev, roofs[i].get())) roofs[i]->ISNewText(dev, name, texts, names, num);
+        }
 }
 
 void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int num)
 {
         ISInit();
-        rollOff->ISNewNumber(dev, name, values, names, num);
+        for (size_t i = 0; i < roofs.size(); i++) {
+            if (forRoof(dev, roofs[i].get())) roofs[i]->ISNewNumber(dev, name, values, names, num);
+        }
 }
 
 void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n)
@@ -83,7 +175,9 @@ void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[],
 void ISSnoopDevice (XMLEle *root)
 {
     ISInit();
-    rollOff->ISSnoopDevice(root);
+    for (size_t i = 0; i < roofs.size(); i++) {
+        roofs[i]->ISSnoopDevice(root);
+    }
 }
 
 AldiRoof::AldiRoof()
@@ -91,7 +185,44 @@ AldiRoof::AldiRoof()
   fullOpenLimitSwitch   = ISS_OFF;
   fullClosedLimitSwitch = ISS_OFF;
   MotionRequest=0;
-  SetDomeCapability(DOME_CAN_ABORT | DOME_CAN_PARK);
+  fastPollFrom = EXPECTED_TRAVEL_S - END_OF_TRAVEL_WINDOW_S;
+  motionDir = TRAVEL_OPEN;
+  motionFullTravel = false;
+  havePrediction = false;
+  predictedMean = 0;
+  predictedSd = 0;
+  haveArrival = false;
+  outsideTemperature = NAN;
+  weatherAlert = false;
+  weatherClosePending = false;
+  weatherCloseAttempts = 0;
+  weatherCloseInterrupted = false;
+  lastQueryRttUs = 0;
+  timerId = -1;
+  roofStateValid = false;
+  roofOpen = false;
+  roofClosed = false;
+  roofEventCallbackId = -1;
+  reconnectTimerId = -1;
+  reconnectDelay = RECONNECT_DELAY_MS;
+  linkOpening.sf = NULL;
+  linkOpenedFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  linkOpenedCallbackId = -1;
+  replyTimeouts = 0;
+  binaryProtocol = false;
+  firmwareFeatures = 0;
+  statsTimerId = -1;
+  resetLinkStats();
+  instance = 0;
+  closeSent = false;
+  shutterRunning = false;
+  shutterSeenMoving = false;
+  shutterCommand = SHUTTER_CLOSE;
+  openShutterAfterRoof = false;
+  parkAfterShutter = false;
+  sharedState = NULL;
+  sf = NULL;
+  SetDomeCapability(DOME_CAN_ABORT | DOME_CAN_PARK | DOME_HAS_SHUTTER);
 }
 
 /**
@@ -99,24 +230,258 @@ AldiRoof::AldiRoof()
  */
 bool AldiRoof::initProperties()
 {
-    DEBUG(INDI::Logger::DBG_SESSION, "Init props");
+    DEBUG(INDI::Logger::DBG_DEBUG, "Init props");
     INDI::Dome::initProperties();
+    if (!defaultPort.empty()) {
+        serialConnection->setDefaultPort(defaultPort.c_str());
+    }
     SetParkDataType(PARK_NONE);
     addAuxControls();
     IUFillText(&CurrentStateT[0],"State","Roof State",NULL);
     IUFillTextVector(&CurrentStateTP,CurrentStateT,1,getDeviceName(),"STATE","ROOF_STATE",MAIN_CONTROL_TAB,IP_RO,60,IPS_IDLE);
+    IUFillNumber(&StateCacheN[0],"STATE_CACHE_MS","Max age (ms)","%.0f",0,5000,100,STATE_CACHE_MS);
+    IUFillNumberVector(&StateCacheNP,StateCacheN,1,getDeviceName(),"STATE_CACHE","Status cache",OPTIONS_TAB,IP_RW,60,IPS_IDLE);
+    IUFillNumber(&LinkStatsN[STAT_RTT_P50],"QUERY_RTT_P50","QUERY RTT p50 (ms)","%.2f",0,1e6,0,0);
+    IUFillNumber(&LinkStatsN[STAT_RTT_P99],"QUERY_RTT_P99","QUERY RTT p99 (ms)","%.2f",0,1e6,0,0);
+    IUFillNumber(&LinkStatsN[STAT_RTT_MAX],"QUERY_RTT_MAX","QUERY RTT max (ms)","%.2f",0,1e6,0,0);
+    IUFillNumber(&LinkStatsN[STAT_WRITE_P99],"WRITE_P99","Serial write p99 (ms)","%.2f",0,1e6,0,0);
+    IUFillNumber(&LinkStatsN[STAT_TICK_P99],"TICK_P99","Timer tick p99 (ms)","%.2f",0,1e6,0,0);
+    IUFillNumber(&LinkStatsN[STAT_TIMEOUTS],"QUERY_TIMEOUTS","QUERY timeouts","%.0f",0,1e9,0,0);
+    IUFillNumber(&LinkStatsN[STAT_RECONNECTS],"RECONNECTS","Reconnects","%.0f",0,1e9,0,0);
+    IUFillNumber(&LinkStatsN[STAT_RX_RATE],"RX_RATE","Received (bytes/s)","%.1f",0,1e9,0,0);
+    IUFillNumber(&LinkStatsN[STAT_TX_RATE],"TX_RATE","Sent (bytes/s)","%.1f",0,1e9,0,0);
+    IUFillNumberVector(&LinkStatsNP,LinkStatsN,STAT_COUNT,getDeviceName(),"LINK_STATS","Link stats",OPTIONS_TAB,IP_RO,60,IPS_IDLE);
+    static const char *bandLabels[TRAVEL_BANDS] = { "<0C", "0-15C", ">15C" };
+    for (int dir = 0; dir < 2; dir++) {
+        for (int band = 0; band < TRAVEL_BANDS; band++) {
+            INumber *np = &TravelModelN[(dir * TRAVEL_BANDS + band) * 3];
+            const char *dirName = dir == TRAVEL_OPEN ? "OPEN" : "CLOSE";
+            const char *dirLabel = dir == TRAVEL_OPEN ? "Open" : "Close";
+            char name[32], label[32];
+            snprintf(name, sizeof(name), "%s_%s_N", dirName, TravelModel::bandName(band));
+            snprintf(label, sizeof(label), "%s %s runs", dirLabel, bandLabels[band]);
+            IUFillNumber(&np[0],name,label,"%.0f",0,TRAVEL_WINDOW,1,0);
+            snprintf(name, sizeof(name), "%s_%s_MEAN", dirName, TravelModel::bandName(band));
+            snprintf(label, sizeof(label), "%s %s mean (s)", dirLabel, bandLabels[band]);
+            IUFillNumber(&np[1],name,label,"%.2f",0,600,0,0);
+            snprintf(name, sizeof(name), "%s_%s_SD", dirName, TravelModel::bandName(band));
+            snprintf(label, sizeof(label), "%s %s sd (s)", dirLabel, bandLabels[band]);
+            IUFillNumber(&np[2],name,label,"%.2f",0,600,0,0);
+        }
+    }
+    IUFillNumberVector(&TravelModelNP,TravelModelN,2 * TRAVEL_BANDS * 3,getDeviceName(),"TRAVEL_MODEL","Travel time",OPTIONS_TAB,IP_RW,60,IPS_IDLE);
+    IUFillText(&WeatherDeviceT[0],"WEATHER","Weather device","");
+    IUFillTextVector(&WeatherDeviceTP,WeatherDeviceT,1,getDeviceName(),"WEATHER_DEVICE","Snoop",OPTIONS_TAB,IP_RW,60,IPS_IDLE);
+    IUFillSwitch(&WeatherCloseS[0],"INDI_ENABLED","Enabled",ISS_OFF);
+    IUFillSwitch(&WeatherCloseS[1],"INDI_DISABLED","Disabled",ISS_ON);
+    IUFillSwitchVector(&WeatherCloseSP,WeatherCloseS,2,getDeviceName(),"WEATHER_CLOSE","Close on weather alert",OPTIONS_TAB,IP_RW,ISR_1OFMANY,60,IPS_IDLE);
+    char telemetryPath[512];
+    const char *home = getenv("HOME");
+    if (instance > 0) {
+        snprintf(telemetryPath, sizeof(telemetryPath), "%s/.indi/aldiroof_telemetry_%d.bin", home ? home : ".", instance);
+    } else {
+        snprintf(telemetryPath, sizeof(telemetryPath), "%s/.indi/aldiroof_telemetry.bin", home ? home : ".");
+    }
+    IUFillText(&TelemetryFileT[0],"PATH","Ring file",telemetryPath);
+    IUFillTextVector(&TelemetryFileTP,TelemetryFileT,1,getDeviceName(),"TELEMETRY_FILE","Telemetry",OPTIONS_TAB,IP_RW,60,IPS_IDLE);
+    for (int i = 0; i < BAUD_COUNT; i++) {
+        char name[32], label[32];
+        snprintf(name, sizeof(name), "BAUD_%d", linkBauds[i]);
+        snprintf(label, sizeof(label), "%d", linkBauds[i]);
+        IUFillSwitch(&LinkBaudS[i],name,label,linkBauds[i] == ROOF_DEFAULT_BAUD ? ISS_ON : ISS_OFF);
+    }
+    IUFillSwitchVector(&LinkBaudSP,LinkBaudS,BAUD_COUNT,getDeviceName(),"LINK_BAUD","Link speed",OPTIONS_TAB,IP_RW,ISR_1OFMANY,60,IPS_IDLE);
+    IUFillSwitch(&LowLatencyS[0],"INDI_ENABLED","Enabled",ISS_OFF);
+    IUFillSwitch(&LowLatencyS[1],"INDI_DISABLED","Disabled",ISS_ON);
+    IUFillSwitchVector(&LowLatencySP,LowLatencyS,2,getDeviceName(),"LINK_LOW_LATENCY","Low latency serial",CONNECTION_TAB,IP_RW,ISR_1OFMANY,60,IPS_IDLE);
+    IUFillSwitch(&ShutterModeS[SHUTTER_SEPARATE],"SHUTTER_SEPARATE","Separately",ISS_OFF);
+    IUFillSwitch(&ShutterModeS[SHUTTER_IN_TURN],"SHUTTER_IN_TURN","In turn",ISS_OFF);
+    IUFillSwitch(&ShutterModeS[SHUTTER_OVERLAP],"SHUTTER_OVERLAP","Overlapped",ISS_ON);
+    IUFillSwitchVector(&ShutterModeSP,ShutterModeS,SHUTTER_MODE_COUNT,getDeviceName(),"SHUTTER_WITH_ROOF","Shutter with roof",OPTIONS_TAB,IP_RW,ISR_1OFMANY,60,IPS_IDLE);
+    IUFillSwitch(&CloseAllS[0],"CLOSE_ALL","Close all roofs",ISS_OFF);
+    IUFillSwitchVector(&CloseAllSP,CloseAllS,1,getDeviceName(),"ROOFS_CLOSE_ALL","All roofs",MAIN_CONTROL_TAB,IP_RW,ISR_ATMOST1,60,IPS_IDLE);
     return true;
 }
 
+/**
+ * The low latency option is needed before connecting, so unlike the other options it is always defined.
+ **/
+void AldiRoof::ISGetProperties(const char *dev)
+{
+    INDI::Dome::ISGetProperties(dev);
+    defineProperty(&LowLatencySP);
+    loadConfig(true, LowLatencySP.name);
+}
+
 bool AldiRoof::ISSnoopDevice (XMLEle *root)
 {
-	return INDI::Dome::ISSnoopDevice(root);
+    std::chrono::steady_clock::time_point arrived = std::chrono::steady_clock::now();
+    const char *propName = findXMLAttValu(root, "name");
+    const char *devName = findXMLAttValu(root, "device");
+    if (strcmp(propName, "WEATHER_STATUS") == 0 && WeatherDeviceT[0].text != NULL && strcmp(devName, WeatherDeviceT[0].text) == 0)
+    {
+        // The weather device sets the vector to Alert when any of its critical parameters is out of range
+        IPState state;
+        bool alert = crackIPState(findXMLAttValu(root, "state"), &state) == 0 && state == IPS_ALERT;
+        bool raised = alert && !weatherAlert;
+        weatherAlert = alert;
+        if (raised) {
+            weatherAlertTime = arrived;
+            weatherClose(false);
+        }
+    }
+    if (strcmp(propName, "WEATHER_PARAMETERS") == 0 && WeatherDeviceT[0].text != NULL && strcmp(devName, WeatherDeviceT[0].text) == 0)
+    {
+        for (XMLEle *ep = nextXMLEle(root, 1); ep != NULL; ep = nextXMLEle(root, 0))
+        {
+            if (strcmp(findXMLAttValu(ep, "name"), "WEATHER_TEMPERATURE") == 0)
+            {
+                outsideTemperature = atof(pcdataXMLEle(ep));
+                temperatureTime = std::chrono::steady_clock::now();
+            }
+        }
+    }
+	bool rc = INDI::Dome::ISSnoopDevice(root);
+	// The mount may just have parked, clearing the lock that held a weather close back
+	checkWeatherClose();
+	return rc;
+}
+
+/**
+ * Start listening to the configured weather device.
+ **/
+void AldiRoof::snoopWeather()
+{
+    outsideTemperature = NAN;
+    weatherAlert = false;
+    weatherClosePending = false;
+    if (WeatherDeviceT[0].text != NULL && WeatherDeviceT[0].text[0] != 0) {
+        IDSnoopDevice(WeatherDeviceT[0].text, "WEATHER_PARAMETERS");
+        IDSnoopDevice(WeatherDeviceT[0].text, "WEATHER_STATUS");
+    }
+}
+
+/**
+ * The weather device has raised an alert. If enabled, close the roof: the first command goes to the arduino before any
+ * property is touched, then the roof parks as if asked. The time from the alert arriving to that command is logged.
+ * A close that can't be made now (mount unparked, link down) stays pending, see checkWeatherClose(). Retries only log
+ * their refusals at debug level.
+ **/
+void AldiRoof::weatherClose(bool retry)
+{
+    if (!isConnected()) return;
+    if (!retry) {
+        weatherCloseAttempts = 0;
+        weatherCloseInterrupted = false;
+    }
+    if (WeatherCloseS[0].s != ISS_ON) {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Weather alert from %s.", WeatherDeviceT[0].text);
+        weatherClosePending = false;
+        return;
+    }
+    weatherClosePending = true;
+    if (closedForWeather()) {
+        DEBUGF(retry ? INDI::Logger::DBG_DEBUG : INDI::Logger::DBG_SESSION, "Weather alert from %s, the roof is closed.", WeatherDeviceT[0].text);
+        weatherClosePending = false;
+        return;
+    }
+    if (isLocked()) {
+        DEBUGF(retry ? INDI::Logger::DBG_DEBUG : INDI::Logger::DBG_ERROR, "Weather alert from %s, but the mount isn't parked. Not closing the roof onto it until it is!", WeatherDeviceT[0].text);
+        return;
+    }
+    if (sf == NULL) {
+        DEBUGF(retry ? INDI::Logger::DBG_DEBUG : INDI::Logger::DBG_ERROR, "Weather alert from %s, but the arduino link is down. The roof will close once it is back!", WeatherDeviceT[0].text);
+        return;
+    }
+    if (weatherCloseAttempts >= WEATHER_CLOSE_ATTEMPTS) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Weather alert from %s, the link dropped during each of %d closes. Giving up, check the roof!",
+               WeatherDeviceT[0].text, weatherCloseAttempts);
+        weatherClosePending = false;
+        return;
+    }
+    weatherCloseAttempts++;
+    weatherCloseInterrupted = false;
+    if (roofStateValid && roofClosed && DomeMotionSP.s != IPS_BUSY) {
+        // Only the shutter is left, parking a closed roof would just be refused
+        if (startShutter(SHUTTER_CLOSE)) {
+            logWeatherClose(TELEMETRY_CMD_SHUTTER_CLOSE);
+        }
+        return;
+    }
+    if (sendCloseFirst()) {
+        logWeatherClose(closeSent ? TELEMETRY_CMD_CLOSE : TELEMETRY_CMD_SHUTTER_CLOSE);
+    }
+    parkNow();
+}
+
+/**
+ * The roof is closed and at rest, and so is the shutter unless it is moved separately.
+ **/
+bool AldiRoof::closedForWeather()
+{
+    bool roofDone = roofStateValid && roofClosed && DomeMotionSP.s != IPS_BUSY;
+    return roofDone && (shutterMode() == SHUTTER_SEPARATE || getShutterState() == SHUTTER_CLOSED);
+}
+
+/**
+ * A weather close has sent its first command. Only the first close after the alert is timed, later ones follow a dropped link.
+ **/
+void AldiRoof::logWeatherClose(uint8_t command)
+{
+    const char *name = command == TELEMETRY_CMD_CLOSE ? "CLOSE" : "SHUTTERCLOSE";
+    if (weatherCloseAttempts > 1) {
+        DEBUGF(INDI::Logger::DBG_SESSION, "Weather alert from %s, closing again after the link dropped. %s sent, attempt %d of %d.",
+               WeatherDeviceT[0].text, name, weatherCloseAttempts, WEATHER_CLOSE_ATTEMPTS);
+        return;
+    }
+    uint32_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - weatherAlertTime).count();
+    logTelemetry(TELEMETRY_WEATHER, command, TELEMETRY_OK, us);
+    DEBUGF(INDI::Logger::DBG_WARNING, "Weather alert from %s, closing. %s sent %.2f ms after the alert.",
+           WeatherDeviceT[0].text, name, us / 1000.0);
+}
+
+/**
+ * Follow a weather close until the roof is seen closed or the alert is over. A close that was refused is tried again, and
+ * so is one the link dropped part way through, up to WEATHER_CLOSE_ATTEMPTS. A close that ran and stopped short (jammed,
+ * timed out) is reported and not driven again.
+ * Called after each snoop (the mount parking clears the lock), after reconnecting and from every tick. To open the roof
+ * during an alert, disable WEATHER_CLOSE.
+ **/
+void AldiRoof::checkWeatherClose()
+{
+    if (!weatherClosePending || !isConnected()) return;
+    if (!weatherAlert || WeatherCloseS[0].s != ISS_ON) {
+        weatherClosePending = false;
+        return;
+    }
+    // A close still under way
+    if (DomeMotionSP.s == IPS_BUSY || ParkSP.s == IPS_BUSY || shutterRunning) return;
+    refreshRoofState(false);
+    if (weatherCloseAttempts > 0 && !weatherCloseInterrupted && !closedForWeather()) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Weather alert from %s, but the roof didn't close. Not driving it again, check the roof!",
+               WeatherDeviceT[0].text);
+        weatherClosePending = false;
+        return;
+    }
+    weatherClose(true);
+}
+
+/**
+ * The outside temperature in C, or NAN if the weather device isn't reporting.
+ **/
+double AldiRoof::currentTemperature()
+{
+    if (isnan(outsideTemperature) ||
+        std::chrono::steady_clock::now() - temperatureTime > std::chrono::seconds(TEMPERATURE_STALE_S)) {
+        return NAN;
+    }
+    return outsideTemperature;
 }
 
 
 bool AldiRoof::SetupParms()
 {
-    DEBUG(INDI::Logger::DBG_SESSION, "Setting up params");
+    DEBUG(INDI::Logger::DBG_DEBUG, "Setting up params");
     //InitPark();
     fullOpenLimitSwitch   = ISS_OFF;
     fullClosedLimitSwitch = ISS_OFF;
@@ -128,7 +493,7 @@ bool AldiRoof::SetupParms()
         roofStateString = "OPEN";
     }
     if (getFullClosedLimitSwitch()) {
-        DEBUG(INDI::Logger::DBG_SESSION, "Setting closed flag on PARKED");
+        DEBUG(INDI::Logger::DBG_DEBUG, "Setting closed flag on PARKED");
         fullClosedLimitSwitch = ISS_ON;
         setDomeState(DOME_PARKED);
         if(isParked()) {
@@ -147,298 +512,1553 @@ bool AldiRoof::SetupParms()
 
 bool AldiRoof::Connect()
 {
-    sf = new Firmata(serialConnection->port());
-    if (sf->portOpen) {
-		if (strstr(sf->firmata_name, "SimpleDigitalFirmataRoofController")) {
-			DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD CONNECTED.");
-			DEBUGF(INDI::Logger::DBG_SESSION, "FIRMATA VERSION:%s",sf->firmata_name);
-			return true;
-		} else {
-		    DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD INCOMPATABLE FIRMWARE.");
-		    DEBUGF(INDI::Logger::DBG_SESSION, "FIRMATA VERSION:%s",sf->firmata_name);
-		    return false;
-		}
-    } else {
-        DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD FAIL TO CONNECT");
-        delete sf;
+    reconnectDelay = RECONNECT_DELAY_MS;
+    if (!openLink())
         return false;
+    resetLinkStats();
+    openTelemetry();
+    if (instance > 0) {
+        sharedStateName = std::string(ROOFSTATE_NAME) + "_" + std::to_string(instance);
+    } else {
+        sharedStateName = ROOFSTATE_NAME;
     }
+    sharedState = roofstate_create(sharedStateName.c_str());
+    if (sharedState == NULL) {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Cannot create shared memory %s, the roof state will not be published locally", sharedStateName.c_str());
+    }
+    publishState();
+    statsTimerId = IEAddTimer(LINK_STATS_PERIOD_MS, linkStatsCallback, this);
+    scheduler.arm(TIMER_POLL, std::chrono::milliseconds(IDLE_POLL_MS));
+    schedule();
+    return true;
 }
 
-AldiRoof::~AldiRoof()
+/**
+ * Open the serial port, check the firmware and start listening for replies and pushed state changes.
+ **/
+bool AldiRoof::openLink()
 {
-
+    link_open_t link;
+    prepareLinkOpen(link);
+    openRoofLink(link);
+    return takeLink(link);
 }
 
-const char * AldiRoof::getDefaultName()
+/**
+ * What openRoofLink() needs from the properties, read on the event loop.
+ **/
+void AldiRoof::prepareLinkOpen(link_open_t &link)
 {
-        return (char *)"Aldi Roof";
+    link.port = serialConnection->port();
+    link.lowLatency = LowLatencyS[0].s == ISS_ON;
+    link.baud = selectedBaud();
+    link.negotiate = !roofBusy();
+    link.sf = NULL;
+    link.firmware.clear();
+    link.binaryProtocol = false;
+    link.features = 0;
+    link.openBaud = ROOF_DEFAULT_BAUD;
+    link.baudResult = BAUD_RESULT_NONE;
 }
 
-bool AldiRoof::ISNewSwitch (const char *dev, const char *name, ISState *states, char *names[], int n)
+/**
+ * The slow part of opening the link: the board resets when the port opens and takes seconds to report its firmware, then
+ * there is the protocol probe and the rate change. Only touches link and the Firmata it makes, so it can run on linkOpener.
+ **/
+void AldiRoof::openRoofLink(link_open_t &link)
 {
-	return INDI::Dome::ISNewSwitch(dev, name, states, names, n);
+    // The roof firmware doesn't expose its pins, so skip the pin survey
+    Firmata *board = new Firmata(link.port.c_str(), CONNECT_TIMEOUT_MS, false, ROOF_DEFAULT_BAUD, link.lowLatency);
+    if (!board->portOpen && link.baud != ROOF_DEFAULT_BAUD) {
+        // A board that wasn't reset by the port opening may still be at the rate negotiated last time
+        delete board;
+        board = new Firmata(link.port.c_str(), CONNECT_TIMEOUT_MS, false, link.baud, link.lowLatency);
+    }
+    if (!board->portOpen) {
+        delete board;
+        return;
+    }
+    link.firmware = board->firmata_name;
+    if (strstr(board->firmata_name, "SimpleDigitalFirmataRoofController") == NULL) {
+        delete board;
+        return;
+    }
+    board->expectReplies("QUERY", {"OPEN", "CLOSED", "UNKNOWN"});
+    board->expectReplies("SHUTTERQUERY", {"SHUTTEROPEN", "SHUTTERCLOSED", "SHUTTERUNKNOWN"});
+    board->startReader(serialLoop);
+    // Newer firmware answers a binary QUERY, older firmware ignores the sysex and keeps to strings
+    std::vector<uint8_t> status;
+    uint8_t op = ROOF_OP_QUERY;
+    link.binaryProtocol = board->requestSysex(ROOF_SYSEX_COMMAND, &op, 1, ROOF_SYSEX_STATUS,
+                                              std::chrono::milliseconds(REPLY_TIMEOUT_MS), status);
+    if (link.binaryProtocol) {
+        link.features = roofFeatures(status.data(), status.size());
+    }
+    link.openBaud = board->getBaud();
+    if (link.binaryProtocol) {
+        // A failed rate change holds commands back, so not while anything is moving. A board still at the rate is fine.
+        link.baudResult = link.negotiate || link.openBaud == link.baud ? changeBaud(board, link.baud) : BAUD_RESULT_BUSY;
+    }
+    link.sf = board;
 }
 
-
-bool AldiRoof::updateProperties()
+/**
+ * Take over a link openRoofLink() has finished with: log what it found and start handling the board's messages.
+ **/
+bool AldiRoof::takeLink(link_open_t &link)
 {
-    DEBUG(INDI::Logger::DBG_SESSION, "Updating props");
-    INDI::Dome::updateProperties();
-
-    if (isConnected())
-    {
-        SetupParms();
-        defineProperty(&CurrentStateTP);
-    } else
-    {
-	deleteProperty(CurrentStateTP.name);
+    if (link.firmware.empty()) {
+        DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD FAIL TO CONNECT");
+        return false;
+    }
+    if (link.sf == NULL) {
+        DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD INCOMPATABLE FIRMWARE.");
+        DEBUGF(INDI::Logger::DBG_SESSION, "FIRMATA VERSION:%s", link.firmware.c_str());
+        return false;
+    }
+    DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD CONNECTED.");
+    DEBUGF(INDI::Logger::DBG_SESSION, "FIRMATA VERSION:%s", link.firmware.c_str());
+    sf = link.sf;
+    link.sf = NULL;
+    binaryProtocol = link.binaryProtocol;
+    firmwareFeatures = link.features;
+    roofEventCallbackId = IEAddCallback(sf->eventFd(), roofEventCallback, this);
+    replyTimeouts = 0;
+    DEBUGF(INDI::Logger::DBG_SESSION, "Using the %s roof command protocol%s.", binaryProtocol ? "binary" : "string",
+           canStopRoofOnly() ? " with STOP" : "");
+    if (binaryProtocol) {
+        LinkBaudSP.s = baudChanged(link.baudResult, link.baud, link.openBaud) ? IPS_OK : IPS_ALERT;
     }
-
     return true;
 }
 
 /**
-* Disconnect from the arduino
-**/
-bool AldiRoof::Disconnect()
+ * The link rate chosen in LINK_BAUD.
+ **/
+int AldiRoof::selectedBaud()
 {
-    sf->closePort();
-    delete sf;
-    DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD DISCONNECTED.");
-    return true;
+    int i = IUFindOnSwitchIndex(&LinkBaudSP);
+    return i < 0 ? ROOF_DEFAULT_BAUD : linkBauds[i];
 }
 
 /**
- * TimerHit gets called by the indi client every 1sec when the roof is moving.
- */
-void AldiRoof::TimerHit()
+ * Move the link to another rate.
+ **/
+bool AldiRoof::negotiateBaud(int baud)
 {
-
-    DEBUG(INDI::Logger::DBG_DEBUG, "Timer hit");
-    if(isConnected() == false) return;  //  No need to reset timer if we are not connected anymore
-
-   if (DomeMotionSP.s == IPS_BUSY)
-   {
-       // Abort called
-       if (MotionRequest < 0)
-       {
-           DEBUG(INDI::Logger::DBG_SESSION, "Roof motion is stopped.");
-           setDomeState(DOME_IDLE);
-           string stateString = "ABORTED";
-           char status[32];
-           strcpy(status, stateString.c_str());
-           IUSaveText(&CurrentStateT[0], status);
-           IDSetText(&CurrentStateTP, NULL);
-	       SetTimer(500);
-           return;
-       }
-
-       // Roll off is opening
-       if (DomeMotionS[DOME_CW].s == ISS_ON)
-       {
-           IDSetText(&CurrentStateTP, "OPENING");
-           if (getFullOpenedLimitSwitch())
-           {
-               DEBUG(INDI::Logger::DBG_SESSION, "Roof is open.");
-               setDomeState(DOME_UNPARKED);
-               DEBUG(INDI::Logger::DBG_SESSION, "Sending ABORT to stop motion");
-               sf->sendStringData((char *)"ABORT");
-               SetParked(false);
-               IUResetSwitch(&ParkSP);
-               ParkS[1].s = ISS_ON;
-               ParkSP.s = IPS_OK;
-               //IDSetSwitch(&ParkSP, NULL);
-               string stateString = "OPEN";
-               char status[32];
-               strcpy(status, stateString.c_str());
-               IUSaveText(&CurrentStateT[0], status);
-               IDSetText(&CurrentStateTP, NULL);
-               return;
-           }
-           if (CalcTimeLeft(MotionStart) <= 0) {
-               DEBUG(INDI::Logger::DBG_SESSION, "Exceeded max motor run duration. Aborting.");
-               Abort();
-           }
-       }
-       // Roll Off is closing
-       else if (DomeMotionS[DOME_CCW].s == ISS_ON)
-       {
-           if (getFullClosedLimitSwitch())
-           {
-                DEBUG(INDI::Logger::DBG_SESSION, "Sending ABORT to stop motion");
-                sf->sendStringData((char *)"ABORT");
-                DEBUG(INDI::Logger::DBG_SESSION, "Roof is closed.");
-                setDomeState(DOME_PARKED);
-                SetParked(true);
-                string stateString = "CLOSED";
-                char status[32];
-                strcpy(status, stateString.c_str());
-                IUSaveText(&CurrentStateT[0], status);
-                IDSetText(&CurrentStateTP, NULL);
-                return;
-           }
-           if (CalcTimeLeft(MotionStart) <= 0) {
-               DEBUG(INDI::Logger::DBG_SESSION, "Exceeded max motor run duration. Aborting.");
-               Abort();
-           }
-       }
-       SetTimer(500);
-   }
+    if (sf == NULL || !binaryProtocol || baudTrialRunning()) return false;
+    int current = sf->getBaud();
+    return baudChanged(roofBusy() && baud != current ? BAUD_RESULT_BUSY : changeBaud(sf, baud), baud, current);
 }
 
-bool AldiRoof::saveConfigItems(FILE *fp)
+/**
+ * The board agrees at the current rate, then both ends switch and the new rate has to carry a confirming round trip. If it
+ * can't, the board drops back to ROOF_DEFAULT_BAUD by itself and so do we. Only talks to board, see openRoofLink().
+ **/
+int AldiRoof::changeBaud(Firmata *board, int baud)
 {
-    return INDI::Dome::saveConfigItems(fp);
+    if (baud == board->getBaud()) return BAUD_RESULT_OK;
+    uint8_t rate[ROOF_BAUD_BYTES];
+    for (int i = 0; i < ROOF_BAUD_BYTES; i++) {
+        rate[i] = (baud >> (7 * i)) & 0x7F;
+    }
+    std::vector<uint8_t> reply;
+    if (!board->requestSysex(ROOF_SYSEX_BAUD, rate, ROOF_BAUD_BYTES, ROOF_SYSEX_BAUD, std::chrono::milliseconds(REPLY_TIMEOUT_MS), reply) ||
+        baudFromSysex(reply) != baud) {
+        return BAUD_RESULT_REFUSED;
+    }
+    if (board->setBaud(baud) == 0) {
+        for (int tries = 0; tries < BAUD_CONFIRM_TRIES; tries++) {
+            if (board->requestSysex(ROOF_SYSEX_BAUD, rate, ROOF_BAUD_BYTES, ROOF_SYSEX_BAUD, std::chrono::milliseconds(REPLY_TIMEOUT_MS), reply) &&
+                baudFromSysex(reply) == baud) {
+                return BAUD_RESULT_OK;
+            }
+        }
+    }
+    board->setBaud(ROOF_DEFAULT_BAUD);
+    return BAUD_RESULT_NO_CONFIRM;
 }
 
 /**
- * Move the roof. Send the command string over frimata to the arduino.
- *
+ * Log the outcome of changeBaud() from rate from, and after a failed confirm keep quiet until the board has given up too.
  **/
-IPState AldiRoof::Move(DomeDirection dir, DomeMotionCommand operation)
+bool AldiRoof::baudChanged(int result, int baud, int from)
 {
-    if (operation == MOTION_START)
-    {
-        updateProperties();
-        // DOME_CW --> OPEN. If can we are ask to "open" while we are fully opened as the limit switch indicates, then we simply return false.
-        if (dir == DOME_CW && fullOpenLimitSwitch == ISS_ON)
-        {
-            DEBUG(INDI::Logger::DBG_WARNING, "Roof is already fully opened.");
-            return IPS_ALERT;
-        }
-        else if (dir == DOME_CCW && INDI::Dome::isLocked())
-        {
-            DEBUG(INDI::Logger::DBG_WARNING, "Cannot close dome when mount is locking. See: Telescope parkng policy, in options tab");
-            return IPS_ALERT;
-        }
-        else if (dir == DOME_CCW && fullClosedLimitSwitch == ISS_ON)
-        {
-            DEBUG(INDI::Logger::DBG_WARNING, "Roof is already fully closed.");
-            return IPS_ALERT;
-        }
-        else if (dir == DOME_CW)
-        {
-            DEBUG(INDI::Logger::DBG_SESSION, "Sending command OPEN");
-            sf->sendStringData((char *)"OPEN");
-        }
-        else if (dir == DOME_CCW)
-        {
-            DEBUG(INDI::Logger::DBG_SESSION, "Sending command CLOSE");
-            sf->sendStringData((char *)"CLOSE");
-        }
-
-        MotionRequest = MAX_ROLLOFF_DURATION;
-        gettimeofday(&MotionStart,NULL);
-        SetTimer(500);
-        DEBUG(INDI::Logger::DBG_SESSION, "return IPS_BUSY");
-        return IPS_BUSY;
+    switch (result) {
+        case BAUD_RESULT_OK:
+            if (baud != from) {
+                DEBUGF(INDI::Logger::DBG_SESSION, "Serial link running at %d baud.", baud);
+            }
+            return true;
+        case BAUD_RESULT_REFUSED:
+            DEBUGF(INDI::Logger::DBG_WARNING, "The arduino won't run the link at %d baud, staying at %d.", baud, from);
+            return false;
+        case BAUD_RESULT_NO_CONFIRM:
+            DEBUGF(INDI::Logger::DBG_WARNING, "No reply at %d baud, going back to %d.", baud, ROOF_DEFAULT_BAUD);
+            // Don't talk to the board until it has given up on the new rate too
+            scheduler.arm(TIMER_BAUD_TRIAL, std::chrono::milliseconds(ROOF_BAUD_TRIAL_MS + REPLY_TIMEOUT_MS));
+            schedule();
+            return false;
+        case BAUD_RESULT_BUSY:
+            DEBUGF(INDI::Logger::DBG_WARNING, "Keeping the link at %d baud while the roof is moving, choose the speed again once it stops.", from);
+            return false;
     }
-    else
-    {
-        DEBUG(INDI::Logger::DBG_SESSION, "WTF WTF ");
-        return (Dome::Abort() ? IPS_OK : IPS_ALERT);
+    return false;
+}
 
-    }
-    DEBUG(INDI::Logger::DBG_SESSION, "return IPS_ALERT");
-    return IPS_ALERT;
+/**
+ * The roof or shutter is moving, or a park is under way.
+ **/
+bool AldiRoof::roofBusy()
+{
+    return DomeMotionSP.s == IPS_BUSY || ParkSP.s == IPS_BUSY || shutterRunning;
+}
 
+/**
+ * True while the board may still be at a rate we failed to confirm.
+ **/
+bool AldiRoof::baudTrialRunning()
+{
+    return scheduler.armed(TIMER_BAUD_TRIAL);
 }
 
 /**
- * Park the roof = close
+ * The board is back at ROOF_DEFAULT_BAUD: send what was held back and read the state afresh.
  **/
-IPState AldiRoof::Park()
+void AldiRoof::baudTrialOver()
 {
-    IPState rc = INDI::Dome::Move(DOME_CCW, MOTION_START);
-    if (rc==IPS_BUSY)
-    {
-        DEBUG(INDI::Logger::DBG_SESSION, "Roll off is parking...");
-        return IPS_BUSY;
+    scheduler.cancel(TIMER_BAUD_TRIAL);
+    std::vector<std::string> commands;
+    commands.swap(deferredCommands);
+    if (!commands.empty()) {
+        // A motion started from a held back command is timed from too early to be learned from
+        motionFullTravel = false;
+    }
+    for (size_t i = 0; i < commands.size() && sf != NULL; i++) {
+        sendCommand(commands[i].c_str());
+    }
+    if (refreshRoofState(true) && DomeMotionSP.s != IPS_BUSY) {
+        SetupParms();
     }
-    else
-        return IPS_ALERT;
 }
 
 /**
- * Unpark the roof = open
+ * Stop the reader and close the serial port.
  **/
-IPState AldiRoof::UnPark()
+void AldiRoof::closeLink()
 {
-    IPState rc = INDI::Dome::Move(DOME_CW, MOTION_START);
-    if (rc==IPS_BUSY) {
-           DEBUG(INDI::Logger::DBG_SESSION, "Roll off is unparking...");
-           return IPS_BUSY;
+    if (roofEventCallbackId >= 0) {
+        IERmCallback(roofEventCallbackId);
+        roofEventCallbackId = -1;
     }
-    else
-      return IPS_ALERT;
+    if (sf != NULL) {
+        sf->stopReader();
+        rxBytesClosed += sf->bytesReceived();
+        txBytesClosed += sf->bytesSent();
+        sf->closePort();
+        delete sf;
+        sf = NULL;
+    }
+    scheduler.cancel(TIMER_BAUD_TRIAL);
+    deferredCommands.clear();
+    invalidateRoofState();
 }
 
 /**
- * Abort motion.
+ * Send a command string to the arduino. A failed write means the link is gone.
  **/
-bool AldiRoof::Abort()
+bool AldiRoof::sendCommand(const char *cmd)
 {
-    DEBUG(INDI::Logger::DBG_SESSION, "Sending command ABORT");
-    sf->sendStringData((char *)"ABORT");
-    MotionRequest=-1;
-
-    // If both limit switches are off, then we're neither parked nor unparked or a hardware failure (cable / rollers / jam).
-    if (getFullOpenedLimitSwitch() == false && getFullClosedLimitSwitch() == false)
-    {
-        IUResetSwitch(&ParkSP);
-        ParkSP.s = IPS_ALERT;
-        IDSetSwitch(&ParkSP, NULL);
+    if (sf == NULL) {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Cannot send %s, arduino link is down", cmd);
+        return false;
     }
-
+    if (baudTrialRunning()) {
+        if (strcmp(cmd, "ABORT") == 0 || strcmp(cmd, "STOP") == 0) {
+            // A stop held back would look sent while the motors ran on. Drop what is held so nothing starts after it either.
+            DEBUGF(INDI::Logger::DBG_ERROR, "Cannot send %s until the arduino is back at %d baud, in %.1f s", cmd, ROOF_DEFAULT_BAUD,
+                   scheduler.remaining(TIMER_BAUD_TRIAL, std::chrono::steady_clock::now()));
+            deferredCommands.clear();
+            return false;
+        }
+        DEBUGF(INDI::Logger::DBG_SESSION, "Holding %s until the arduino is back at %d baud", cmd, ROOF_DEFAULT_BAUD);
+        deferredCommands.push_back(cmd);
+        return true;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint8_t op = binaryProtocol ? roofOpcode(cmd) : 0;
+    int rv = op != 0 ? sf->sendSysex(ROOF_SYSEX_COMMAND, &op, 1) : sf->sendStringData((char *)cmd);
+    if (rv != 0) {
+        logTelemetry(TELEMETRY_COMMAND, telemetry_command_code(cmd), TELEMETRY_FAILED);
+        linkLost("serial write failed");
+        return false;
+    }
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    writeTime.add(elapsed);
+    logTelemetry(TELEMETRY_COMMAND, telemetry_command_code(cmd), TELEMETRY_OK,
+                 std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
     return true;
 }
 
-float AldiRoof::CalcTimeLeft(timeval start)
+/**
+ * Tear down a dead link and start trying to re-open it. Motion in progress keeps being timed so the safety cut out still applies once the link is back.
+ **/
+void AldiRoof::linkLost(const char *reason)
 {
-    double timesince;
-    double timeleft;
-    struct timeval now;
-    gettimeofday(&now,NULL);
+    if (sf == NULL) return;
+    DEBUGF(INDI::Logger::DBG_ERROR, "Lost the arduino link (%s). Reconnecting.", reason);
+    if (weatherClosePending && weatherCloseAttempts > 0) {
+        // The close may have been cut short, it can be made again once the link is back
+        weatherCloseInterrupted = true;
+    }
+    logTelemetry(TELEMETRY_LINK, TELEMETRY_CMD_NONE, TELEMETRY_LOST);
+    closeLink();
+    IUSaveText(&CurrentStateT[0], "LINK LOST");
+    IDSetText(&CurrentStateTP, NULL);
+    publishState();
+    if (reconnectTimerId < 0) {
+        reconnectTimerId = IEAddTimer(reconnectDelay, reconnectCallback, this);
+    }
+}
 
-    timesince=(double)(now.tv_sec * 1000.0 + now.tv_usec/1000) - (double)(start.tv_sec * 1000.0 + start.tv_usec/1000);
-    timesince=timesince/1000;
-    timeleft=MotionRequest-timesince;
-    return timeleft;
+void AldiRoof::reconnectCallback(void *userpointer)
+{
+    static_cast<AldiRoof *>(userpointer)->reconnect();
 }
 
 /**
- * Get the state of the full open limit switch. This function will also switch off the motors as a safety override.
+ * Try to re-open the link, backing off after each failure. The port is opened by name so a board that re-enumerated on the same device node is picked up.
+ * The open and handshake run on linkOpener so the event loop, and any other roofs, carry on meanwhile.
  **/
-bool AldiRoof::getFullOpenedLimitSwitch()
+void AldiRoof::reconnect()
 {
-    DEBUG(INDI::Logger::DBG_SESSION, "Sending QUERY command to determine roof state");
-    sf->sendStringData((char*)"QUERY");
-    sf->OnIdle();
-    DEBUGF(INDI::Logger::DBG_SESSION, "QUERY resp=%s",sf->string_buffer);
-    if (strcmp(sf->string_buffer,"OPEN")==0) {
-        fullOpenLimitSwitch = ISS_ON;
-        return true;
-    } else {
-        DEBUG(INDI::Logger::DBG_SESSION, "Fully open switch OFF");
-        return false;
+    reconnectTimerId = -1;
+    if (!isConnected() || sf != NULL || linkOpener.joinable()) return;
+    prepareLinkOpen(linkOpening);
+    if (linkOpenedFd < 0) {
+        openRoofLink(linkOpening);
+        linkOpened();
+        return;
     }
+    linkOpenedCallbackId = IEAddCallback(linkOpenedFd, linkOpenedCallback, this);
+    linkOpener = std::thread([this]() {
+        openRoofLink(linkOpening);
+        uint64_t one = 1;
+        if (write(linkOpenedFd, &one, sizeof(one)) < 0) perror("AldiRoof::reconnect():write():");
+    });
+}
+
+void AldiRoof::linkOpenedCallback(int fd, void *userpointer)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("AldiRoof::linkOpenedCallback():read():");
+    static_cast<AldiRoof *>(userpointer)->linkOpened();
 }
 
 /**
- * Get the state of the full closed limit switch. This function will also switch off the motors as a safety override.
+ * Back on the event loop with the result of a reconnect attempt.
  **/
-bool AldiRoof::getFullClosedLimitSwitch()
+void AldiRoof::linkOpened()
 {
-    DEBUG(INDI::Logger::DBG_SESSION, "Sending QUERY command to determine roof state");
-    sf->sendStringData((char*)"QUERY");
-    sf->OnIdle();
-    DEBUGF(INDI::Logger::DBG_SESSION, "QUERY resp=%s",sf->string_buffer);
-    if (strcmp(sf->string_buffer,"CLOSED")==0) {
-        fullClosedLimitSwitch = ISS_ON;
+    finishLinkOpen();
+    if (!takeLink(linkOpening)) {
+        reconnectDelay = std::min(reconnectDelay * 2, MAX_RECONNECT_DELAY_MS);
+        DEBUGF(INDI::Logger::DBG_WARNING, "Reconnect failed, retrying in %d s", reconnectDelay / 1000);
+        reconnectTimerId = IEAddTimer(reconnectDelay, reconnectCallback, this);
+        return;
+    }
+    DEBUG(INDI::Logger::DBG_SESSION, "Arduino link re-established.");
+    reconnectDelay = RECONNECT_DELAY_MS;
+    reconnects++;
+    logTelemetry(TELEMETRY_LINK, TELEMETRY_CMD_NONE, TELEMETRY_RESTORED);
+    if (DomeMotionSP.s == IPS_BUSY) {
+        // The motion deadlines kept running and TimerHit will pick up the fresh state
+        refreshRoofState(true);
+    } else {
+        SetupParms();
+    }
+    checkWeatherClose();
+    publishState();
+}
+
+/**
+ * Wait for linkOpener, if it is running, and stop listening for it. Its result is left in linkOpening.
+ **/
+void AldiRoof::finishLinkOpen()
+{
+    if (linkOpenedCallbackId >= 0) {
+        IERmCallback(linkOpenedCallbackId);
+        linkOpenedCallbackId = -1;
+    }
+    if (linkOpener.joinable()) {
+        linkOpener.join();
+    }
+}
+
+AldiRoof::~AldiRoof()
+{
+    finishLinkOpen();
+    delete linkOpening.sf;
+    if (linkOpenedFd >= 0) close(linkOpenedFd);
+}
+
+const char * AldiRoof::getDefaultName()
+{
+        return (char *)"Aldi Roof";
+}
+
+/**
+ * Make this one of several roofs run from the process: device "Aldi Roof <number>", defaulting to the given port.
+ **/
+void AldiRoof::setInstance(int number, const char *port)
+{
+    char name[MAXINDIDEVICE];
+    snprintf(name, sizeof(name), "%s %d", getDefaultName(), number);
+    setDeviceName(name);
+    instance = number;
+    defaultPort = port;
+}
+
+/**
+ * Close every roof run from this process. The CLOSE commands all go out first, then each roof parks as if asked on its
+ * own, so a slow or dead link on one roof doesn't hold up the others. Each roof keeps its own motion timeout.
+ **/
+void AldiRoof::closeAll()
+{
+    for (size_t i = 0; i < roofs.size(); i++) {
+        roofs[i]->sendCloseFirst();
+    }
+    for (size_t i = 0; i < roofs.size(); i++) {
+        if (roofs[i]->isConnected()) {
+            roofs[i]->parkNow();
+        }
+    }
+}
+
+/**
+ * Send the first command of closing straight away, ahead of the property handling parking goes through: CLOSE, or
+ * SHUTTERCLOSE when closing in turn and the shutter has to go first. Park() then carries on from it. Returns false if
+ * nothing was sent because the link is down, the mount is in the way or the roof is already closed.
+ **/
+bool AldiRoof::sendCloseFirst()
+{
+    if (sf == NULL || isLocked() || (roofStateValid && roofClosed)) return false;
+    if (shutterMode() == SHUTTER_IN_TURN && getShutterState() != SHUTTER_CLOSED)
+        return startShutter(SHUTTER_CLOSE);
+    DEBUG(INDI::Logger::DBG_SESSION, "Sending command CLOSE");
+    closeSent = sendCommand("CLOSE");
+    return closeSent;
+}
+
+/**
+ * Park as if asked through the PARK property.
+ **/
+void AldiRoof::parkNow()
+{
+    char *names[] = { ParkS[0].name };
+    ISState states[] = { ISS_ON };
+    INDI::Dome::ISNewSwitch(getDeviceName(), ParkSP.name, states, names, 1);
+    closeSent = false;
+    publishState();
+}
+
+bool AldiRoof::ISNewSwitch (const char *dev, const char *name, ISState *states, char *names[], int n)
+{
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, LinkBaudSP.name) == 0)
+    {
+        if (sf != NULL && roofBusy()) {
+            DEBUG(INDI::Logger::DBG_WARNING, "Cannot change the link speed while the roof or shutter is moving.");
+            LinkBaudSP.s = IPS_ALERT;
+            IDSetSwitch(&LinkBaudSP, NULL);
+            return true;
+        }
+        IUUpdateSwitch(&LinkBaudSP, states, names, n);
+        LinkBaudSP.s = IPS_OK;
+        if (sf != NULL) {
+            if (binaryProtocol) {
+                LinkBaudSP.s = negotiateBaud(selectedBaud()) ? IPS_OK : IPS_ALERT;
+            } else {
+                DEBUG(INDI::Logger::DBG_WARNING, "The arduino firmware is too old to change the link speed.");
+                LinkBaudSP.s = IPS_ALERT;
+            }
+        }
+        IDSetSwitch(&LinkBaudSP, NULL);
+        return true;
+    }
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, ShutterModeSP.name) == 0)
+    {
+        IUUpdateSwitch(&ShutterModeSP, states, names, n);
+        ShutterModeSP.s = IPS_OK;
+        if (IUFindOnSwitchIndex(&ShutterModeSP) == SHUTTER_OVERLAP && sf != NULL && !canStopRoofOnly()) {
+            DEBUG(INDI::Logger::DBG_WARNING, "The arduino firmware is too old to stop the roof without the shutter, moving them in turn.");
+        }
+        IDSetSwitch(&ShutterModeSP, NULL);
+        return true;
+    }
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, CloseAllSP.name) == 0)
+    {
+        DEBUG(INDI::Logger::DBG_SESSION, "Closing all roofs.");
+        closeAll();
+        IUResetSwitch(&CloseAllSP);
+        CloseAllSP.s = IPS_OK;
+        IDSetSwitch(&CloseAllSP, NULL);
+        return true;
+    }
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, WeatherCloseSP.name) == 0)
+    {
+        IUUpdateSwitch(&WeatherCloseSP, states, names, n);
+        WeatherCloseSP.s = IPS_OK;
+        IDSetSwitch(&WeatherCloseSP, NULL);
+        // Enabled while the weather device is already in alert
+        if (WeatherCloseS[0].s == ISS_ON && weatherAlert) {
+            weatherAlertTime = std::chrono::steady_clock::now();
+            weatherClose(false);
+        }
+        return true;
+    }
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, LowLatencySP.name) == 0)
+    {
+        IUUpdateSwitch(&LowLatencySP, states, names, n);
+        LowLatencySP.s = IPS_OK;
+        IDSetSwitch(&LowLatencySP, sf != NULL ? "Takes effect when the arduino link is next opened." : NULL);
+        return true;
+    }
+	bool handled = INDI::Dome::ISNewSwitch(dev, name, states, names, n);
+	if (dev != NULL && strcmp(dev, getDeviceName()) == 0) {
+	    // Motion, park and shutter commands change the state once the dome has taken them
+	    publishState();
+	}
+	return handled;
+}
+
+bool AldiRoof::ISNewNumber (const char *dev, const char *name, double values[], char *names[], int n)
+{
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, StateCacheNP.name) == 0)
+    {
+        IUUpdateNumber(&StateCacheNP, values, names, n);
+        StateCacheNP.s = IPS_OK;
+        IDSetNumber(&StateCacheNP, NULL);
+        return true;
+    }
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, TravelModelNP.name) == 0)
+    {
+        // Restored from the config file, or edited by hand to reset the model
+        IUUpdateNumber(&TravelModelNP, values, names, n);
+        for (int dir = 0; dir < 2; dir++) {
+            for (int band = 0; band < TRAVEL_BANDS; band++) {
+                INumber *np = &TravelModelN[(dir * TRAVEL_BANDS + band) * 3];
+                travel_stats_t &stats = travelModel.stats(dir, band);
+                stats.n = np[0].value;
+                stats.mean = np[1].value;
+                stats.m2 = stats.n > 1 ? np[2].value * np[2].value * (stats.n - 1) : 0;
+            }
+        }
+        TravelModelNP.s = IPS_OK;
+        IDSetNumber(&TravelModelNP, NULL);
+        return true;
+    }
+	return INDI::Dome::ISNewNumber(dev, name, values, names, n);
+}
+
+bool AldiRoof::ISNewText (const char *dev, const char *name, char *texts[], char *names[], int n)
+{
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, WeatherDeviceTP.name) == 0)
+    {
+        IUUpdateText(&WeatherDeviceTP, texts, names, n);
+        WeatherDeviceTP.s = IPS_OK;
+        IDSetText(&WeatherDeviceTP, NULL);
+        snoopWeather();
+        return true;
+    }
+    if (dev != NULL && strcmp(dev, getDeviceName()) == 0 && strcmp(name, TelemetryFileTP.name) == 0)
+    {
+        IUUpdateText(&TelemetryFileTP, texts, names, n);
+        if (isConnected()) {
+            openTelemetry();
+        }
+        IDSetText(&TelemetryFileTP, NULL);
+        return true;
+    }
+	return INDI::Dome::ISNewText(dev, name, texts, names, n);
+}
+
+
+bool AldiRoof::updateProperties()
+{
+    DEBUG(INDI::Logger::DBG_DEBUG, "Updating props");
+    INDI::Dome::updateProperties();
+
+    if (isConnected())
+    {
+        SetupParms();
+        defineProperty(&CurrentStateTP);
+        defineProperty(&StateCacheNP);
+        defineProperty(&LinkStatsNP);
+        defineProperty(&TravelModelNP);
+        defineProperty(&WeatherDeviceTP);
+        defineProperty(&WeatherCloseSP);
+        defineProperty(&TelemetryFileTP);
+        defineProperty(&LinkBaudSP);
+        defineProperty(&ShutterModeSP);
+        if (roofs.size() > 1) {
+            defineProperty(&CloseAllSP);
+        }
+    } else
+    {
+	deleteProperty(CurrentStateTP.name);
+	deleteProperty(StateCacheNP.name);
+	deleteProperty(LinkStatsNP.name);
+	deleteProperty(TravelModelNP.name);
+	deleteProperty(WeatherDeviceTP.name);
+	deleteProperty(WeatherCloseSP.name);
+	deleteProperty(TelemetryFileTP.name);
+	deleteProperty(LinkBaudSP.name);
+	deleteProperty(ShutterModeSP.name);
+	if (roofs.size() > 1) {
+	    deleteProperty(CloseAllSP.name);
+	}
+    }
+
+    return true;
+}
+
+/**
+* Disconnect from the arduino
+**/
+bool AldiRoof::Disconnect()
+{
+    if (reconnectTimerId >= 0) {
+        IERmTimer(reconnectTimerId);
+        reconnectTimerId = -1;
+    }
+    // A reconnect attempt part way through the handshake is seen out, then dropped
+    finishLinkOpen();
+    delete linkOpening.sf;
+    linkOpening.sf = NULL;
+    if (statsTimerId >= 0) {
+        IERmTimer(statsTimerId);
+        statsTimerId = -1;
+    }
+    scheduler.cancelAll();
+    schedule();
+    shutterRunning = false;
+    openShutterAfterRoof = false;
+    parkAfterShutter = false;
+    closeLink();
+    telemetry.close();
+    // Readers still mapping the segment see the link down, new ones find no driver
+    publishState();
+    roofstate_destroy(sharedState, sharedStateName.c_str());
+    sharedState = NULL;
+    DEBUG(INDI::Logger::DBG_SESSION, "ARDUINO BOARD DISCONNECTED.");
+    return true;
+}
+
+/**
+ * (Re)arm the INDI timer for the earliest scheduler deadline.
+ */
+void AldiRoof::schedule()
+{
+    if (timerId >= 0) {
+        RemoveTimer(timerId);
+        timerId = -1;
+    }
+    int delay = scheduler.nextDelayMs(std::chrono::steady_clock::now());
+    if (delay >= 0) {
+        timerId = SetTimer(delay);
+    }
+}
+
+/**
+ * TimerHit gets called when the earliest scheduler deadline is reached: the motor safety timeout, the next poll or a settle delay.
+ */
+void AldiRoof::TimerHit()
+{
+    timerId = -1;
+    DEBUG(INDI::Logger::DBG_DEBUG, "Timer hit");
+    if(isConnected() == false) {  //  No need to reset timer if we are not connected anymore
+        scheduler.cancelAll();
+        return;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    // Before the motion timeout, so an ABORT due at the same time gets through
+    if (scheduler.expired(TIMER_BAUD_TRIAL, now)) {
+        baudTrialOver();
+    }
+
+    if (scheduler.expired(TIMER_MOTION_TIMEOUT, now)) {
+        scheduler.cancel(TIMER_MOTION_TIMEOUT);
+        DEBUG(INDI::Logger::DBG_SESSION, "Exceeded max motor run duration. Aborting.");
+        if (!Abort() && baudTrialRunning()) {
+            // Try again as soon as the arduino is back at the default rate
+            scheduler.arm(TIMER_MOTION_TIMEOUT, std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                          std::chrono::duration<double>(scheduler.remaining(TIMER_BAUD_TRIAL, now))));
+        } else {
+            logTelemetry(TELEMETRY_MOTION_END, TELEMETRY_CMD_NONE, TELEMETRY_TIMED_OUT);
+        }
+    }
+
+    if (scheduler.expired(TIMER_POLL, now)) {
+        if (DomeMotionSP.s == IPS_BUSY) {
+            // One QUERY per tick, shared by every limit switch check below
+            refreshRoofState(true);
+            if (checkMotion()) {
+                scheduler.arm(TIMER_POLL, std::chrono::milliseconds(motionPollInterval()));
+            } else {
+                motionFinished();
+            }
+        } else {
+            idlePoll();
+            scheduler.arm(TIMER_POLL, std::chrono::milliseconds(shutterRunning ? MOTION_POLL_MS : IDLE_POLL_MS));
+        }
+        // The same QUERY carried the shutter state
+        checkShutter();
+        tickTime.add(std::chrono::steady_clock::now() - now);
+    }
+
+    if (scheduler.expired(TIMER_SHUTTER_TIMEOUT, now)) {
+        scheduler.cancel(TIMER_SHUTTER_TIMEOUT);
+        if (shutterRunning) {
+            DEBUGF(INDI::Logger::DBG_WARNING, "The shutter hasn't reported the end of its run after %d s.", SHUTTER_RUN_S + SHUTTER_TIMEOUT_MARGIN_S);
+            shutterRunning = false;
+            logTelemetry(TELEMETRY_MOTION_END, shutterCommand == SHUTTER_OPEN ? TELEMETRY_CMD_SHUTTER_OPEN : TELEMETRY_CMD_SHUTTER_CLOSE,
+                         TELEMETRY_TIMED_OUT);
+            setShutterState(SHUTTER_UNKNOWN);
+            if (parkAfterShutter) {
+                parkAfterShutter = false;
+                ParkSP.s = IPS_ALERT;
+                IDSetSwitch(&ParkSP, NULL);
+            }
+        }
+    }
+
+    if (scheduler.expired(TIMER_SETTLE, now)) {
+        scheduler.cancel(TIMER_SETTLE);
+        refreshRoofState(true);
+        SetupParms();
+    }
+
+    checkWeatherClose();
+    publishState();
+    schedule();
+}
+
+/**
+ * How long until the next QUERY while moving: slow through the bulk of the travel, fast as the end approaches.
+ */
+int AldiRoof::motionPollInterval()
+{
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - motionStart).count();
+    double untilWindow = fastPollFrom - elapsed;
+    if (untilWindow <= 0) {
+        return END_OF_TRAVEL_POLL_MS;
+    }
+    // Don't sleep past the start of the fast polling window
+    return std::max(END_OF_TRAVEL_POLL_MS, std::min(MOTION_POLL_MS, (int)(untilWindow * 1000)));
+}
+
+/**
+ * Motion has stopped: drop the safety timeout, go back to the idle poll rate and re-read the state once things have settled.
+ */
+void AldiRoof::motionFinished()
+{
+    scheduler.cancel(TIMER_MOTION_TIMEOUT);
+    scheduler.arm(TIMER_POLL, std::chrono::milliseconds(shutterRunning ? MOTION_POLL_MS : IDLE_POLL_MS));
+    scheduler.arm(TIMER_SETTLE, std::chrono::milliseconds(LIMIT_SETTLE_MS));
+    schedule();
+}
+
+/**
+ * Check the roof at rest. Keeps the link supervised and catches the roof being moved by hand.
+ */
+void AldiRoof::idlePoll()
+{
+    bool wasOpen = roofOpen;
+    bool wasClosed = roofClosed;
+    if (refreshRoofState(true) && (roofOpen != wasOpen || roofClosed != wasClosed)) {
+        SetupParms();
+    }
+}
+
+/**
+ * Act on the current roof state while the roof is moving. Called from the timer and whenever the arduino pushes a state change.
+ * Returns true if the motion still needs to be monitored.
+ */
+bool AldiRoof::checkMotion()
+{
+    // Abort called
+    if (MotionRequest < 0)
+    {
+        DEBUG(INDI::Logger::DBG_SESSION, "Roof motion is stopped.");
+        logTelemetry(TELEMETRY_MOTION_END, TELEMETRY_CMD_NONE, TELEMETRY_ABORTED);
+        setDomeState(DOME_IDLE);
+        string stateString = "ABORTED";
+        char status[32];
+        strcpy(status, stateString.c_str());
+        IUSaveText(&CurrentStateT[0], status);
+        IDSetText(&CurrentStateTP, NULL);
+        return false;
+    }
+
+    // Roll off is opening
+    if (DomeMotionS[DOME_CW].s == ISS_ON)
+    {
+        IDSetText(&CurrentStateTP, "OPENING");
+        if (getFullOpenedLimitSwitch())
+        {
+            DEBUG(INDI::Logger::DBG_SESSION, "Roof is open.");
+            logTelemetry(TELEMETRY_MOTION_END, TELEMETRY_CMD_NONE, TELEMETRY_OPENED);
+            recordTravel();
+            setDomeState(DOME_UNPARKED);
+            stopRoof();
+            SetParked(false);
+            IUResetSwitch(&ParkSP);
+            ParkS[1].s = ISS_ON;
+            ParkSP.s = IPS_OK;
+            //IDSetSwitch(&ParkSP, NULL);
+            string stateString = "OPEN";
+            char status[32];
+            strcpy(status, stateString.c_str());
+            IUSaveText(&CurrentStateT[0], status);
+            IDSetText(&CurrentStateTP, NULL);
+            if (openShutterAfterRoof) {
+                openShutterAfterRoof = false;
+                startShutter(SHUTTER_OPEN);
+            }
+            return false;
+        }
+    }
+    // Roll Off is closing
+    else if (DomeMotionS[DOME_CCW].s == ISS_ON)
+    {
+        if (getFullClosedLimitSwitch())
+        {
+             stopRoof();
+             DEBUG(INDI::Logger::DBG_SESSION, "Roof is closed.");
+             logTelemetry(TELEMETRY_MOTION_END, TELEMETRY_CMD_NONE, TELEMETRY_CLOSED);
+             recordTravel();
+             setDomeState(DOME_PARKED);
+             SetParked(true);
+             string stateString = "CLOSED";
+             char status[32];
+             strcpy(status, stateString.c_str());
+             IUSaveText(&CurrentStateT[0], status);
+             IDSetText(&CurrentStateTP, NULL);
+             return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Stop the roof motors at a limit switch. ABORT would stop the shutter too, so while it is running only the roof is stopped.
+ * Firmware without STOP gets ABORT and the shutter run is started again.
+ **/
+void AldiRoof::stopRoof()
+{
+    if (shutterRunning && canStopRoofOnly()) {
+        DEBUG(INDI::Logger::DBG_SESSION, "Sending STOP to stop motion");
+        sendCommand("STOP");
+        return;
+    }
+    DEBUG(INDI::Logger::DBG_SESSION, "Sending ABORT to stop motion");
+    sendCommand("ABORT");
+    if (shutterRunning) {
+        shutterRunning = false;
+        startShutter(shutterCommand);
+    }
+}
+
+bool AldiRoof::saveConfigItems(FILE *fp)
+{
+    IUSaveConfigNumber(fp, &StateCacheNP);
+    IUSaveConfigNumber(fp, &TravelModelNP);
+    IUSaveConfigText(fp, &WeatherDeviceTP);
+    IUSaveConfigSwitch(fp, &WeatherCloseSP);
+    IUSaveConfigText(fp, &TelemetryFileTP);
+    IUSaveConfigSwitch(fp, &LinkBaudSP);
+    IUSaveConfigSwitch(fp, &LowLatencySP);
+    IUSaveConfigSwitch(fp, &ShutterModeSP);
+    return INDI::Dome::saveConfigItems(fp);
+}
+
+/**
+ * Move the roof. Send the command string over frimata to the arduino.
+ *
+ **/
+IPState AldiRoof::Move(DomeDirection dir, DomeMotionCommand operation)
+{
+    if (operation == MOTION_START)
+    {
+        updateProperties();
+        // DOME_CW --> OPEN. If can we are ask to "open" while we are fully opened as the limit switch indicates, then we simply return false.
+        if (dir == DOME_CW && fullOpenLimitSwitch == ISS_ON)
+        {
+            DEBUG(INDI::Logger::DBG_WARNING, "Roof is already fully opened.");
+            return IPS_ALERT;
+        }
+        else if (dir == DOME_CCW && INDI::Dome::isLocked())
+        {
+            DEBUG(INDI::Logger::DBG_WARNING, "Cannot close dome when mount is locking. See: Telescope parkng policy, in options tab");
+            return IPS_ALERT;
+        }
+        else if (dir == DOME_CCW && fullClosedLimitSwitch == ISS_ON)
+        {
+            DEBUG(INDI::Logger::DBG_WARNING, "Roof is already fully closed.");
+            return IPS_ALERT;
+        }
+        else if (dir == DOME_CW)
+        {
+            DEBUG(INDI::Logger::DBG_SESSION, "Sending command OPEN");
+            if (!sendCommand("OPEN"))
+                return IPS_ALERT;
+        }
+        else if (dir == DOME_CCW && closeSent)
+        {
+            DEBUG(INDI::Logger::DBG_SESSION, "CLOSE already sent");
+        }
+        else if (dir == DOME_CCW)
+        {
+            DEBUG(INDI::Logger::DBG_SESSION, "Sending command CLOSE");
+            if (!sendCommand("CLOSE"))
+                return IPS_ALERT;
+        }
+
+        invalidateRoofState();
+        MotionRequest = MAX_ROLLOFF_DURATION;
+        startMotionTiming(dir);
+        scheduler.arm(TIMER_POLL, std::chrono::milliseconds(motionPollInterval()));
+        scheduler.cancel(TIMER_SETTLE);
+        schedule();
+        DEBUG(INDI::Logger::DBG_SESSION, "return IPS_BUSY");
+        return IPS_BUSY;
+    }
+    else
+    {
+        DEBUG(INDI::Logger::DBG_SESSION, "WTF WTF ");
+        return (Dome::Abort() ? IPS_OK : IPS_ALERT);
+
+    }
+    DEBUG(INDI::Logger::DBG_SESSION, "return IPS_ALERT");
+    return IPS_ALERT;
+
+}
+
+/**
+ * Start timing a motion: predict when the far limit switch will be reached, set the motor cut out from that and poll fast
+ * only around the predicted arrival. Until the model has enough runs the fixed MAX_ROLLOFF_DURATION applies.
+ **/
+void AldiRoof::startMotionTiming(DomeDirection dir)
+{
+    motionStart = std::chrono::steady_clock::now();
+    motionDir = dir == DOME_CW ? TRAVEL_OPEN : TRAVEL_CLOSE;
+    haveArrival = false;
+    // SetupParms() has just refreshed the limit switches
+    motionFullTravel = dir == DOME_CW ? fullClosedLimitSwitch == ISS_ON : fullOpenLimitSwitch == ISS_ON;
+
+    double timeout = MAX_ROLLOFF_DURATION;
+    havePrediction = travelModel.predict(motionDir, currentTemperature(), predictedMean, predictedSd);
+    if (havePrediction) {
+        // Never looser than the fixed cut out
+        timeout = std::min(timeout, predictedMean + std::max(4 * predictedSd, (double)TRAVEL_TIMEOUT_MARGIN_S));
+        fastPollFrom = predictedMean - std::max(3 * predictedSd, 1.0);
+        DEBUGF(INDI::Logger::DBG_SESSION, "Expecting the roof to %s in %.1f s (sd %.1f s), motors cut out after %.1f s",
+               motionDir == TRAVEL_OPEN ? "open" : "close", predictedMean, predictedSd, timeout);
+    } else {
+        fastPollFrom = EXPECTED_TRAVEL_S - END_OF_TRAVEL_WINDOW_S;
+    }
+    scheduler.arm(TIMER_MOTION_TIMEOUT,
+                  std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout)));
+}
+
+/**
+ * Learn from a motion that just reached its limit switch, and warn if it was unusually slow. Timed to the switch edge
+ * when the board reported it, otherwise to now.
+ **/
+void AldiRoof::recordTravel()
+{
+    if (!motionFullTravel) return;  // started part way, says nothing about the full travel time
+    std::chrono::steady_clock::time_point end = haveArrival ? arrivalTime : std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - motionStart).count();
+    if (havePrediction && seconds > predictedMean + std::max(3 * predictedSd, TRAVEL_DRIFT_MIN_S)) {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Roof took %.1f s to %s, usually %.1f s (sd %.1f s). Check the hoist and rails for wear or ice.",
+               seconds, motionDir == TRAVEL_OPEN ? "open" : "close", predictedMean, predictedSd);
+    }
+    travelModel.add(motionDir, currentTemperature(), seconds);
+    motionFullTravel = false;
+    publishTravelModel();
+    saveConfig(true, TravelModelNP.name);
+}
+
+/**
+ * Copy the travel model into its property.
+ **/
+void AldiRoof::publishTravelModel()
+{
+    for (int dir = 0; dir < 2; dir++) {
+        for (int band = 0; band < TRAVEL_BANDS; band++) {
+            INumber *np = &TravelModelN[(dir * TRAVEL_BANDS + band) * 3];
+            const travel_stats_t &stats = travelModel.stats(dir, band);
+            np[0].value = stats.n;
+            np[1].value = stats.mean;
+            np[2].value = stats.n > 1 ? sqrt(stats.m2 / (stats.n - 1)) : 0;
+        }
+    }
+    TravelModelNP.s = IPS_OK;
+    IDSetNumber(&TravelModelNP, NULL);
+}
+
+/**
+ * Park the roof = close
+ **/
+IPState AldiRoof::Park()
+{
+    if (shutterMode() == SHUTTER_IN_TURN && getShutterState() != SHUTTER_CLOSED)
+    {
+        // The roof closes last, checkShutter() starts it once the shutter is closed
+        if (!startShutter(SHUTTER_CLOSE))
+            return IPS_ALERT;
+        parkAfterShutter = true;
+        DEBUG(INDI::Logger::DBG_SESSION, "Closing the shutter before the roof...");
+        return IPS_BUSY;
+    }
+    IPState rc = INDI::Dome::Move(DOME_CCW, MOTION_START);
+    if (rc==IPS_BUSY)
+    {
+        if (shutterMode() == SHUTTER_OVERLAP && getShutterState() != SHUTTER_CLOSED)
+            startShutter(SHUTTER_CLOSE);
+        DEBUG(INDI::Logger::DBG_SESSION, "Roll off is parking...");
+        return IPS_BUSY;
+    }
+    else
+        return IPS_ALERT;
+}
+
+/**
+ * Unpark the roof = open
+ **/
+IPState AldiRoof::UnPark()
+{
+    IPState rc = INDI::Dome::Move(DOME_CW, MOTION_START);
+    if (rc==IPS_BUSY) {
+           // In turn, the shutter opens once the roof is open
+           if (shutterMode() == SHUTTER_OVERLAP && getShutterState() != SHUTTER_OPENED)
+               startShutter(SHUTTER_OPEN);
+           else if (shutterMode() == SHUTTER_IN_TURN && getShutterState() != SHUTTER_OPENED)
+               openShutterAfterRoof = true;
+           DEBUG(INDI::Logger::DBG_SESSION, "Roll off is unparking...");
+           return IPS_BUSY;
+    }
+    else
+      return IPS_ALERT;
+}
+
+/**
+ * Abort motion.
+ **/
+bool AldiRoof::Abort()
+{
+    DEBUG(INDI::Logger::DBG_SESSION, "Sending command ABORT");
+    bool sent = sendCommand("ABORT");
+    if (!sent && sf != NULL) {
+        // Refused during a baud trial. The roof is still moving, so keep following it.
+        return false;
+    }
+    // With the link down the board's own cut outs are all there is, stop timing the motion
+    MotionRequest=-1;
+    // ABORT stops the shutter as well. The limit switch checks below re-read its state.
+    openShutterAfterRoof = false;
+    parkAfterShutter = false;
+    if (shutterRunning) {
+        shutterRunning = false;
+        scheduler.cancel(TIMER_SHUTTER_TIMEOUT);
+        invalidateRoofState();
+    }
+    // Let the next tick report the stop straight away
+    if (DomeMotionSP.s == IPS_BUSY) {
+        scheduler.arm(TIMER_POLL, std::chrono::milliseconds(0));
+        schedule();
+    }
+
+    // If both limit switches are off, then we're neither parked nor unparked or a hardware failure (cable / rollers / jam).
+    if (getFullOpenedLimitSwitch() == false && getFullClosedLimitSwitch() == false)
+    {
+        IUResetSwitch(&ParkSP);
+        ParkSP.s = IPS_ALERT;
+        IDSetSwitch(&ParkSP, NULL);
+    }
+
+    return sent;
+}
+
+/**
+ * Open or close the shutter on its own.
+ **/
+IPState AldiRoof::ControlShutter(ShutterOperation operation)
+{
+    return startShutter(operation) ? IPS_BUSY : IPS_ALERT;
+}
+
+/**
+ * The firmware has STOP, which stops the roof without stopping the shutter. It says so in the features byte of its status
+ * frames, the first binary firmware doesn't.
+ **/
+bool AldiRoof::canStopRoofOnly()
+{
+    return binaryProtocol && (firmwareFeatures & ROOF_FEATURE_STOP);
+}
+
+/**
+ * How the shutter moves when the roof is parked or unparked: not at all, in turn with the roof (the roof opens first and
+ * closes last), or at the same time. Overlapping needs STOP to stop the roof at a limit while the shutter runs on.
+ **/
+int AldiRoof::shutterMode()
+{
+    int mode = IUFindOnSwitchIndex(&ShutterModeSP);
+    if (mode == SHUTTER_OVERLAP && !canStopRoofOnly())
+        return SHUTTER_IN_TURN;
+    return mode < 0 ? SHUTTER_SEPARATE : mode;
+}
+
+/**
+ * Start a shutter run and follow it until the board reports it over. The shutter state comes with every QUERY, so no
+ * extra polling is needed while the roof moves too.
+ **/
+bool AldiRoof::startShutter(ShutterOperation operation)
+{
+    if (shutterRunning && shutterCommand == operation)
+        return true;
+    const char *cmd = operation == SHUTTER_OPEN ? "SHUTTEROPEN" : "SHUTTERCLOSE";
+    DEBUGF(INDI::Logger::DBG_SESSION, "Sending command %s", cmd);
+    shutterStart = std::chrono::steady_clock::now();
+    if (!sendCommand(cmd))
+        return false;
+    shutterRunning = true;
+    shutterSeenMoving = false;
+    shutterCommand = operation;
+    IUResetSwitch(&DomeShutterSP);
+    DomeShutterS[operation].s = ISS_ON;
+    setShutterState(SHUTTER_MOVING);
+    scheduler.arm(TIMER_SHUTTER_TIMEOUT, std::chrono::seconds(SHUTTER_RUN_S + SHUTTER_TIMEOUT_MARGIN_S));
+    if (DomeMotionSP.s != IPS_BUSY)
+        scheduler.arm(TIMER_POLL, std::chrono::milliseconds(MOTION_POLL_MS));
+    schedule();
+    return true;
+}
+
+/**
+ * Update the shutter from a SHUTTERQUERY reply or pushed shutter string. Returns false if the string is not a shutter state.
+ **/
+bool AldiRoof::setShutterReply(const char *state)
+{
+    ShutterState shutter;
+    if (strcmp(state, "SHUTTEROPEN") == 0)
+        shutter = SHUTTER_OPENED;
+    else if (strcmp(state, "SHUTTERCLOSED") == 0)
+        shutter = SHUTTER_CLOSED;
+    else if (strcmp(state, "SHUTTERUNKNOWN") == 0)
+        shutter = SHUTTER_MOVING;   // the board only loses track while the actuator runs
+    else
+        return false;
+    if (shutterRunning && !shutterSeenMoving) {
+        // Until the board reports the run, what it says predates our command
+        if (shutter != SHUTTER_MOVING)
+            return true;
+        shutterSeenMoving = true;
+    }
+    if (shutter != getShutterState())
+        setShutterState(shutter);
+    return true;
+}
+
+/**
+ * Notice the end of a shutter run and start whatever was waiting for it. Called after each poll and shutter push.
+ **/
+void AldiRoof::checkShutter()
+{
+    if (!shutterRunning || getShutterState() == SHUTTER_MOVING)
+        return;
+    shutterRunning = false;
+    scheduler.cancel(TIMER_SHUTTER_TIMEOUT);
+    bool closed = getShutterState() == SHUTTER_CLOSED;
+    logTelemetry(TELEMETRY_MOTION_END, shutterCommand == SHUTTER_OPEN ? TELEMETRY_CMD_SHUTTER_OPEN : TELEMETRY_CMD_SHUTTER_CLOSE,
+                 closed ? TELEMETRY_CLOSED : TELEMETRY_OPENED);
+    if (!parkAfterShutter)
+        return;
+    parkAfterShutter = false;
+    if (closed && getFullClosedLimitSwitch()) {
+        SetParked(true);
+        return;
+    }
+    if (closed) {
+        DEBUG(INDI::Logger::DBG_SESSION, "Shutter is closed, closing the roof.");
+        if (INDI::Dome::Move(DOME_CCW, MOTION_START) == IPS_BUSY)
+            return;
+    }
+    ParkSP.s = IPS_ALERT;
+    IDSetSwitch(&ParkSP, NULL);
+}
+
+/**
+ * Get the state of the full open limit switch. This function will also switch off the motors as a safety override.
+ **/
+bool AldiRoof::getFullOpenedLimitSwitch()
+{
+    refreshRoofState(false);
+    if (roofOpen) {
+        fullOpenLimitSwitch = ISS_ON;
         return true;
     } else {
-        DEBUG(INDI::Logger::DBG_SESSION, "Fully Closed switch OFF");
+        DEBUG(INDI::Logger::DBG_DEBUG, "Fully open switch OFF");
         return false;
     }
 }
+
+/**
+ * Get the state of the full closed limit switch. This function will also switch off the motors as a safety override.
+ **/
+bool AldiRoof::getFullClosedLimitSwitch()
+{
+    refreshRoofState(false);
+    if (roofClosed) {
+        fullClosedLimitSwitch = ISS_ON;
+        return true;
+    } else {
+        DEBUG(INDI::Logger::DBG_DEBUG, "Fully Closed switch OFF");
+        return false;
+    }
+}
+
+/**
+ * Send QUERY to the arduino and wait for the matching reply.
+ **/
+bool AldiRoof::queryRoof(string &reply)
+{
+    if (sf == NULL || baudTrialRunning()) {
+        return false;
+    }
+    DEBUG(INDI::Logger::DBG_DEBUG, "Sending QUERY command to determine roof state");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool answered;
+    if (binaryProtocol) {
+        std::vector<uint8_t> status;
+        uint8_t op = ROOF_OP_QUERY;
+        answered = sf->requestSysex(ROOF_SYSEX_COMMAND, &op, 1, ROOF_SYSEX_STATUS, std::chrono::milliseconds(REPLY_TIMEOUT_MS), status);
+        if (answered) {
+            reply = roofStatusString(status[0]);
+            setShutterReply(shutterStatusString(status[0]));
+        }
+    } else {
+        // Both questions go out together so the shutter costs no extra round trip
+        firmata_request_t roofRequest = sf->sendRequest("QUERY");
+        firmata_request_t shutterRequest = sf->sendRequest("SHUTTERQUERY");
+        answered = sf->waitReply(roofRequest, std::chrono::milliseconds(REPLY_TIMEOUT_MS), reply);
+        string shutterReply;
+        if (sf->waitReply(shutterRequest, std::chrono::milliseconds(answered ? REPLY_TIMEOUT_MS : 0), shutterReply)) {
+            setShutterReply(shutterReply.c_str());
+        }
+    }
+    if (!answered) {
+        DEBUG(INDI::Logger::DBG_WARNING, "No reply to QUERY from the arduino");
+        queryTimeouts++;
+        logTelemetry(TELEMETRY_QUERY, TELEMETRY_CMD_QUERY, TELEMETRY_FAILED);
+        if (sf->linkLost()) {
+            linkLost("serial write failed");
+        } else if (++replyTimeouts >= MAX_REPLY_TIMEOUTS) {
+            linkLost("no reply to QUERY");
+        }
+        return false;
+    }
+    std::chrono::steady_clock::duration rtt = std::chrono::steady_clock::now() - start;
+    queryRtt.add(rtt);
+    lastQueryRttUs = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+    replyTimeouts = 0;
+    DEBUGF(INDI::Logger::DBG_DEBUG, "QUERY resp=%s",reply.c_str());
+    return true;
+}
+
+/**
+ * Refresh the cached roof state from a single QUERY unless the last reply is younger than the status cache max age.
+ * Returns false if the arduino did not answer, in which case both limit switches read as off.
+ * An idle poll that finds nothing new isn't recorded in the telemetry, it would soon fill the ring.
+ **/
+bool AldiRoof::refreshRoofState(bool force)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!force && roofStateValid &&
+        now - roofStateTime < std::chrono::milliseconds((long)StateCacheN[0].value))
+    {
+        return true;
+    }
+    string reply;
+    if (!queryRoof(reply)) {
+        roofStateValid = false;
+        roofOpen = false;
+        roofClosed = false;
+        return false;
+    }
+    bool wasValid = roofStateValid;
+    bool wasOpen = roofOpen;
+    bool wasClosed = roofClosed;
+    bool known = setRoofState(reply.c_str());
+    if (DomeMotionSP.s == IPS_BUSY || shutterRunning || !wasValid || roofOpen != wasOpen || roofClosed != wasClosed) {
+        logTelemetry(TELEMETRY_QUERY, TELEMETRY_CMD_QUERY, TELEMETRY_OK, lastQueryRttUs);
+    }
+    return known;
+}
+
+/**
+ * Update the cached roof state from a QUERY reply or pushed state string. Returns false if the string is not a roof state.
+ **/
+bool AldiRoof::setRoofState(const char *state)
+{
+    if (strcmp(state, "OPEN") != 0 && strcmp(state, "CLOSED") != 0 && strcmp(state, "UNKNOWN") != 0) {
+        return false;
+    }
+    roofOpen = strcmp(state, "OPEN") == 0;
+    roofClosed = strcmp(state, "CLOSED") == 0;
+    roofStateValid = true;
+    roofStateTime = std::chrono::steady_clock::now();
+    return true;
+}
+
+/**
+ * Called from the INDI event loop when the serial reader has queued messages the arduino sent without being asked.
+ **/
+void AldiRoof::roofEventCallback(int fd, void *userpointer)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("AldiRoof::roofEventCallback():read():");
+    }
+    static_cast<AldiRoof *>(userpointer)->handleRoofEvents();
+}
+
+/**
+ * Apply pushed state changes straight away rather than waiting for the next poll.
+ **/
+void AldiRoof::handleRoofEvents()
+{
+    if (sf == NULL) return;
+    if (sf->linkLost()) {
+        linkLost("serial read failed");
+        return;
+    }
+    handleRoofMessages();
+    publishState();
+}
+
+/**
+ * Drain the messages queued by the reader and act on them.
+ **/
+void AldiRoof::handleRoofMessages()
+{
+    firmata_msg_t msg;
+    bool changed = false;
+    bool shutterChanged = false;
+    while (sf->popMessage(msg)) {
+        const char *state = NULL;
+        const char *shutter = NULL;
+        if (msg.command == FIRMATA_STRING_DATA) {
+            state = msg.text;
+            shutter = msg.text;
+        } else if (msg.command == FIRMATA_START_SYSEX && msg.port == ROOF_SYSEX_STATUS && msg.len >= 1) {
+            state = roofStatusString(msg.data[0]);
+            shutter = shutterStatusString(msg.data[0]);
+        } else if (msg.command == FIRMATA_START_SYSEX && msg.port == ROOF_SYSEX_EDGE && msg.len >= ROOF_EDGE_BYTES) {
+            handleLimitEdge(msg);
+        }
+        if (state != NULL && setRoofState(state)) {
+            DEBUGF(INDI::Logger::DBG_DEBUG, "Roof state pushed: %s", state);
+            logTelemetry(TELEMETRY_PUSH, TELEMETRY_CMD_NONE, TELEMETRY_OK);
+            changed = true;
+        }
+        if (shutter != NULL && setShutterReply(shutter)) {
+            shutterChanged = true;
+        }
+    }
+    if (shutterChanged && isConnected()) {
+        checkShutter();
+    }
+    if (!changed || !isConnected()) return;
+    if (DomeMotionSP.s == IPS_BUSY) {
+        if (!checkMotion()) {
+            motionFinished();
+        }
+    } else {
+        SetupParms();
+    }
+}
+
+/**
+ * A limit switch edge latched by the board. The edge arrives ahead of the settled state push, so the time it
+ * gives for reaching the far limit is in place when the motion finishes.
+ **/
+void AldiRoof::handleLimitEdge(const firmata_msg_t &msg)
+{
+    uint8_t edge = msg.data[0];
+    uint32_t boardMs = 0;
+    uint32_t ageMs = 0;
+    for (int i = 0; i < 5; i++) {
+        boardMs |= (uint32_t)(msg.data[1 + i] & 0x7F) << (7 * i);
+    }
+    for (int i = 0; i < 3; i++) {
+        ageMs |= (uint32_t)(msg.data[6 + i] & 0x7F) << (7 * i);
+    }
+    std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now() - std::chrono::milliseconds(ageMs);
+    bool made = (edge & ROOF_EDGE_MADE) != 0;
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Limit switch edge: %s %s at board time %u ms, %u ms ago%s",
+           edge & ROOF_EDGE_OPEN_LIMIT ? "open" : "closed", made ? "made" : "released", boardMs, ageMs,
+           edge & ROOF_EDGE_CUT ? ", relays cut" : "");
+    int changed = (edge & ROOF_EDGE_OPEN_LIMIT ? TELEMETRY_LIMIT_OPEN : 0) | (edge & ROOF_EDGE_CLOSED_LIMIT ? TELEMETRY_LIMIT_CLOSED : 0);
+    logTelemetry(TELEMETRY_EDGE, TELEMETRY_CMD_NONE,
+                 edge & ROOF_EDGE_CUT ? TELEMETRY_CUT : made ? TELEMETRY_MADE : TELEMETRY_RELEASED,
+                 0, boardMs, ageMs, changed);
+    if (DomeMotionSP.s != IPS_BUSY || !made || when < motionStart) return;
+    uint8_t farLimit = motionDir == TRAVEL_OPEN ? ROOF_EDGE_OPEN_LIMIT : ROOF_EDGE_CLOSED_LIMIT;
+    if (edge & farLimit) {
+        haveArrival = true;
+        arrivalTime = when;
+    }
+}
+
+/**
+ * Forget the cached roof state, e.g. after a command that will change it.
+ **/
+void AldiRoof::invalidateRoofState()
+{
+    roofStateValid = false;
+}
+
+/**
+ * Start the link statistics afresh for a new connection.
+ **/
+void AldiRoof::resetLinkStats()
+{
+    queryRtt.reset();
+    writeTime.reset();
+    tickTime.reset();
+    queryTimeouts = 0;
+    reconnects = 0;
+    rxBytesClosed = 0;
+    txBytesClosed = 0;
+    lastRxBytes = 0;
+    lastTxBytes = 0;
+    lastStatsTime = std::chrono::steady_clock::now();
+}
+
+void AldiRoof::linkStatsCallback(void *userpointer)
+{
+    AldiRoof *roof = static_cast<AldiRoof *>(userpointer);
+    roof->publishLinkStats();
+    roof->statsTimerId = IEAddTimer(LINK_STATS_PERIOD_MS, linkStatsCallback, roof);
+}
+
+/**
+ * Publish the histograms and counters gathered since connecting. Byte rates cover the last period only.
+ **/
+void AldiRoof::publishLinkStats()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastStatsTime).count();
+    uint64_t rx = rxBytesClosed + (sf != NULL ? sf->bytesReceived() : 0);
+    uint64_t tx = txBytesClosed + (sf != NULL ? sf->bytesSent() : 0);
+
+    LinkStatsN[STAT_RTT_P50].value = queryRtt.percentile(50);
+    LinkStatsN[STAT_RTT_P99].value = queryRtt.percentile(99);
+    LinkStatsN[STAT_RTT_MAX].value = queryRtt.max();
+    LinkStatsN[STAT_WRITE_P99].value = writeTime.percentile(99);
+    LinkStatsN[STAT_TICK_P99].value = tickTime.percentile(99);
+    LinkStatsN[STAT_TIMEOUTS].value = queryTimeouts;
+    LinkStatsN[STAT_RECONNECTS].value = reconnects;
+    if (seconds > 0) {
+        LinkStatsN[STAT_RX_RATE].value = (rx - lastRxBytes) / seconds;
+        LinkStatsN[STAT_TX_RATE].value = (tx - lastTxBytes) / seconds;
+    }
+    lastRxBytes = rx;
+    lastTxBytes = tx;
+    lastStatsTime = now;
+
+    LinkStatsNP.s = (sf == NULL || replyTimeouts > 0) ? IPS_ALERT : IPS_OK;
+    IDSetNumber(&LinkStatsNP, NULL);
+}
+
+/**
+ * (Re)open the telemetry ring file named by TELEMETRY_FILE. Telemetry is best effort: the roof works without it.
+ **/
+void AldiRoof::openTelemetry()
+{
+    telemetry.close();
+    if (TelemetryFileT[0].text == NULL || TelemetryFileT[0].text[0] == 0) {
+        TelemetryFileTP.s = IPS_IDLE;
+        return;
+    }
+    if (telemetry.open(TelemetryFileT[0].text, TELEMETRY_RECORDS)) {
+        TelemetryFileTP.s = IPS_OK;
+    } else {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Cannot open telemetry file %s, roof history will not be recorded", TelemetryFileT[0].text);
+        TelemetryFileTP.s = IPS_ALERT;
+    }
+}
+
+/**
+ * Append a telemetry record, filling in the limit switches (unless given), motion time and temperature as they are now.
+ **/
+void AldiRoof::logTelemetry(uint8_t event, uint8_t command, uint8_t outcome, uint32_t rtt_us, uint32_t board_ms, uint32_t age_ms, int limits)
+{
+    if (!telemetry.isOpen()) return;
+    telemetry_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.event = event;
+    rec.command = command;
+    rec.outcome = outcome;
+    rec.rtt_us = rtt_us;
+    rec.board_ms = board_ms;
+    if (limits >= 0) {
+        rec.limits = limits;
+    } else {
+        rec.limits = (roofOpen ? TELEMETRY_LIMIT_OPEN : 0) | (roofClosed ? TELEMETRY_LIMIT_CLOSED : 0) |
+                     (roofStateValid ? TELEMETRY_LIMIT_VALID : 0);
+    }
+    bool shutter = command == TELEMETRY_CMD_SHUTTER_OPEN || command == TELEMETRY_CMD_SHUTTER_CLOSE;
+    if (DomeMotionSP.s == IPS_BUSY || event == TELEMETRY_MOTION_END || (shutter && shutterRunning)) {
+        std::chrono::steady_clock::time_point start = shutter ? shutterStart : motionStart;
+        std::chrono::steady_clock::time_point at = std::chrono::steady_clock::now() - std::chrono::milliseconds(age_ms);
+        rec.elapsed_ms = at > start ? std::chrono::duration_cast<std::chrono::milliseconds>(at - start).count() : 0;
+    }
+    double temperature = currentTemperature();
+    rec.temperature = isnan(temperature) ? TELEMETRY_NO_TEMPERATURE : (int16_t)lround(temperature * 10);
+    telemetry.append(rec);
+}
+
+/**
+ * Write the current state to the shared memory segment. Cheap enough to call after everything that might have changed it.
+ **/
+void AldiRoof::publishState()
+{
+    if (sharedState == NULL) return;
+    roofstate_t state;
+    memset(&state, 0, sizeof(state));
+    state.flags = (roofOpen ? ROOFSTATE_OPEN_LIMIT : 0) | (roofClosed ? ROOFSTATE_CLOSED_LIMIT : 0) |
+                  (roofStateValid ? ROOFSTATE_VALID : 0) | (sf != NULL ? ROOFSTATE_LINK_UP : 0) |
+                  (isParked() ? ROOFSTATE_PARKED : 0);
+    if (DomeMotionSP.s == IPS_BUSY) {
+        state.motion = DomeMotionS[DOME_CW].s == ISS_ON ? ROOFSTATE_OPENING : ROOFSTATE_CLOSING;
+    }
+    switch (getShutterState())
+    {
+        case SHUTTER_OPENED: state.shutter = ROOFSTATE_SHUTTER_OPEN; break;
+        case SHUTTER_CLOSED: state.shutter = ROOFSTATE_SHUTTER_CLOSED; break;
+        case SHUTTER_MOVING: state.shutter = ROOFSTATE_SHUTTER_MOVING; break;
+        default: state.shutter = ROOFSTATE_SHUTTER_UNKNOWN; break;
+    }
+    state.reply_timeouts = replyTimeouts;
+    state.query_rtt_us = lastQueryRttUs;
+    state.reconnects = reconnects;
+    // roofStateTime is on the steady clock, move it onto CLOCK_MONOTONIC by its age
+    uint64_t now = roofstate_now_ns();
+    uint64_t age = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - roofStateTime).count();
+    state.state_ns = age < now ? now - age : 0;
+    roofstate_publish(sharedState, &state);
+}
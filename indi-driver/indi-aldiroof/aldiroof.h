@@ -5,11 +5,20 @@
 
 /*  Some headers we need */
 #include <math.h>
-#include <sys/time.h>
+#include <chrono>
+#include <string>
+#include <thread>
 
 /* Firmata */
 #include "firmata.h"
 
+#include "linkstats.h"
+#include "scheduler.h"
+#include "travelmodel.h"
+#include "telemetry.h"
+#include "roofstate.h"
+#include "roofprotocol.h"
+
 
 class AldiRoof : public INDI::Dome
 {
@@ -18,10 +27,15 @@ class AldiRoof : public INDI::Dome
         virtual ~AldiRoof();
 
         virtual bool initProperties();
+        virtual void ISGetProperties(const char *dev);
         const char *getDefaultName();
+        // One of several roofs in this process, see ISInit()
+        void setInstance(int number, const char *port);
         bool updateProperties();
         virtual bool ISSnoopDevice (XMLEle *root);
 		virtual bool ISNewSwitch (const char *dev, const char *name, ISState *states, char *names[], int n);
+		virtual bool ISNewNumber (const char *dev, const char *name, double values[], char *names[], int n);
+		virtual bool ISNewText (const char *dev, const char *name, char *texts[], char *names[], int n);
 		virtual bool saveConfigItems(FILE *fp);
 
       protected:
@@ -36,6 +50,7 @@ class AldiRoof : public INDI::Dome
         virtual IPState Park();
         virtual IPState UnPark();
         virtual bool Abort();
+        virtual IPState ControlShutter(ShutterOperation operation);
 
         virtual bool getFullOpenedLimitSwitch();
         virtual bool getFullClosedLimitSwitch();
@@ -45,15 +60,194 @@ class AldiRoof : public INDI::Dome
         IText CurrentStateT[1];
         ITextVectorProperty CurrentStateTP;
 
+        // How long a QUERY reply is reused before asking the arduino again
+        INumber StateCacheN[1];
+        INumberVectorProperty StateCacheNP;
+
+        // Link health, published every LINK_STATS_PERIOD_MS while connected
+        enum { STAT_RTT_P50, STAT_RTT_P99, STAT_RTT_MAX, STAT_WRITE_P99, STAT_TICK_P99,
+               STAT_TIMEOUTS, STAT_RECONNECTS, STAT_RX_RATE, STAT_TX_RATE, STAT_COUNT };
+        INumber LinkStatsN[STAT_COUNT];
+        INumberVectorProperty LinkStatsNP;
+        LatencyHistogram queryRtt;
+        LatencyHistogram writeTime;
+        LatencyHistogram tickTime;
+        unsigned long queryTimeouts;
+        unsigned long reconnects;
+        uint64_t rxBytesClosed;     // bytes moved by links that have since been closed
+        uint64_t txBytesClosed;
+        uint64_t lastRxBytes;
+        uint64_t lastTxBytes;
+        std::chrono::steady_clock::time_point lastStatsTime;
+        int statsTimerId;
+        void resetLinkStats();
+        void publishLinkStats();
+        static void linkStatsCallback(void *userpointer);
+
         ISState fullOpenLimitSwitch;
         ISState fullClosedLimitSwitch;
         bool IsTelescopeParked;
 
         double MotionRequest;
-        struct timeval MotionStart;
+        std::chrono::steady_clock::time_point motionStart;
+        double fastPollFrom;        // seconds into the motion when fast polling starts
         bool SetupParms();
 
-        float CalcTimeLeft(timeval);
+        // Learned limit to limit travel times, persisted in the config file
+        INumber TravelModelN[2 * TRAVEL_BANDS * 3];
+        INumberVectorProperty TravelModelNP;
+        TravelModel travelModel;
+        int motionDir;              // TRAVEL_OPEN or TRAVEL_CLOSE
+        bool motionFullTravel;      // started at the opposite limit, so the run can be learned from
+        bool havePrediction;
+        double predictedMean;
+        double predictedSd;
+        bool haveArrival;           // the board reported the edge of the far limit switch during this motion
+        std::chrono::steady_clock::time_point arrivalTime;
+        void startMotionTiming(DomeDirection dir);
+        void recordTravel();
+        void publishTravelModel();
+
+        // Weather station snooped for the outside temperature and its alert status
+        IText WeatherDeviceT[1];
+        ITextVectorProperty WeatherDeviceTP;
+        double outsideTemperature;  // NAN until reported
+        std::chrono::steady_clock::time_point temperatureTime;
+        void snoopWeather();
+        double currentTemperature();
+        // Close as soon as the weather device raises an alert, rather than waiting for a client to notice
+        ISwitch WeatherCloseS[2];
+        ISwitchVectorProperty WeatherCloseSP;
+        bool weatherAlert;
+        std::chrono::steady_clock::time_point weatherAlertTime;
+        bool weatherClosePending;   // the alert is on and the roof hasn't been seen closed since
+        int weatherCloseAttempts;   // closes started for this alert
+        bool weatherCloseInterrupted;   // the link dropped since the last of them started
+        void weatherClose(bool retry);
+        bool closedForWeather();
+        void logWeatherClose(uint8_t command);
+        void checkWeatherClose();
+
+        // Shutter actuator. It has no limit switches: the board runs it for a fixed time, then reports it open or closed.
+        enum { SHUTTER_SEPARATE, SHUTTER_IN_TURN, SHUTTER_OVERLAP, SHUTTER_MODE_COUNT };
+        ISwitch ShutterModeS[SHUTTER_MODE_COUNT];
+        ISwitchVectorProperty ShutterModeSP;
+        bool shutterRunning;        // a shutter command is out and the board hasn't reported the end of the run
+        bool shutterSeenMoving;     // the board has reported the run, so its reports are current
+        ShutterOperation shutterCommand;
+        std::chrono::steady_clock::time_point shutterStart;
+        bool openShutterAfterRoof;
+        bool parkAfterShutter;      // close the roof once the shutter is closed
+        int shutterMode();
+        bool startShutter(ShutterOperation operation);
+        bool setShutterReply(const char *state);
+        void checkShutter();
+
+        // Binary history of commands, replies and motion outcomes
+        IText TelemetryFileT[1];
+        ITextVectorProperty TelemetryFileTP;
+        TelemetryLog telemetry;
+        uint32_t lastQueryRttUs;
+        void openTelemetry();
+        void logTelemetry(uint8_t event, uint8_t command, uint8_t outcome, uint32_t rtt_us = 0,
+                          uint32_t board_ms = 0, uint32_t age_ms = 0, int limits = -1);
+
+        // Roof state in shared memory for local readers (roofstate.h), republished after every event handled
+        roofstate_shm_t *sharedState;
+        std::string sharedStateName;
+        void publishState();
+
+        // Deadlines handled from TimerHit. Only one INDI timer is armed, for the earliest of them.
+        enum { TIMER_MOTION_TIMEOUT, TIMER_POLL, TIMER_SETTLE, TIMER_SHUTTER_TIMEOUT, TIMER_BAUD_TRIAL };
+        DeadlineScheduler scheduler;
+        int timerId;
+        void schedule();
+        int motionPollInterval();
+        void motionFinished();
+        void idlePoll();
+
+        bool queryRoof(string &reply);
+        bool refreshRoofState(bool force);
+        bool setRoofState(const char *state);
+        bool checkMotion();
+        void stopRoof();
+        void handleRoofEvents();
+        void handleRoofMessages();
+        void handleLimitEdge(const firmata_msg_t &msg);
+        static void roofEventCallback(int fd, void *userpointer);
+        int roofEventCallbackId;
+
+        // Serial link supervision. The INDI device stays connected while the link is re-opened in the background.
+        enum { BAUD_RESULT_NONE, BAUD_RESULT_OK, BAUD_RESULT_REFUSED, BAUD_RESULT_NO_CONFIRM, BAUD_RESULT_BUSY };
+        typedef struct {
+            std::string port;
+            bool lowLatency;
+            int baud;               // LINK_BAUD, tried if the board doesn't answer at ROOF_DEFAULT_BAUD and negotiated once found
+            bool negotiate;         // false while the roof is moving, see roofBusy()
+            Firmata *sf;            // the open link, NULL if no roof controller answered
+            std::string firmware;   // as the board reported it, empty if nothing answered
+            bool binaryProtocol;
+            uint8_t features;       // ROOF_FEATURE_* from the probe's status frame
+            int openBaud;           // the rate the board answered at
+            int baudResult;         // BAUD_RESULT_*
+        } link_open_t;
+        bool openLink();
+        void prepareLinkOpen(link_open_t &link);
+        static void openRoofLink(link_open_t &link);
+        bool takeLink(link_open_t &link);
+        void closeLink();
+        bool sendCommand(const char *cmd);
+        void linkLost(const char *reason);
+        void reconnect();
+        static void reconnectCallback(void *userpointer);
+        // A reconnect opens the port on linkOpener, which signals linkOpenedFd once linkOpening holds the result
+        std::thread linkOpener;
+        link_open_t linkOpening;
+        int linkOpenedFd;
+        int linkOpenedCallbackId;
+        static void linkOpenedCallback(int fd, void *userpointer);
+        void linkOpened();
+        void finishLinkOpen();
+        int reconnectTimerId;
+        int reconnectDelay;
+        int replyTimeouts;
+        bool binaryProtocol;        // the firmware speaks the sysex command set in roofprotocol.h
+        uint8_t firmwareFeatures;   // ROOF_FEATURE_* the firmware reported
+        bool canStopRoofOnly();
+        // Serial link rate, negotiated up from ROOF_DEFAULT_BAUD once connected
+        enum { BAUD_57600, BAUD_115200, BAUD_230400, BAUD_500000, BAUD_COUNT };
+        ISwitch LinkBaudS[BAUD_COUNT];
+        ISwitchVectorProperty LinkBaudSP;
+        int selectedBaud();
+        bool negotiateBaud(int baud);
+        static int changeBaud(Firmata *board, int baud);
+        bool baudChanged(int result, int baud, int from);
+        bool roofBusy();
+        // After a failed rate change the board is left at the new rate until its trial runs out. Until TIMER_BAUD_TRIAL
+        // expires nothing is asked and commands wait here. ABORT and STOP are refused instead, and take the held commands with them.
+        std::vector<std::string> deferredCommands;
+        bool baudTrialRunning();
+        void baudTrialOver();
+        // Exclusive, low latency serial port (Arduino::setLowLatency). Applies when the link is next opened.
+        ISwitch LowLatencyS[2];
+        ISwitchVectorProperty LowLatencySP;
+
+        // Several roofs run from this process
+        int instance;               // 1.., or 0 for the only roof
+        std::string defaultPort;
+        ISwitch CloseAllS[1];
+        ISwitchVectorProperty CloseAllSP;
+        bool closeSent;             // sendCloseFirst() has sent CLOSE, Move() shouldn't send it again
+        static void closeAll();
+        bool sendCloseFirst();
+        void parkNow();
+        void invalidateRoofState();
+
+        // Last QUERY reply. Both limit switches come from the same reply.
+        bool roofStateValid;
+        bool roofOpen;
+        bool roofClosed;
+        std::chrono::steady_clock::time_point roofStateTime;
 
         Firmata* sf;
 
@@ -0,0 +1,252 @@
+/*
+   aldiroof_bench: latency and throughput numbers for the driver's serial stack.
+
+   Runs against the roof simulator on a pseudo terminal, so the numbers cover
+   libfirmata, the kernel tty layer and the reader thread but not USB or the
+   arduino itself. Each benchmark collects one sample per iteration and
+   reports p50 / p99 / max.
+
+     encode        FirmataFrame::putStringData() of a command, ns per frame
+     parse         FirmataParser over a recorded reply stream, MB/s; p99
+                   and max are the slow end for this one
+     query rtt     request("QUERY") -> matched reply, as TimerHit() polls
+     abort ack     ABORT written -> the QUERY pipelined behind it answered
+     binary rtt    the same QUERY over the sysex command set (roofprotocol.h)
+     limit push    limit switch state change written by the controller ->
+                   message popped after the event fd wakes, which is where
+                   the driver calls setDomeState(). Binary status frames,
+                   as the simulator pushes once binary commands are seen
+*/
+
+#include <roofsim.h>
+#include <firmata.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SAMPLES       1000
+#define BENCH_ENCODE_BATCH  1000  // frames encoded per encode sample
+#define BENCH_PARSE_BYTES   (1 << 20)
+#define BENCH_READ_CHUNK    4096  // bytes handed to the parser at once, like a read()
+#define BENCH_REPLY_TIMEOUT 250   // ms, same as the driver
+
+static double nowUs() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+class Samples {
+	public:
+		// higherIsBetter puts the slowest samples in the p99 / max columns
+		Samples(const char* _name, const char* _unit, bool _higherIsBetter = false)
+			: name(_name), unit(_unit), higherIsBetter(_higherIsBetter), failed(0) {}
+		void add(double v) { values.push_back(v); }
+		void fail() { failed++; }
+		double percentile(double p) {
+			size_t i = (size_t)(p / 100.0 * values.size());
+			return values[std::min(i, values.size() - 1)];
+		}
+		void report() {
+			if (values.empty()) {
+				printf("%-12s %8s  no samples (%d failed)\n", name, "", failed);
+				return;
+			}
+			std::sort(values.begin(), values.end());
+			if (higherIsBetter) std::reverse(values.begin(), values.end());
+			printf("%-12s %8zu %12.2f %12.2f %12.2f  %s", name, values.size(),
+				percentile(50), percentile(99), values.back(), unit);
+			if (failed) printf("  (%d failed)", failed);
+			printf("\n");
+		}
+	private:
+		const char* name;
+		const char* unit;
+		bool higherIsBetter;
+		std::vector<double> values;
+		int failed;
+};
+
+static volatile int sink;
+
+static void benchEncode(int samples) {
+	Samples s("encode", "ns/frame");
+	FirmataFrame frame;
+	for (int i=0; i < samples; i++) {
+		double t0 = nowUs();
+		for (int j=0; j < BENCH_ENCODE_BATCH; j++) {
+			frame.reset();
+			frame.putStringData("SHUTTERQUERY");
+			sink += frame.size();
+		}
+		s.add((nowUs() - t0) * 1000.0 / BENCH_ENCODE_BATCH);
+	}
+	s.report();
+}
+
+// What the controller sends back in normal operation: replies and pushes,
+// the odd digital port report and a firmware report on reconnect.
+static std::vector<uint8_t> recordedStream() {
+	static const char* replies[] = { "CLOSED", "UNKNOWN", "OPEN", "SHUTTERCLOSED", "SHUTTERUNKNOWN", "SHUTTEROPEN" };
+	std::vector<uint8_t> stream;
+	FirmataFrame frame;
+	for (int i=0; stream.size() < BENCH_PARSE_BYTES; i++) {
+		frame.reset();
+		if (i % 50 == 49) {
+			frame.put(FIRMATA_START_SYSEX);
+			frame.put(FIRMATA_REPORT_FIRMWARE);
+			frame.put(2);
+			frame.put(5);
+			for (const char* c = ROOFSIM_FIRMWARE_NAME; *c; c++) frame.putTwo7bitBytes((unsigned char)*c);
+			frame.put(FIRMATA_END_SYSEX);
+		} else if (i % 10 == 9) {
+			frame.put(FIRMATA_DIGITAL_MESSAGE | (i & 1));
+			frame.putTwo7bitBytes(i & 0xFF);
+		} else {
+			frame.putStringData(replies[i % 6]);
+		}
+		stream.insert(stream.end(), frame.data(), frame.data() + frame.size());
+	}
+	return stream;
+}
+
+static void benchParse(int samples) {
+	Samples s("parse", "MB/s", true);
+	std::vector<uint8_t> stream = recordedStream();
+	FirmataParser parser;
+	firmata_view_t msg;
+	// Fewer passes than the latency benchmarks, each one is a megabyte
+	for (int i=0; i < samples / 10 + 1; i++) {
+		double t0 = nowUs();
+		int messages = 0;
+		for (size_t off=0; off < stream.size(); off += BENCH_READ_CHUNK) {
+			const uint8_t* p = &stream[off];
+			const uint8_t* end = &stream[0] + std::min(off + BENCH_READ_CHUNK, stream.size());
+			while (parser.next(&p, end, msg)) messages++;
+		}
+		sink += messages;
+		s.add(stream.size() / (nowUs() - t0));  // bytes per us == MB/s
+	}
+	s.report();
+}
+
+static void benchCommands(Firmata* sf, int samples) {
+	Samples rtt("query rtt", "us");
+	Samples abort("abort ack", "us");
+	Samples binary("binary rtt", "us");
+	string reply;
+	vector<uint8_t> status;
+	uint8_t query = ROOF_OP_QUERY;
+	for (int i=0; i < samples; i++) {
+		double t0 = nowUs();
+		if (sf->request("QUERY", std::chrono::milliseconds(BENCH_REPLY_TIMEOUT), reply)) {
+			rtt.add(nowUs() - t0);
+		} else {
+			rtt.fail();
+		}
+	}
+	for (int i=0; i < samples; i++) {
+		double t0 = nowUs();
+		sf->sendStringData((char*)"ABORT");
+		if (sf->request("QUERY", std::chrono::milliseconds(BENCH_REPLY_TIMEOUT), reply)) {
+			abort.add(nowUs() - t0);
+		} else {
+			abort.fail();
+		}
+	}
+	for (int i=0; i < samples; i++) {
+		double t0 = nowUs();
+		if (sf->requestSysex(ROOF_SYSEX_COMMAND, &query, 1, ROOF_SYSEX_STATUS, std::chrono::milliseconds(BENCH_REPLY_TIMEOUT), status)) {
+			binary.add(nowUs() - t0);
+		} else {
+			binary.fail();
+		}
+	}
+	rtt.report();
+	abort.report();
+	binary.report();
+}
+
+// The simulator is stepped from this thread so the push is written at a
+// known time; its limit switch settle has to elapse before anything is sent.
+// The edge frames sent straight away on the switch change are skipped.
+static void benchPush(Firmata* sf, RoofSim* sim, int samples) {
+	Samples push("limit push", "us");
+	firmata_msg_t msg;
+	while (sf->popMessage(msg));
+	for (int i=0; i < samples; i++) {
+		uint8_t expect = (i & 1) ? ROOF_STATUS_CLOSED_LIMIT : ROOF_STATUS_OPEN_LIMIT;
+		sim->setPosition((i & 1) ? 0.0 : 1.0);
+		sim->step(0);
+		double t0 = nowUs();
+		sim->step(2 * ROOFSIM_LIMIT_SETTLE);
+		int got;
+		while ((got = sf->waitMessage(msg, BENCH_REPLY_TIMEOUT)) > 0 && msg.command == FIRMATA_START_SYSEX &&
+			msg.port == ROOF_SYSEX_EDGE);
+		if (got > 0 && msg.command == FIRMATA_START_SYSEX &&
+			msg.port == ROOF_SYSEX_STATUS && msg.len >= 1 && (msg.data[0] & expect)) {
+			push.add(nowUs() - t0);
+		} else {
+			push.fail();
+		}
+		while (sf->popMessage(msg));
+	}
+	push.report();
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,"Usage: %s [-n samples]\n",prog);
+}
+
+int main(int argc, char** argv) {
+	int samples = BENCH_SAMPLES;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n': samples = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return(opt == 'h' ? 0 : 1);
+		}
+	}
+	if (samples < 1) {
+		usage(argv[0]);
+		return(1);
+	}
+
+	printf("%-12s %8s %12s %12s %12s\n", "benchmark", "samples", "p50", "p99", "max");
+	benchEncode(samples);
+	benchParse(samples);
+
+	roofsim_config_t cfg;
+	roofsim_default_config(&cfg);
+	RoofSim sim(cfg);
+	if (sim.openPty() < 0) return(1);
+	volatile bool stop = false;
+	std::thread simThread([&] { sim.run(&stop, 10); });
+
+	Firmata* sf = new Firmata(sim.slaveName(), 3000, false);
+	if (!sf->portOpen || sf->handshakeState != FIRMATA_HS_DONE) {
+		fprintf(stderr, "No answer from the simulator on %s\n", sim.slaveName());
+		stop = true;
+		simThread.join();
+		delete sf;
+		return(1);
+	}
+	sf->expectReplies("QUERY", {"OPEN", "CLOSED", "UNKNOWN"});
+	sf->startReader();
+
+	benchCommands(sf, samples);
+	stop = true;
+	simThread.join();
+	benchPush(sf, &sim, samples);
+
+	sf->stopReader();
+	delete sf;
+	return(0);
+}
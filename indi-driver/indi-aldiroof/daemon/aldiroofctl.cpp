@@ -0,0 +1,79 @@
+/*
+ * aldiroofctl: send one request to aldiroofd and print the reply.
+ *
+ *   aldiroofctl [-s socket] [-t timeout ms] REQUEST
+ *
+ * REQUEST is one of the lines in roofd.h, e.g. STATUS or OPEN. Exits 0 if the
+ * daemon answered OK, 1 otherwise.
+ */
+#include "roofd.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s socket] [-t timeout ms] STATUS|QUERY|OPEN|CLOSE|ABORT|STOP|SHUTTEROPEN|SHUTTERCLOSE\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = ROOFD_SOCKET;
+    int timeout_ms = 2000;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:h")) != -1) {
+        switch (opt) {
+            case 's': path = optarg; break;
+            case 't': timeout_ms = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || strlen(argv[optind]) >= ROOFD_MAX_LINE - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "%s: %s (is aldiroofd running?)\n", path, strerror(errno));
+        return 1;
+    }
+    char request[ROOFD_MAX_LINE];
+    int len = snprintf(request, sizeof(request), "%s\n", argv[optind]);
+    if (send(fd, request, len, MSG_NOSIGNAL) != len) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    char reply[ROOFD_MAX_LINE];
+    size_t got = 0;
+    while (got < sizeof(reply) - 1 && memchr(reply, '\n', got) == NULL) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            fprintf(stderr, "%s: no reply\n", path);
+            return 1;
+        }
+        ssize_t n = read(fd, reply + got, sizeof(reply) - 1 - got);
+        if (n <= 0) {
+            fprintf(stderr, "%s: connection closed\n", path);
+            return 1;
+        }
+        got += n;
+    }
+    reply[got] = 0;
+    close(fd);
+    fputs(reply, stdout);
+    return strncmp(reply, "OK", 2) == 0 ? 0 : 1;
+}
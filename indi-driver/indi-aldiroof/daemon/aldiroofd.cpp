@@ -0,0 +1,669 @@
+/*
+ * aldiroofd: hold the roof controller's serial link open and serve it to local
+ * clients over a Unix domain socket (protocol in roofd.h).
+ *
+ *   aldiroofd [-p serial port] [-s socket] [-m shared memory name] [-v]
+ *
+ * Opening the port resets the arduino and it takes seconds to boot, so scripts
+ * that open it for every call are slow and fight the INDI driver for the tty.
+ * The daemon opens it once, claims it exclusively, and keeps the last state the
+ * arduino reported (it pushes every change), so a STATUS is answered from
+ * memory. The link is queried every IDLE_POLL_MS to notice a dead board and is
+ * re-opened with backoff when it fails. Neither holds up the other clients: the
+ * port is opened on a worker thread, and QUERY replies are collected when the
+ * reader signals them. aldiroofctl is the command line client.
+ * The state is also published in shared memory (roofstate.h) for readers that
+ * don't need to ask, as the INDI driver does when it owns the port.
+ */
+#include "roofd.h"
+
+#include <firmata.h>
+#include <roofprotocol.h>
+#include <roofstate.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONNECT_TIMEOUT_MS      3000    // Give up connecting if the board hasn't reported its firmware by then
+#define REPLY_TIMEOUT_MS        250     // How long to wait for the arduino to answer a QUERY
+#define MAX_REPLY_TIMEOUTS      3       // Consecutive unanswered QUERYs before the link is considered dead
+#define IDLE_POLL_MS            10000   // QUERY rate, state changes are pushed in between
+#define RECONNECT_DELAY_MS      1000    // First reconnect attempt, doubled after each failure
+#define MAX_RECONNECT_DELAY_MS  30000
+#define MAX_CLIENTS             16
+
+typedef std::chrono::steady_clock clock_type;
+
+static volatile sig_atomic_t stop = 0;
+static bool verbose = false;
+
+static void onSignal(int)
+{
+    stop = 1;
+}
+
+typedef struct {
+    int fd;
+    std::string in;
+    bool waiting;               // sent QUERY, its reply and anything sent after it wait for the arduino
+} client_t;
+
+template <typename T> static bool ready(const std::shared_future<T> &reply)
+{
+    return reply.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready;
+}
+
+class RoofDaemon
+{
+    public:
+        RoofDaemon(const char *port, const char *stateName);
+        ~RoofDaemon();
+        // Serve until a signal arrives
+        int run(int listenFd);
+
+    private:
+        std::string port;
+        Firmata *sf;
+        bool binaryProtocol;
+        uint8_t features;           // ROOF_FEATURE_* the firmware reported
+        int replyTimeouts;
+        int reconnectDelay;
+        bool linkSeen;              // the link has been up, so opening it again is a reconnect
+        clock_type::time_point nextPoll;
+        clock_type::time_point nextReconnect;
+
+        // The port is opened on opener, which signals openedFd once opened holds the result
+        typedef struct {
+            Firmata *sf;            // NULL if no roof controller answered
+            bool binaryProtocol;
+            std::vector<uint8_t> status;    // the binary probe's reply
+        } opened_link_t;
+        std::thread opener;
+        opened_link_t opened;
+        int openedFd;
+
+        // QUERY on the wire, finished by checkQuery() once the replies are in or REPLY_TIMEOUT_MS has passed
+        bool queryRunning;
+        clock_type::time_point queryStart;
+        clock_type::time_point queryDeadline;
+        firmata_sysex_request_t statusRequest;
+        firmata_request_t roofRequest;
+        firmata_request_t shutterRequest;
+
+        // Last state the arduino reported
+        std::string roof;
+        std::string shutter;
+        bool stateKnown;
+        clock_type::time_point stateTime;
+        uint8_t motion;             // ROOFSTATE_OPENING or CLOSING from the command sent until the far limit is reported
+        uint32_t queryRttUs;
+        uint32_t reconnects;
+
+        std::string stateName;
+        roofstate_shm_t *sharedState;
+
+        std::vector<client_t> clients;
+
+        static void openLink(const std::string &port, opened_link_t &link);
+        void startOpen();
+        void linkOpened();
+        void closeLink(const char *reason);
+        void startQuery();
+        void checkQuery();
+        void finishQuery(bool answered);
+        void answerQuery(const std::string &reply);
+        bool sendCommand(const char *cmd);
+        void handleEvents();
+        bool setState(const char *state);
+        void publishState();
+        std::string handleRequest(const std::string &request);
+        std::string statusReply();
+        void acceptClient(int listenFd);
+        bool readClient(client_t &client);
+        bool serveClient(client_t &client);
+        bool sendReply(client_t &client, const std::string &reply);
+        int pollTimeout();
+};
+
+RoofDaemon::RoofDaemon(const char *_port, const char *_stateName)
+{
+    port = _port;
+    stateName = _stateName;
+    sharedState = roofstate_create(stateName.c_str());
+    sf = NULL;
+    binaryProtocol = false;
+    features = 0;
+    replyTimeouts = 0;
+    reconnectDelay = RECONNECT_DELAY_MS;
+    linkSeen = false;
+    nextPoll = nextReconnect = clock_type::now();
+    opened.sf = NULL;
+    openedFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (openedFd < 0) perror("aldiroofd: eventfd");
+    queryRunning = false;
+    roof = "UNKNOWN";
+    shutter = "SHUTTERUNKNOWN";
+    stateKnown = false;
+    motion = ROOFSTATE_IDLE;
+    queryRttUs = 0;
+    reconnects = 0;
+}
+
+RoofDaemon::~RoofDaemon()
+{
+    if (opener.joinable()) opener.join();
+    delete opened.sf;
+    if (openedFd >= 0) close(openedFd);
+    delete sf;
+    sf = NULL;
+    publishState();
+    roofstate_destroy(sharedState, stateName.c_str());
+    for (size_t i = 0; i < clients.size(); i++) {
+        close(clients[i].fd);
+    }
+}
+
+/**
+ * Open the port exclusively, check the firmware, start the reader and probe for the binary protocol, as the driver's
+ * openRoofLink() does. Runs on opener, so it only touches link.
+ **/
+void RoofDaemon::openLink(const std::string &port, opened_link_t &link)
+{
+    link.sf = NULL;
+    link.binaryProtocol = false;
+    link.status.clear();
+    Firmata *board = new Firmata(port.c_str(), CONNECT_TIMEOUT_MS, false, ROOF_DEFAULT_BAUD, true);
+    if (!board->portOpen || strstr(board->firmata_name, "SimpleDigitalFirmataRoofController") == NULL) {
+        fprintf(stderr, "aldiroofd: no roof controller on %s\n", port.c_str());
+        delete board;
+        return;
+    }
+    board->expectReplies("QUERY", {"OPEN", "CLOSED", "UNKNOWN"});
+    board->expectReplies("SHUTTERQUERY", {"SHUTTEROPEN", "SHUTTERCLOSED", "SHUTTERUNKNOWN"});
+    board->startReader();
+    uint8_t op = ROOF_OP_QUERY;
+    link.binaryProtocol = board->requestSysex(ROOF_SYSEX_COMMAND, &op, 1, ROOF_SYSEX_STATUS,
+                                              std::chrono::milliseconds(REPLY_TIMEOUT_MS), link.status);
+    link.sf = board;
+}
+
+/**
+ * Open the link on opener. The board resets when the port opens and takes seconds to report its firmware.
+ **/
+void RoofDaemon::startOpen()
+{
+    if (opener.joinable()) return;
+    if (openedFd < 0) {
+        openLink(port, opened);
+        linkOpened();
+        return;
+    }
+    opener = std::thread([this]() {
+        openLink(port, opened);
+        uint64_t one = 1;
+        if (write(openedFd, &one, sizeof(one)) < 0) perror("aldiroofd: write(opened)");
+    });
+}
+
+/**
+ * Take over the link opener has finished with, or back off before trying again.
+ **/
+void RoofDaemon::linkOpened()
+{
+    if (opener.joinable()) opener.join();
+    if (opened.sf == NULL) {
+        reconnectDelay = std::min(reconnectDelay * 2, MAX_RECONNECT_DELAY_MS);
+        nextReconnect = clock_type::now() + std::chrono::milliseconds(reconnectDelay);
+        return;
+    }
+    sf = opened.sf;
+    opened.sf = NULL;
+    binaryProtocol = opened.binaryProtocol;
+    features = binaryProtocol ? roofFeatures(opened.status.data(), opened.status.size()) : 0;
+    replyTimeouts = 0;
+    if (linkSeen) reconnects++;
+    linkSeen = true;
+    printf("aldiroofd: %s on %s, %s protocol\n", sf->firmata_name, port.c_str(), binaryProtocol ? "binary" : "string");
+    fflush(stdout);
+    nextPoll = clock_type::now() + std::chrono::milliseconds(IDLE_POLL_MS);
+    if (binaryProtocol) {
+        setState(roofStatusString(opened.status[0]));
+        setState(shutterStatusString(opened.status[0]));
+    } else {
+        startQuery();
+    }
+}
+
+void RoofDaemon::closeLink(const char *reason)
+{
+    if (sf == NULL) return;
+    fprintf(stderr, "aldiroofd: lost the arduino link (%s), reconnecting\n", reason);
+    delete sf;
+    sf = NULL;
+    stateKnown = false;
+    motion = ROOFSTATE_IDLE;
+    reconnectDelay = RECONNECT_DELAY_MS;
+    nextReconnect = clock_type::now() + std::chrono::milliseconds(reconnectDelay);
+}
+
+/**
+ * Ask the arduino for the roof and shutter state. With the string protocol both questions go out together. The poll loop
+ * carries on meanwhile and checkQuery() picks up the replies.
+ **/
+void RoofDaemon::startQuery()
+{
+    if (sf == NULL || queryRunning) return;
+    queryRunning = true;
+    queryStart = clock_type::now();
+    queryDeadline = queryStart + std::chrono::milliseconds(REPLY_TIMEOUT_MS);
+    if (binaryProtocol) {
+        uint8_t op = ROOF_OP_QUERY;
+        statusRequest = sf->sendSysexRequest(ROOF_SYSEX_COMMAND, &op, 1, ROOF_SYSEX_STATUS);
+    } else {
+        roofRequest = sf->sendRequest("QUERY");
+        shutterRequest = sf->sendRequest("SHUTTERQUERY");
+    }
+}
+
+/**
+ * Finish the QUERY on the wire once its replies are in, or without them once the deadline has passed.
+ **/
+void RoofDaemon::checkQuery()
+{
+    if (!queryRunning) return;
+    if (sf == NULL) {
+        // The link was closed under it
+        queryRunning = false;
+        answerQuery("ERR link down");
+        return;
+    }
+    bool late = clock_type::now() >= queryDeadline;
+    bool answered;
+    if (binaryProtocol) {
+        if (!late && !ready(statusRequest.reply)) return;
+        std::vector<uint8_t> status;
+        answered = sf->waitSysexReply(statusRequest, std::chrono::milliseconds(0), status);
+        if (answered) {
+            setState(roofStatusString(status[0]));
+            setState(shutterStatusString(status[0]));
+        }
+    } else {
+        if (!late && !(ready(roofRequest.reply) && ready(shutterRequest.reply))) return;
+        std::string reply;
+        answered = sf->waitReply(roofRequest, std::chrono::milliseconds(0), reply);
+        if (answered) setState(reply.c_str());
+        if (sf->waitReply(shutterRequest, std::chrono::milliseconds(0), reply)) {
+            setState(reply.c_str());
+        }
+    }
+    finishQuery(answered);
+}
+
+void RoofDaemon::finishQuery(bool answered)
+{
+    queryRunning = false;
+    nextPoll = clock_type::now() + std::chrono::milliseconds(IDLE_POLL_MS);
+    if (!answered) {
+        if (sf->linkLost()) {
+            closeLink("serial write failed");
+        } else if (++replyTimeouts >= MAX_REPLY_TIMEOUTS) {
+            closeLink("no reply to QUERY");
+        }
+        answerQuery("ERR no reply");
+        return;
+    }
+    replyTimeouts = 0;
+    queryRttUs = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - queryStart).count();
+    answerQuery(statusReply());
+}
+
+/**
+ * Give the clients waiting on a QUERY their reply, then serve what they sent after it.
+ **/
+void RoofDaemon::answerQuery(const std::string &reply)
+{
+    for (size_t i = clients.size(); i-- > 0; ) {
+        if (!clients[i].waiting) continue;
+        clients[i].waiting = false;
+        if (!sendReply(clients[i], reply) || !serveClient(clients[i])) {
+            close(clients[i].fd);
+            clients.erase(clients.begin() + i);
+        }
+    }
+}
+
+bool RoofDaemon::sendCommand(const char *cmd)
+{
+    if (sf == NULL) return false;
+    uint8_t op = 0;
+    if (binaryProtocol) {
+        static const char *ops[] = { NULL, "OPEN", "CLOSE", "ABORT", "SHUTTEROPEN", "SHUTTERCLOSE", "QUERY", "STOP" };
+        for (uint8_t i = ROOF_OP_OPEN; i <= ROOF_OP_STOP; i++) {
+            if (strcmp(cmd, ops[i]) == 0) op = i;
+        }
+    }
+    int rv = op != 0 ? sf->sendSysex(ROOF_SYSEX_COMMAND, &op, 1) : sf->sendStringData((char *)cmd);
+    if (rv != 0) {
+        closeLink("serial write failed");
+        return false;
+    }
+    if (verbose) printf("aldiroofd: sent %s\n", cmd);
+    if (strcmp(cmd, "OPEN") == 0 && roof != "OPEN") {
+        motion = ROOFSTATE_OPENING;
+    } else if (strcmp(cmd, "CLOSE") == 0 && roof != "CLOSED") {
+        motion = ROOFSTATE_CLOSING;
+    } else if (strcmp(cmd, "ABORT") == 0 || strcmp(cmd, "STOP") == 0) {
+        motion = ROOFSTATE_IDLE;
+    }
+    return true;
+}
+
+/**
+ * Take a QUERY or SHUTTERQUERY reply, asked for or pushed. Returns false if the string is neither.
+ **/
+bool RoofDaemon::setState(const char *state)
+{
+    if (strcmp(state, "OPEN") == 0 || strcmp(state, "CLOSED") == 0 || strcmp(state, "UNKNOWN") == 0) {
+        roof = state;
+        if ((motion == ROOFSTATE_OPENING && roof == "OPEN") || (motion == ROOFSTATE_CLOSING && roof == "CLOSED")) {
+            motion = ROOFSTATE_IDLE;
+        }
+    } else if (strncmp(state, "SHUTTER", 7) == 0) {
+        shutter = state;
+    } else {
+        return false;
+    }
+    stateKnown = true;
+    stateTime = clock_type::now();
+    return true;
+}
+
+/**
+ * Take the state changes the arduino pushed.
+ **/
+void RoofDaemon::handleEvents()
+{
+    if (sf == NULL) return;
+    if (sf->linkLost()) {
+        closeLink("serial read failed");
+        return;
+    }
+    firmata_msg_t msg;
+    while (sf->popMessage(msg)) {
+        if (msg.command == FIRMATA_STRING_DATA) {
+            setState(msg.text);
+        } else if (msg.command == FIRMATA_START_SYSEX && msg.port == ROOF_SYSEX_STATUS && msg.len >= 1) {
+            setState(roofStatusString(msg.data[0]));
+            setState(shutterStatusString(msg.data[0]));
+        }
+        if (verbose) printf("aldiroofd: pushed %s %s\n", roof.c_str(), shutter.c_str());
+    }
+}
+
+/**
+ * Write the state to shared memory. The daemon doesn't park, so ROOFSTATE_PARKED is never set.
+ **/
+void RoofDaemon::publishState()
+{
+    if (sharedState == NULL) return;
+    roofstate_t state;
+    memset(&state, 0, sizeof(state));
+    state.flags = (roof == "OPEN" ? ROOFSTATE_OPEN_LIMIT : 0) | (roof == "CLOSED" ? ROOFSTATE_CLOSED_LIMIT : 0) |
+                  (stateKnown ? ROOFSTATE_VALID : 0) | (sf != NULL ? ROOFSTATE_LINK_UP : 0);
+    state.motion = motion;
+    if (shutter == "SHUTTEROPEN") state.shutter = ROOFSTATE_SHUTTER_OPEN;
+    else if (shutter == "SHUTTERCLOSED") state.shutter = ROOFSTATE_SHUTTER_CLOSED;
+    else if (shutter == "SHUTTERUNKNOWN" && stateKnown) state.shutter = ROOFSTATE_SHUTTER_MOVING;
+    state.reply_timeouts = replyTimeouts;
+    state.query_rtt_us = queryRttUs;
+    state.reconnects = reconnects;
+    uint64_t now = roofstate_now_ns();
+    uint64_t age = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - stateTime).count();
+    state.state_ns = stateKnown && age < now ? now - age : 0;
+    roofstate_publish(sharedState, &state);
+}
+
+std::string RoofDaemon::statusReply()
+{
+    if (sf == NULL) return "ERR link down";
+    if (!stateKnown) return "ERR state unknown";
+    long age = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - stateTime).count();
+    char reply[ROOFD_MAX_LINE];
+    snprintf(reply, sizeof(reply), "OK %s %s %ld", roof.c_str(), shutter.c_str(), age);
+    return reply;
+}
+
+std::string RoofDaemon::handleRequest(const std::string &request)
+{
+    static const char *commands[] = { "OPEN", "CLOSE", "ABORT", "STOP", "SHUTTEROPEN", "SHUTTERCLOSE" };
+    if (request == "STATUS") {
+        return statusReply();
+    }
+    if (request == "QUERY") {
+        if (sf == NULL) return "ERR link down";
+        // Answered from answerQuery()
+        startQuery();
+        return "";
+    }
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (request == commands[i]) {
+            if (sf == NULL) return "ERR link down";
+            // ABORT instead would stop the shutter as well, so leave that choice to the client
+            if (request == "STOP" && !(binaryProtocol && (features & ROOF_FEATURE_STOP))) return "ERR firmware has no STOP";
+            return sendCommand(commands[i]) ? "OK" : "ERR serial write failed";
+        }
+    }
+    return "ERR unknown request";
+}
+
+void RoofDaemon::acceptClient(int listenFd)
+{
+    int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) perror("aldiroofd: accept");
+        return;
+    }
+    if (clients.size() >= MAX_CLIENTS) {
+        close(fd);
+        return;
+    }
+    client_t client;
+    client.fd = fd;
+    client.waiting = false;
+    clients.push_back(client);
+}
+
+/**
+ * Answer each complete line the client has sent. Returns false once the client has gone or misbehaved.
+ **/
+bool RoofDaemon::readClient(client_t &client)
+{
+    char buf[256];
+    ssize_t n = read(client.fd, buf, sizeof(buf));
+    if (n < 0) return errno == EAGAIN || errno == EINTR;
+    if (n == 0) return false;
+    client.in.append(buf, n);
+    return serveClient(client);
+}
+
+/**
+ * Answer the complete lines the client has sent, up to a QUERY still waiting for the arduino. Returns false if the
+ * client has to be dropped.
+ **/
+bool RoofDaemon::serveClient(client_t &client)
+{
+    size_t eol;
+    while (!client.waiting && (eol = client.in.find('\n')) != std::string::npos) {
+        std::string request = client.in.substr(0, eol);
+        client.in.erase(0, eol + 1);
+        if (!request.empty() && request[request.size() - 1] == '\r') request.erase(request.size() - 1);
+        std::string reply = handleRequest(request);
+        if (reply.empty()) {
+            client.waiting = true;
+        } else if (!sendReply(client, reply)) {
+            return false;
+        }
+    }
+    return client.in.size() <= ROOFD_MAX_LINE;
+}
+
+bool RoofDaemon::sendReply(client_t &client, const std::string &reply)
+{
+    std::string line = reply + "\n";
+    // Replies are a few bytes, far below the socket buffer. A client that doesn't read them is dropped.
+    return send(client.fd, line.data(), line.size(), MSG_NOSIGNAL) == (ssize_t)line.size();
+}
+
+/**
+ * Milliseconds until the next poll, QUERY deadline or reconnect attempt. -1 while opener runs, it signals openedFd.
+ **/
+int RoofDaemon::pollTimeout()
+{
+    if (sf == NULL && opener.joinable()) return -1;
+    clock_type::time_point next = sf == NULL ? nextReconnect : queryRunning ? queryDeadline : nextPoll;
+    long ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - clock_type::now()).count();
+    return (int)std::max(0L, ms + 1);
+}
+
+int RoofDaemon::run(int listenFd)
+{
+    publishState();
+    startOpen();
+    std::vector<struct pollfd> fds;
+    while (!stop) {
+        fds.clear();
+        struct pollfd pfd = { listenFd, POLLIN, 0 };
+        fds.push_back(pfd);
+        pfd.fd = sf != NULL ? sf->eventFd() : -1;
+        fds.push_back(pfd);
+        pfd.fd = opener.joinable() ? openedFd : -1;
+        fds.push_back(pfd);
+        for (size_t i = 0; i < clients.size(); i++) {
+            pfd.fd = clients[i].fd;
+            fds.push_back(pfd);
+        }
+        if (poll(fds.data(), fds.size(), pollTimeout()) < 0) {
+            if (errno == EINTR) continue;
+            perror("aldiroofd: poll");
+            return 1;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(fds[1].fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("aldiroofd: read(event)");
+            handleEvents();
+        }
+        if (fds[2].revents & POLLIN) {
+            uint64_t count;
+            if (read(fds[2].fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("aldiroofd: read(opened)");
+            linkOpened();
+        }
+        // Walk back so dropping a client doesn't move the ones still to be looked at
+        for (size_t i = clients.size(); i-- > 0; ) {
+            if (fds[3 + i].revents == 0) continue;
+            if (!readClient(clients[i])) {
+                close(clients[i].fd);
+                clients.erase(clients.begin() + i);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            acceptClient(listenFd);
+        }
+        clock_type::time_point now = clock_type::now();
+        if (sf != NULL && !queryRunning && now >= nextPoll) {
+            startQuery();
+        } else if (sf == NULL && !opener.joinable() && now >= nextReconnect) {
+            startOpen();
+        }
+        checkQuery();
+        publishState();
+    }
+    return 0;
+}
+
+/**
+ * Listen on path, refusing to take over the socket of a daemon that is still running.
+ **/
+static int listenOn(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "aldiroofd: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("aldiroofd: socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "aldiroofd: already running on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, MAX_CLIENTS) != 0) {
+        fprintf(stderr, "aldiroofd: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-p serial port] [-s socket] [-m shared memory name] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *port = "/dev/ttyACM0";
+    const char *path = ROOFD_SOCKET;
+    const char *stateName = ROOFSTATE_NAME;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:m:vh")) != -1) {
+        switch (opt) {
+            case 'p': port = optarg; break;
+            case 's': path = optarg; break;
+            case 'm': stateName = optarg; break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    int listenFd = listenOn(path);
+    if (listenFd < 0) return 1;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int rv;
+    {
+        RoofDaemon roofd(port, stateName);
+        rv = roofd.run(listenFd);
+    }
+    close(listenFd);
+    unlink(path);
+    return rv;
+}
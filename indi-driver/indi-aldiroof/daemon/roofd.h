@@ -0,0 +1,26 @@
+#ifndef RoofDaemon_H
+#define RoofDaemon_H
+
+/*
+ * Socket protocol between aldiroofd and its clients. Requests and replies are
+ * single lines terminated by a newline:
+ *
+ *   STATUS      OK <roof> <shutter> <age ms>   last known state, answered
+ *                                              without touching the serial link
+ *   QUERY       OK <roof> <shutter> <age ms>   after a fresh round trip to the
+ *                                              arduino
+ *   OPEN, CLOSE, ABORT, STOP, SHUTTEROPEN, SHUTTERCLOSE
+ *               OK                             once written to the arduino
+ *
+ * STOP stops the roof and leaves the shutter running. Firmware that doesn't
+ * report ROOF_FEATURE_STOP can't do that and STOP is refused; ABORT stops both.
+ *
+ * <roof> and <shutter> are what the arduino answers to QUERY (OPEN, CLOSED,
+ * UNKNOWN) and SHUTTERQUERY (SHUTTEROPEN, SHUTTERCLOSED, SHUTTERUNKNOWN). <age
+ * ms> is how long ago the arduino last told us. A request that can't be served,
+ * including any request while the link is down, is answered ERR <reason>.
+ */
+#define ROOFD_SOCKET        "/tmp/aldiroofd.sock"
+#define ROOFD_MAX_LINE      128
+
+#endif
@@ -0,0 +1,86 @@
+/*
+   Firmata C++ library.
+
+   Fuzz harness for FirmataParser. Built by the firmata_fuzz_parser target
+   (cmake -DFIRMATA_BUILD_FUZZER=ON). With clang it links against libFuzzer;
+   otherwise FIRMATA_FUZZ_STANDALONE provides a main() that runs each file
+   given on the command line (or stdin), which is what AFL expects.
+
+   The first input byte picks the chunk size the rest is fed in, so messages
+   split across reads are exercised as well as whole buffers.
+*/
+
+#include <firmataparser.h>
+#include <firmata.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static void checkMessage(const firmata_view_t& msg)
+{
+	assert(msg.len >= 0);
+	assert(msg.text_len >= 0 && msg.text_len < FIRMATA_MAX_TEXT_BYTES);
+	assert((int)strlen(msg.text) <= msg.text_len);
+	if (msg.command == FIRMATA_START_SYSEX) {
+		assert(msg.len <= FIRMATA_MAX_SYSEX_BYTES);
+		assert(msg.sysex_id < 0x80);
+	} else {
+		assert(msg.len <= 2);
+	}
+	for (int i=0; i < msg.len; i++) {
+		assert((msg.data[i] & 0x80) == 0);
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	if (size == 0) return 0;
+	size_t chunk = (data[0] % 16) + 1;
+	data++;
+	size--;
+
+	FirmataParser parser;
+	firmata_view_t msg;
+	for (size_t off = 0; off < size; off += chunk) {
+		const uint8_t* p = data + off;
+		const uint8_t* end = data + (off + chunk < size ? off + chunk : size);
+		while (parser.next(&p, end, msg)) {
+			checkMessage(msg);
+		}
+		assert(p == end);
+	}
+	return 0;
+}
+
+#ifdef FIRMATA_FUZZ_STANDALONE
+static void runFile(FILE* f)
+{
+	std::vector<uint8_t> buf;
+	uint8_t tmp[4096];
+	size_t n;
+	while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) {
+		buf.insert(buf.end(), tmp, tmp + n);
+	}
+	LLVMFuzzerTestOneInput(buf.empty() ? NULL : &buf[0], buf.size());
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		runFile(stdin);
+		return 0;
+	}
+	for (int i=1; i < argc; i++) {
+		FILE* f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		runFile(f);
+		fclose(f);
+	}
+	return 0;
+}
+#endif // FIRMATA_FUZZ_STANDALONE
@@ -21,10 +21,53 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <libgen.h>
 #include <linux/serial.h>
 
+// Rates the board can be asked for. The ones above 115200 aren't in POSIX.
+static const struct {
+	int rate;
+	speed_t speed;
+} baudTable[] = {
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+#ifdef B230400
+	{ 230400, B230400 },
+#endif
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B500000
+	{ 500000, B500000 },
+#endif
+#ifdef B1000000
+	{ 1000000, B1000000 },
+#endif
+};
+
+speed_t Arduino::baudSpeed(int _baud) {
+	for (unsigned i=0; i < sizeof(baudTable)/sizeof(baudTable[0]); i++) {
+		if (baudTable[i].rate == _baud) return baudTable[i].speed;
+	}
+	return B0;
+}
+
 Arduino::Arduino() {
 	fd = -1;
+	baud = B0;
+	baudRate = 0;
+	lowLatency = false;
+	wakeFd = -1;
+	frameDelay = ARDUINO_FRAME_DELAY_US;
   memset(&term,0,sizeof(termios));
 }
 
@@ -41,41 +84,70 @@ int Arduino::destroy() {
 }
 
 int Arduino::sendUchar(const unsigned char data) {
-#ifdef DEBUG
-	printf("Arduino::sendUchar sending: 0x%02x\n",data);
-#endif // DEBUG
-	if(write(fd, &data, sizeof(char))< 0) {
-		perror("Arduino::sendUchar():write():");
-		fprintf(stderr,"during write 0x%02x (%c)\n",data,data);
-		return(-1);
-	}
-	usleep(100);
-	return(0);
+	return(sendFrame(&data, 1));
 }
+
 int Arduino::sendString(const string datastr) {
-	int rv=0;
-	for (int i=0; i<datastr.size(); i++) {
-		unsigned char data = (unsigned char)datastr[i];
+	return(sendFrame((const unsigned char*)datastr.data(), datastr.size()));
+}
+
+// Write a whole message with as few write() calls as the tty allows. The port
+// is non-blocking, so a full output queue is waited out with select() rather
+// than dropping the tail of the frame.
+int Arduino::sendFrame(const unsigned char* data, int len) {
 #ifdef DEBUG
-		printf("Arduino::sendString sending: %01x\n",data);
+	printf("Arduino::sendFrame sending %d bytes:",len);
+	for (int i=0; i<len; i++) printf(" 0x%02x",data[i]);
+	printf("\n");
 #endif // DEBUG
-		rv |= sendUchar(data);
+	int sent=0;
+	while (sent < len) {
+		int n = write(fd, data+sent, len-sent);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) {
+				fd_set wfds;
+				struct timeval tv;
+				tv.tv_sec = ARDUINO_WRITE_TIMEOUT / 1000;
+				tv.tv_usec = (ARDUINO_WRITE_TIMEOUT % 1000) * 1000;
+				FD_ZERO(&wfds);
+				FD_SET(fd, &wfds);
+				if (select(fd+1, NULL, &wfds, NULL, &tv) > 0) continue;
+			}
+			perror("Arduino::sendFrame():write():");
+			fprintf(stderr,"during write of %d byte frame (0x%02x)\n",len,data[0]);
+			return(-1);
+		}
+		sent += n;
 	}
-	return(rv);
+	if (frameDelay > 0) usleep(frameDelay);
+	return(0);
+}
+
+void Arduino::setFrameDelay(int usec) {
+	frameDelay = usec;
 }
 
 int Arduino::readPort(void *buff, int count) {
-	int msec=10; //timeout
+	return(readPort(buff, count, ARDUINO_READ_TIMEOUT));
+}
+
+int Arduino::readPort(void *buff, int count, int timeout_ms) {
 	//if (!port_is_open) return -1;
 	if (count <= 0) return 0;
 
-	fd_set rfds;
-	struct timeval tv;
-	tv.tv_sec = msec / 1000;
-	tv.tv_usec = (msec % 1000) * 1000;
-	FD_ZERO(&rfds);
-	FD_SET(fd, &rfds);
-	if (select(fd+1, &rfds, NULL, NULL, &tv)==0) return 0; 
+	struct pollfd pfd[2];
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wakeFd;
+	pfd[1].events = POLLIN;
+	int r = poll(pfd, wakeFd >= 0 ? 2 : 1, timeout_ms);
+	if (r <= 0) return 0;
+	if (wakeFd >= 0 && (pfd[1].revents & POLLIN)) {
+		uint64_t n;
+		if (read(wakeFd, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("Arduino::readPort():read(wake):");
+		if (!(pfd[0].revents & POLLIN)) return 0;
+	}
 
 	int n, bits;
 	n = read(fd, buff, count);
@@ -85,38 +157,75 @@ int Arduino::readPort(void *buff, int count) {
 }
 
 
+void Arduino::wake() {
+	if (wakeFd >= 0) {
+		uint64_t one = 1;
+		if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("Arduino::wake():write():");
+	}
+}
+
+int Arduino::portFd() {
+	return fd;
+}
+
+void Arduino::setLowLatency(bool enable) {
+	lowLatency = enable;
+}
+
+// TIOCEXCL turns away any other open of the tty, the flock() stops programs
+// that lock serial ports the usual way (pyserial's exclusive=True, lockdev)
+// from sharing it, and tells us if one of them already has it.
+int Arduino::claimPort() {
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		if (errno == EWOULDBLOCK) {
+			fprintf(stderr,"Arduino::claimPort(): %s is in use by another program\n",serialPort);
+		} else {
+			perror("Arduino::claimPort():flock():");
+		}
+		return(-1);
+	}
+	if (ioctl(fd, TIOCEXCL) < 0) {
+		perror("Arduino::claimPort():ioctl(TIOCEXCL):");
+		return(-1);
+	}
+	return(0);
+}
+
+// Best effort: not every tty supports these, and the sysfs latency timer is
+// usually only writable by root or a udev rule. ASYNC_LOW_LATENCY lowers the
+// latency timer too on ftdi_sio.
+void Arduino::reduceLatency() {
+	struct serial_struct ss;
+	if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &ss) < 0) perror("Arduino::reduceLatency():ioctl(TIOCSSERIAL):");
+	}
+	char real[PATH_MAX];
+	if (realpath(serialPort, real) != NULL) {
+		char timer[PATH_MAX + 64];
+		snprintf(timer, sizeof(timer), "/sys/bus/usb-serial/devices/%s/latency_timer", basename(real));
+		FILE* f = fopen(timer, "w");
+		if (f != NULL) {
+			fprintf(f, "%d\n", ARDUINO_LATENCY_TIMER);
+			fclose(f);
+		}
+	}
+	// The port stays non-blocking: reads wait in poll() and return whatever
+	// has arrived, and sendFrame() needs EAGAIN to bound a stuck write
+}
+
 int Arduino::openPort(const char* _serialPort) {
 	return(openPort(_serialPort,ARDUINO_DEFAULT_BAUD));
 }
 
 int Arduino::openPort(const char* _serialPort, int _baud) {
 	strncpy(serialPort,_serialPort,sizeof(serialPort)-1);
-	switch(_baud) {
-		case 1152000:
-			baud=B115200;
-			break;
-		case 57600:
-			baud=B57600;
-			break;
-		case 38400:
-			baud=B38400;
-			break;
-		case 19200:
-			baud=B19200;
-			break;
-		case 9600:
-			baud=B9600;
-			break;
-		case 4800:
-			baud=B4800;
-			break;
-		case 2400:
-			baud=B2400;
-			break;
-		default:
-			baud=B115200;
-			break;
+	if (baudSpeed(_baud) == B0) {
+		fprintf(stderr,"Arduino::openPort(): unsupported baud rate %d\n",_baud);
+		return(-1);
 	}
+	baud = baudSpeed(_baud);
+	baudRate = _baud;
 
 	if(fd >= 0) {
 		fprintf(stderr,"Connection to %s already open\n",serialPort);
@@ -131,6 +240,11 @@ int Arduino::openPort(const char* _serialPort, int _baud) {
 		perror("Arduino::openPort():open():");
 		return(-1);
 	}
+	if (lowLatency && claimPort() != 0) {
+		close(fd);
+		fd = -1;
+		return(-1);
+	}
 	if(tcflush(fd, TCIFLUSH) < 0) {
 		perror("Arduino::openPort():tcflush():");
 		close(fd);
@@ -149,7 +263,6 @@ int Arduino::openPort(const char* _serialPort, int _baud) {
 	cfsetispeed(&term, baud);
 	cfsetospeed(&term, baud);
 	term.c_cflag |= (CLOCAL | CREAD | CS8 );
-	term.c_iflag |= ICRNL;
 
 	if(tcsetattr(fd, TCSAFLUSH, &term) < 0) {
 		perror("Arduino::openPort():tcsetattr():");
@@ -157,6 +270,8 @@ int Arduino::openPort(const char* _serialPort, int _baud) {
 		fd = -1;
 		return(-1);
 	}
+	if (lowLatency) reduceLatency();
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	/* TODO
 	if(storeFirmwareVersion() < 0) {
 		perror("Arduino::openPort():storeFirmwareVersion():");
@@ -185,6 +300,28 @@ int Arduino::openPort(const char* _serialPort, int _baud) {
 	return(0);
 }
 
+int Arduino::setBaud(int _baud) {
+	speed_t speed = baudSpeed(_baud);
+	if (speed == B0) {
+		fprintf(stderr,"Arduino::setBaud(): unsupported baud rate %d\n",_baud);
+		return(-1);
+	}
+	if (fd < 0) return(-1);
+	cfsetispeed(&term, speed);
+	cfsetospeed(&term, speed);
+	if(tcsetattr(fd, TCSADRAIN, &term) < 0) {
+		perror("Arduino::setBaud():tcsetattr():");
+		return(-1);
+	}
+	baud = speed;
+	baudRate = _baud;
+	return(0);
+}
+
+int Arduino::getBaud() {
+	return(baudRate);
+}
+
 int Arduino::closePort() {
 	int rv = 0;
 	rv |= flushPort();
@@ -192,16 +329,18 @@ int Arduino::closePort() {
 		fprintf(stderr,"Connection to %s already closed\n",serialPort);
 		rv |= -1;
 	}
-	else if(tcsetattr(fd, TCSAFLUSH, &oldterm) < 0) {
-		perror("Arduino::closePort():tcsetattr():");
-		rv |= -2;
+	else {
+		if(tcsetattr(fd, TCSAFLUSH, &oldterm) < 0) {
+			perror("Arduino::closePort():tcsetattr():");
+			rv |= -2;
+		}
 		if (close(fd) < 0) {
 			perror("Arduino::closePort():close():");
 			rv |= -4;
 		}
-		else {
-			fd = -1;
-		}
+		fd = -1;
+		if (wakeFd >= 0) close(wakeFd);
+		wakeFd = -1;
 	}
 	return(rv);
 }
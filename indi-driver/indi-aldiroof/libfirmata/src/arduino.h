@@ -33,6 +33,10 @@
 #define ARDUINO_HIGH           0x01 // digital output pin 5V command
 #define ARDUINO_LOW            0x00 // digital output pin 0V command
 #define ARDUINO_MAX_DATA_BYTES 256
+#define ARDUINO_FRAME_DELAY_US 0    // pause after each frame. 0 = no pacing
+#define ARDUINO_WRITE_TIMEOUT  100  // ms to wait for the tty to drain on a short write
+#define ARDUINO_READ_TIMEOUT   10   // ms readPort() waits for data by default
+#define ARDUINO_LATENCY_TIMER  1    // ms, FTDI latency timer in low latency mode (the driver default is 16)
 
 using namespace std;
 
@@ -43,19 +47,43 @@ class Arduino {
 		int destroy();
 		int sendUchar(const unsigned char);
 		int sendString(const string);
+		int sendFrame(const unsigned char* data, int len);
+		void setFrameDelay(int usec);
 		int readPort(void *buff, int count);
+		// timeout_ms < 0 waits until data arrives or wake() is called
+		int readPort(void *buff, int count, int timeout_ms);
+		// Make a readPort() waiting in another thread return
+		void wake();
+		// The open port, for polling alongside other descriptors
+		int portFd();
+		// Opt in before openPort(): claim the port exclusively and ask the
+		// USB-serial driver not to hold back received bytes.
+		void setLowLatency(bool enable);
 		int openPort(const char* _serialPort);
 		int openPort(const char* _serialPort, int _baud);
+		// Change the speed of the open port once pending output has gone
+		int setBaud(int _baud);
+		int getBaud();
+		// termios speed for a baud rate, B0 if the platform has none
+		static speed_t baudSpeed(int _baud);
 		int closePort();
 		int flushPort();
 
 	protected:
 		/* Serial port to which the arduino is connected */
 		char serialPort[PATH_MAX];
-		int baud;
+		int baud;      // termios speed
+		int baudRate;  // the same in bits per second
 		struct termios oldterm;
 		struct termios term;
 		int flags;
+		/* Pause (usec) applied once after every frame written */
+		int frameDelay;
+		bool lowLatency;
+		/* eventfd that wakes readPort() */
+		int wakeFd;
+		int claimPort();
+		void reduceLatency();
 		/* File descriptor associated with serial connection (-1 if no valid
 		* connection) */
 		int fd;
@@ -12,19 +12,32 @@
 */
 
 #include <firmata.h>
+#include <algorithm>
 #include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 int debug=0;
 
 Firmata::Firmata() {
-	init("/dev/ttyACM0");
+	init("/dev/ttyACM0", FIRMATA_HANDSHAKE_TIMEOUT_MS, true, FIRMATA_DEFAULT_BAUD, false);
 }
 
 Firmata::Firmata(const char* _serialPort) {
-	init(_serialPort);
+	init(_serialPort, FIRMATA_HANDSHAKE_TIMEOUT_MS, true, FIRMATA_DEFAULT_BAUD, false);
+}
+
+Firmata::Firmata(const char* _serialPort, int timeout_ms, bool surveyPins) {
+	init(_serialPort, timeout_ms, surveyPins, FIRMATA_DEFAULT_BAUD, false);
+}
+
+Firmata::Firmata(const char* _serialPort, int timeout_ms, bool surveyPins, int baud, bool lowLatency) {
+	init(_serialPort, timeout_ms, surveyPins, baud, lowLatency);
 }
 
 Firmata::~Firmata() {
+	stopReader();
+	if (event_fd >= 0) close(event_fd);
 	delete arduino;
 }
 
@@ -61,39 +74,95 @@ int Firmata::writeDigitalPin(unsigned char pin, unsigned char mode) {
 		perror("Firmata::writeDigitalPin():invalid mode:");
 		return(-1);
 	}
-	rv |= arduino->sendUchar(FIRMATA_DIGITAL_MESSAGE+port);
-	rv |= sendValueAsTwo7bitBytes(digitalPortValue[port]); //ARDUINO_HIGH OR ARDUINO_LOW
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_DIGITAL_MESSAGE+port);
+	rv |= frame.putTwo7bitBytes(digitalPortValue[port]); //ARDUINO_HIGH OR ARDUINO_LOW
+	rv |= sendFrame(frame);
 	return(rv);
 
 }
 
+FirmataFrame::FirmataFrame() {
+	len = 0;
+}
+
+void FirmataFrame::reset() {
+	len = 0;
+}
+
+int FirmataFrame::put(unsigned char data) {
+	if (len >= (int)sizeof(buf)) {
+		fprintf(stderr,"FirmataFrame::put():frame full, dropping 0x%02x\n",data);
+		return(-1);
+	}
+	buf[len++] = data;
+	return(0);
+}
+
 // in Firmata (and MIDI) data bytes are 7-bits. The 8th bit serves as a flag to mark a byte as either command or data.
 // therefore you need two data bytes to send 8-bits (a char).  
-int Firmata::sendValueAsTwo7bitBytes(int value)
-{
-  int rv;
-  rv |= arduino->sendUchar(value & 127); // LSB
-  rv |= arduino->sendUchar(value >> 7 & 127); // MSB
-  return rv;
+int FirmataFrame::putTwo7bitBytes(int value) {
+	int rv=0;
+	rv |= put(value & 127); // LSB
+	rv |= put(value >> 7 & 127); // MSB
+	return(rv);
+}
+
+int FirmataFrame::putStringData(const char* data) {
+	int rv=0;
+	// A frame cut short would lose its END_SYSEX and the board would swallow the next message as part of it
+	if (len + (int)strlen(data)*2 + 3 > (int)sizeof(buf)) {
+		fprintf(stderr,"FirmataFrame::putStringData():string of %d chars too long for a frame\n",(int)strlen(data));
+		return(-1);
+	}
+	rv |= put(FIRMATA_START_SYSEX);
+	rv |= put(FIRMATA_STRING_DATA);
+	for (const char* c=data; *c; c++) {
+		rv |= putTwo7bitBytes((unsigned char)*c);
+	}
+	rv |= put(FIRMATA_END_SYSEX);
+	return(rv);
+}
+
+const unsigned char* FirmataFrame::data() const {
+	return(buf);
+}
+
+int FirmataFrame::size() const {
+	return(len);
+}
+
+int Firmata::sendFrame(const FirmataFrame& frame) {
+	if (arduino->sendFrame(frame.data(), frame.size()) < 0) {
+		linkDown = true;
+		signalEvent();
+		return(-1);
+	}
+	txBytes += frame.size();
+	return(0);
 }
 
 
 
 int Firmata::setSamplingInterval(int16_t value) {
 	int rv=0;
-	rv |= arduino->sendUchar(FIRMATA_START_SYSEX);
-	rv |= arduino->sendUchar(FIRMATA_SAMPLING_INTERVAL);
-	rv |= arduino->sendUchar((unsigned char)(value % 128));
-	rv |= arduino->sendUchar((unsigned char)(value >> 7));
-	rv |= arduino->sendUchar(FIRMATA_END_SYSEX);
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_START_SYSEX);
+	rv |= frame.put(FIRMATA_SAMPLING_INTERVAL);
+	rv |= frame.put((unsigned char)(value % 128));
+	rv |= frame.put((unsigned char)(value >> 7));
+	rv |= frame.put(FIRMATA_END_SYSEX);
+	rv |= sendFrame(frame);
 	return(rv);
 }
 
 int Firmata::setPinMode(unsigned char pin, unsigned char mode) {
 	int rv = 0;
-	rv |= arduino->sendUchar(FIRMATA_SET_PIN_MODE);
-	rv |= arduino->sendUchar(pin);
-	rv |= arduino->sendUchar(mode);
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_SET_PIN_MODE);
+	rv |= frame.put(pin);
+	rv |= frame.put(mode);
+	rv |= sendFrame(frame);
 	usleep(1000);
 	askPinState(pin);
   return(rv);
@@ -101,41 +170,51 @@ int Firmata::setPinMode(unsigned char pin, unsigned char mode) {
 
 int Firmata::setPwmPin(unsigned char pin, int16_t value) {
 	int rv=0;
-	rv |= arduino->sendUchar(FIRMATA_ANALOG_MESSAGE+pin);
-	rv |= arduino->sendUchar((unsigned char)(value % 128));
-	rv |= arduino->sendUchar((unsigned char)(value >> 7));
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_ANALOG_MESSAGE+pin);
+	rv |= frame.put((unsigned char)(value % 128));
+	rv |= frame.put((unsigned char)(value >> 7));
+	rv |= sendFrame(frame);
 	return(rv);
 }
 int Firmata::mapAnalogChannels() {
 	int rv=0;
-	rv |= arduino->sendUchar(FIRMATA_START_SYSEX);
-	rv |= arduino->sendUchar(FIRMATA_ANALOG_MAPPING_QUERY); // read firmata name & version
-	rv |= arduino->sendUchar(FIRMATA_END_SYSEX);
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_START_SYSEX);
+	rv |= frame.put(FIRMATA_ANALOG_MAPPING_QUERY); // read firmata name & version
+	rv |= frame.put(FIRMATA_END_SYSEX);
+	rv |= sendFrame(frame);
 	return(rv);
 }
 
 int Firmata::askFirmwareVersion() {
 	int rv=0;
-	rv |= arduino->sendUchar(FIRMATA_START_SYSEX);
-	rv |= arduino->sendUchar(FIRMATA_REPORT_FIRMWARE); // read firmata name & version
-	rv |= arduino->sendUchar(FIRMATA_END_SYSEX);
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_START_SYSEX);
+	rv |= frame.put(FIRMATA_REPORT_FIRMWARE); // read firmata name & version
+	rv |= frame.put(FIRMATA_END_SYSEX);
+	rv |= sendFrame(frame);
 	return(rv);
 }
 
 int Firmata::askCapabilities() {
 	int rv=0;
-	rv |= arduino->sendUchar(FIRMATA_START_SYSEX);
-	rv |= arduino->sendUchar(FIRMATA_CAPABILITY_QUERY); 
-	rv |= arduino->sendUchar(FIRMATA_END_SYSEX);
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_START_SYSEX);
+	rv |= frame.put(FIRMATA_CAPABILITY_QUERY);
+	rv |= frame.put(FIRMATA_END_SYSEX);
+	rv |= sendFrame(frame);
 	return(rv);
 }
 
 int Firmata::askPinState(int pin) {
 	int rv=0;
-	rv |= arduino->sendUchar(FIRMATA_START_SYSEX);
-	rv |= arduino->sendUchar(FIRMATA_PIN_STATE_QUERY);
-	rv |= arduino->sendUchar(pin);  
-	rv |= arduino->sendUchar(FIRMATA_END_SYSEX);
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_START_SYSEX);
+	rv |= frame.put(FIRMATA_PIN_STATE_QUERY);
+	rv |= frame.put(pin);
+	rv |= frame.put(FIRMATA_END_SYSEX);
+	rv |= sendFrame(frame);
 	rv |= usleep(1000);
 	rv |= OnIdle();
 	return(rv);
@@ -143,19 +222,23 @@ int Firmata::askPinState(int pin) {
 
 int  Firmata::reportDigitalPorts(int enable) {
 	int rv=0;
+	FirmataFrame frame;
 	for (int i=0; i<20; i++) {
-		rv |= arduino->sendUchar(FIRMATA_REPORT_DIGITAL | i);  // report analog
-		rv |= arduino->sendUchar(enable);
+		rv |= frame.put(FIRMATA_REPORT_DIGITAL | i);  // report analog
+		rv |= frame.put(enable);
 	}
+	rv |= sendFrame(frame);
 	return(rv);
 }
 
 int Firmata::reportAnalogPorts(int enable) {
 	int rv=0;
+	FirmataFrame frame;
 	for (int i=0; i<20; i++) {
-		rv |= arduino->sendUchar(FIRMATA_REPORT_ANALOG | i);  // report analog
-		rv |= arduino->sendUchar(enable);
+		rv |= frame.put(FIRMATA_REPORT_ANALOG | i);  // report analog
+		rv |= frame.put(enable);
 	}
+	rv |= sendFrame(frame);
 	return(rv);
 }
 
@@ -182,208 +265,351 @@ int Firmata::flushPort() {
 	return(0);
 }
 
+int Firmata::setBaud(int baud) {
+	return(arduino->setBaud(baud));
+}
+
+int Firmata::getBaud() {
+	return(arduino->getBaud());
+}
+
 int Firmata::sendStringData(char* data) {
-	//TODO Testting
 	int rv=0;
-	int i;
-	char c;
-	rv |= arduino->sendUchar(FIRMATA_START_SYSEX);
-	rv |= arduino->sendUchar(FIRMATA_STRING_DATA);
-	for (int i=0; i < strlen(data); i++) {
-		rv|=sendValueAsTwo7bitBytes(data[i]);
-	}
-	rv |= arduino->sendUchar(FIRMATA_END_SYSEX);
-	return(rv);
+	FirmataFrame frame;
+	rv |= frame.putStringData(data);
+	if (rv != 0) return(rv);
+	return(sendFrame(frame));
+}
+
+int Firmata::sendSysex(uint8_t id, const uint8_t* data, int len) {
+	int rv=0;
+	FirmataFrame frame;
+	rv |= frame.put(FIRMATA_START_SYSEX);
+	rv |= frame.put(id & 0x7F);
+	for (int i=0; i < len; i++) {
+		rv |= frame.put(data[i] & 0x7F);
+	}
+	rv |= frame.put(FIRMATA_END_SYSEX);
+	if (rv != 0) return(rv);
+	return(sendFrame(frame));
 }
 
-int Firmata::init(const char* _serialPort) {
+int Firmata::init(const char* _serialPort, int timeout_ms, bool surveyPins, int baud, bool lowLatency) {
 	arduino = new Arduino();
+	arduino->setLowLatency(lowLatency);
 	portOpen = 0;
-	if (arduino->openPort(_serialPort,FIRMATA_DEFAULT_BAUD) != 0) {
+	readerRunning = false;
+	ioLoop = NULL;
+	linkDown = false;
+	rxBytes = 0;
+	txBytes = 0;
+	initHandlers();
+	parser.reset();
+	firmata_name[0] = 0;
+	string_buffer[0] = 0;
+	memset(pin_info, 0, sizeof(pin_info));
+	for (int pin=0; pin<128; pin++) {
+		pin_info[pin].analog_channel = 127;
+	}
+	memset(digitalPortValue, 0, sizeof(digitalPortValue));
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	nextRequestId = 0;
+	handshakeState = FIRMATA_HS_FAILED;
+	if (arduino->openPort(_serialPort,baud) != 0) {
 		if (debug) fprintf(stderr,"sf->openPort(%s) failed: exiting\n",_serialPort);
 		return 1;
 	}
+	if (handshake(timeout_ms, surveyPins) != 0) {
+		if (debug) fprintf(stderr,"Firmata::init():no firmware report from %s within %dms\n",_serialPort,timeout_ms);
+		arduino->closePort();
+		return 1;
+	}
+	if (debug) printf("FIRMATA ARDUINO BOARD:%s\n",firmata_name);
+	portOpen=1;
+	return 0;
+}
 
-	askFirmwareVersion();
-	usleep(1000);
-	while(true) {
-		OnIdle();
-		if(strlen(firmata_name)>0) {
-			if (debug) printf("FIRMATA ARDUINO BOARD:%s\n",firmata_name);
-			fflush(stdout);
-			portOpen=1;
-			break;
+static int elapsedMs(const struct timespec& start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+// Connect handshake. DoMessage advances handshakeState as replies arrive, in
+// whatever order the board sends them; this just keeps the port drained until
+// the state machine finishes or the deadline passes. Only the firmware report
+// is mandatory: a board that ignores the survey queries still connects once
+// the deadline is reached.
+int Firmata::handshake(int timeout_ms, bool surveyPins)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	capabilitiesReported = false;
+	analogMappingReported = false;
+	pinStatesReported = 0;
+	handshakeState = FIRMATA_HS_FIRMWARE;
+
+	int lastAsk = -FIRMATA_HANDSHAKE_RETRY_MS;
+	while (handshakeState == FIRMATA_HS_FIRMWARE) {
+		int elapsed = elapsedMs(start);
+		if (elapsed >= timeout_ms) {
+			handshakeState = FIRMATA_HS_FAILED;
+			return -1;
+		}
+		// A board that was reset by opening the port misses the first query while its bootloader runs
+		if (elapsed - lastAsk >= FIRMATA_HANDSHAKE_RETRY_MS) {
+			askFirmwareVersion();
+			lastAsk = elapsed;
+		}
+		if (OnIdle() < 0) {
+			handshakeState = FIRMATA_HS_FAILED;
+			return -1;
 		}
 	}
-	askCapabilities();
-	usleep(1000);
-	OnIdle();
-        mapAnalogChannels();
-	usleep(1000);
-	OnIdle();
-	for (int pin=0;pin<20;pin++) {
-		askPinState(pin);
+	if (!surveyPins) {
+		handshakeState = FIRMATA_HS_DONE;
+		return 0;
+	}
+
+	// Ask everything at once rather than one round trip per pin
+	FirmataFrame frame;
+	frame.put(FIRMATA_START_SYSEX);
+	frame.put(FIRMATA_CAPABILITY_QUERY);
+	frame.put(FIRMATA_END_SYSEX);
+	frame.put(FIRMATA_START_SYSEX);
+	frame.put(FIRMATA_ANALOG_MAPPING_QUERY);
+	frame.put(FIRMATA_END_SYSEX);
+	for (int pin=0; pin<FIRMATA_SURVEY_PINS; pin++) {
+		frame.put(FIRMATA_START_SYSEX);
+		frame.put(FIRMATA_PIN_STATE_QUERY);
+		frame.put(pin);
+		frame.put(FIRMATA_END_SYSEX);
+	}
+	handshakeState = FIRMATA_HS_SURVEY;
+	sendFrame(frame);
+	while (!handshakeComplete() && elapsedMs(start) < timeout_ms) {
+		if (OnIdle() < 0) break;
 	}
+	if (debug && !handshakeComplete()) printf("Pin survey incomplete, continuing without it\n");
+	handshakeState = FIRMATA_HS_DONE;
 	return 0;
 }
 
+bool Firmata::handshakeComplete()
+{
+	return capabilitiesReported && analogMappingReported &&
+		pinStatesReported == ((1u << FIRMATA_SURVEY_PINS) - 1);
+}
+
 void Firmata::Parse(const uint8_t *buf, int len)
 {
-	const uint8_t *p, *end;
-
-	p = buf;
-	end = p + len;
-	for (p = buf; p < end; p++) {
-		uint8_t msn = *p & 0xF0;
-		if (msn == 0xE0 || msn == 0x90 || *p == 0xF9) {
-			parse_command_len = 3;
-			parse_count = 0;
-		} else if (msn == 0xC0 || msn == 0xD0) {
-			parse_command_len = 2;
-			parse_count = 0;
-		} else if (*p == FIRMATA_START_SYSEX) {
-			parse_count = 0;
-			parse_command_len = sizeof(parse_buf);
-		} else if (*p == FIRMATA_END_SYSEX) {
-			parse_command_len = parse_count + 1;
-		} else if (*p & 0x80) {
-			parse_command_len = 1;
-			parse_count = 0;
-		}
-		if (parse_count < (int)sizeof(parse_buf)) {
-			parse_buf[parse_count++] = *p;
-		}
-		if (parse_count == parse_command_len) {
-			DoMessage();
-			parse_count = parse_command_len = 0;
-		}
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + len;
+	firmata_view_t msg;
+	rxBytes += len;
+	while (parser.next(&p, end, msg)) {
+		DoMessage(msg);
 	}
 }
 
-void Firmata::DoMessage(void)
+// Dispatch tables. Channel messages are keyed by their command nibble, sysex
+// messages by their sysex id. Built-in handlers can be replaced for a sysex
+// id with attachSysex().
+void Firmata::initHandlers(void)
 {
-	uint8_t cmd = (parse_buf[0] & 0xF0);
+	for (int i=0; i<16; i++) commandHandlers[i] = NULL;
+	for (int i=0; i<128; i++) sysexHandlers[i] = NULL;
+	commandHandlers[FIRMATA_ANALOG_MESSAGE >> 4] = &Firmata::handleAnalogMessage;
+	commandHandlers[FIRMATA_DIGITAL_MESSAGE >> 4] = &Firmata::handleDigitalMessage;
+	commandHandlers[FIRMATA_START_SYSEX >> 4] = &Firmata::handleSysex;
+	sysexHandlers[FIRMATA_REPORT_FIRMWARE] = &Firmata::handleFirmwareReport;
+	sysexHandlers[FIRMATA_CAPABILITY_RESPONSE] = &Firmata::handleCapabilityResponse;
+	sysexHandlers[FIRMATA_ANALOG_MAPPING_RESPONSE] = &Firmata::handleAnalogMappingResponse;
+	sysexHandlers[FIRMATA_PIN_STATE_RESPONSE] = &Firmata::handlePinStateResponse;
+	sysexHandlers[FIRMATA_STRING_DATA] = &Firmata::handleStringData;
+	sysexHandlers[FIRMATA_EXTENDED_ANALOG] = &Firmata::handleExtendedAnalog;
+	sysexHandlers[FIRMATA_I2C_REPLY] = &Firmata::handleI2cReply;
+	for (int ch=0; ch<16; ch++) analog_pin[ch] = 127;
+}
 
-	//if (debug) printf("message, %d bytes, %02X\n", parse_count, parse_buf[0]);
+// Replace the handler for a sysex id. The callback runs on whichever thread
+// is parsing (the reader thread once startReader() has been called) and the
+// view is only valid for the duration of the call. Pass an empty function to
+// restore the built-in handler.
+void Firmata::attachSysex(uint8_t id, firmata_sysex_callback_t callback)
+{
+	sysexCallbacks[id & 0x7F] = callback;
+}
 
-	if (cmd ==FIRMATA_ANALOG_MESSAGE && parse_count == 3) {
-		int analog_ch = (parse_buf[0] & 0x0F);
-		int analog_val = parse_buf[1] | (parse_buf[2] << 7);
-		for (int pin=0; pin<128; pin++) {
-			if (pin_info[pin].analog_channel == analog_ch) {
-				pin_info[pin].value = analog_val;
-				if (debug) printf("pin %d is A%d = %d\n", pin, analog_ch, analog_val);
-				return;
-			}
-		}
+void Firmata::DoMessage(const firmata_view_t& msg)
+{
+	//if (debug) printf("message, %d bytes, %02X\n", msg.len, msg.command);
+	firmata_handler_t handler = commandHandlers[msg.command >> 4];
+	if (handler) (this->*handler)(msg);
+}
+
+void Firmata::handleSysex(const firmata_view_t& msg)
+{
+	if (msg.command != FIRMATA_START_SYSEX) return;
+	if (msg.sysex_id <= FIRMATA_CUSTOM_SYSEX_MAX && completeSysexRequest(msg)) return;
+	if (sysexCallbacks[msg.sysex_id]) {
+		sysexCallbacks[msg.sysex_id](msg);
 		return;
 	}
-	if (cmd == FIRMATA_DIGITAL_MESSAGE && parse_count == 3) {
-		int port_num = (parse_buf[0] & 0x0F);
-		int port_val = parse_buf[1] | (parse_buf[2] << 7);
-		int pin = port_num * 8;
-		if (debug) printf("port_num = %d, port_val = %d\n", port_num, port_val);
-		for (int mask=1; mask & 0xFF; mask <<= 1, pin++) {
-			if (pin_info[pin].mode == FIRMATA_MODE_INPUT) {
-				uint32_t val = (port_val & mask) ? 1 : 0;
-				if (pin_info[pin].value != val) {
-					if (debug) printf("pin %d is %d\n", pin, val);
-					pin_info[pin].value = val;
-				}
+	firmata_handler_t handler = sysexHandlers[msg.sysex_id];
+	if (handler) {
+		(this->*handler)(msg);
+	} else if (msg.sysex_id <= FIRMATA_CUSTOM_SYSEX_MAX) {
+		publishSysex(msg);
+	}
+}
+
+void Firmata::publishSysex(const firmata_view_t& msg)
+{
+	firmata_msg_t out;
+	out.command = FIRMATA_START_SYSEX;
+	out.port = msg.sysex_id;
+	out.value = 0;
+	out.text[0] = 0;
+	out.len = msg.len < FIRMATA_MSG_SYSEX_BYTES ? msg.len : FIRMATA_MSG_SYSEX_BYTES;
+	memcpy(out.data, msg.data, out.len);
+	publish(out);
+}
+
+void Firmata::handleAnalogMessage(const firmata_view_t& msg)
+{
+	int analog_ch = msg.channel;
+	int analog_val = msg.data[0] | (msg.data[1] << 7);
+	int pin = analog_pin[analog_ch];
+	if (pin < 128) {
+		pin_info[pin].value = analog_val;
+		if (debug) printf("pin %d is A%d = %d\n", pin, analog_ch, analog_val);
+	}
+}
+
+void Firmata::handleDigitalMessage(const firmata_view_t& msg)
+{
+	int port_num = msg.channel;
+	int port_val = msg.data[0] | (msg.data[1] << 7);
+	int pin = port_num * 8;
+	if (debug) printf("port_num = %d, port_val = %d\n", port_num, port_val);
+	for (int mask=1; mask & 0xFF; mask <<= 1, pin++) {
+		if (pin_info[pin].mode == FIRMATA_MODE_INPUT) {
+			uint32_t val = (port_val & mask) ? 1 : 0;
+			if (pin_info[pin].value != val) {
+				if (debug) printf("pin %d is %d\n", pin, val);
+				pin_info[pin].value = val;
 			}
 		}
-		return;
 	}
+	firmata_msg_t out;
+	out.command = FIRMATA_DIGITAL_MESSAGE;
+	out.port = port_num;
+	out.value = port_val;
+	out.text[0] = 0;
+	out.len = 0;
+	publish(out);
+}
 
+void Firmata::handleFirmwareReport(const firmata_view_t& msg)
+{
+	if (msg.len < 2) return;
+	snprintf(firmata_name, sizeof(firmata_name), "%s-%c.%c", msg.text, msg.data[0] + '0', msg.data[1] + '0');
+	if (handshakeState == FIRMATA_HS_FIRMWARE) handshakeState = FIRMATA_HS_SURVEY;
+	//if (debug) printf("FIRMWARE:%s\n",firmata_name);
+}
 
-	if (parse_buf[0] == FIRMATA_START_SYSEX && parse_buf[parse_count-1] == FIRMATA_END_SYSEX) {
-		// Sysex message
-		if (parse_buf[1] == FIRMATA_REPORT_FIRMWARE) {
-			char name[140];
-			int len=0;
-			for (int i=4; i < parse_count-2; i+=2) {
-				name[len++] = (parse_buf[i] & 0x7F)
-				  | ((parse_buf[i+1] & 0x7F) << 7);
-			}
-			name[len++] = '-';
-			name[len++] = parse_buf[2] + '0';
-			name[len++] = '.';
-			name[len++] = parse_buf[3] + '0';
-			name[len++] = 0;
-			strcpy(firmata_name,name);
-			//if (debug) printf("FIRMWARE:%s\n",firmata_name);
-			
-		} else if (parse_buf[1] == FIRMATA_CAPABILITY_RESPONSE) {
-			int pin, i, n;
-			for (pin=0; pin < 128; pin++) {
-				pin_info[pin].supported_modes = 0;
-			}
-			for (i=2, n=0, pin=0; i<parse_count; i++) {
-				if (parse_buf[i] == 127) {
-					pin++;
-					n = 0;
-					continue;
-				}
-				if (n == 0) {
-					// first byte is supported mode
-					pin_info[pin].supported_modes |= (1<<parse_buf[i]);
-					if (debug) printf("PIN:%u modes:%04x\n",pin,(short)pin_info[pin].supported_modes);
-				}
-				n = n ^ 1;
-			}
-		} else if (parse_buf[1] == FIRMATA_ANALOG_MAPPING_RESPONSE) {
-			int pin=0;
-			for (int i=2; i<parse_count-1; i++) {
-				pin_info[pin].analog_channel = parse_buf[i];
-				pin++;
-			}
-			return;
-		} else if (parse_buf[1] == FIRMATA_PIN_STATE_RESPONSE && parse_count >= 6) {
-			int pin = parse_buf[2];
-			pin_info[pin].mode = parse_buf[3];
-			pin_info[pin].value = parse_buf[4];
-			if (parse_count > 6) pin_info[pin].value |= (parse_buf[5] << 7);
-			if (parse_count > 7) pin_info[pin].value |= (parse_buf[6] << 14);
-			if (debug) printf("PIN:%u. Mode:%u. Value:%lu\n",pin,pin_info[pin].mode,pin_info[pin].value);
-		} else if (parse_buf[1] == FIRMATA_STRING_DATA ) {
-			if ( (parse_count -3 ) >= MAX_STRING_DATA_LEN ) {
-				if (debug) printf("FIRMATA_STRING_DATA TOO LARGE.%u Parsing up to max %u\n",(parse_count -3 ),MAX_STRING_DATA_LEN);
-				parse_count=FIRMATA_STRING_DATA+3;
-			}
-			char name[MAX_STRING_DATA_LEN];
-			int len=0;
-			for (int i=2; i < parse_count-2; i+=2) {
-				name[len++] = (parse_buf[i] & 0x7F)
-				  | ((parse_buf[i+1] & 0x7F) << 7);
-			}
-			name[len++] = 0;
-			strcpy(string_buffer,name);
-		} else if (parse_buf[1] == FIRMATA_EXTENDED_ANALOG) {
-			//TODO Testting
-			if ( (parse_count -3) > 8 ) printf("Extended analog max precision uint64_bit");
-			int pin=(parse_buf[2] & 0x7F);   //UP to 128 analogs
-			if (pin_info[pin].mode == FIRMATA_MODE_INPUT) {
-				int analog_val = (parse_buf[3] & 0x7F);
-				for (int i=4;i < parse_count -1 ; i++) {
-					analog_val = ( analog_val << 7 ) | ( parse_buf[i]  & 0x7F );			
-				}
-				pin_info[pin].value = analog_val;
-				if (debug) printf("Extended analog: pin %d = %d\n", pin, analog_val);
-			}
-		} else if (parse_buf[1] == FIRMATA_I2C_REPLY) {
-			//TODO Testting
-			if ( (parse_count -3) > 8 ) printf("I2C_REPLY max precision uint64_bit (8 bytes)");
-			int slaveAddress=(parse_buf[2] & 0x7F);   
-			slaveAddress = (slaveAddress <<7 )|| (parse_buf[3] & 0x7F); 
-			long i2c_val = (parse_buf[4] & 0x7F);
-			for (int i=4;i < parse_count -1 ; i++) {
-				i2c_val = ( i2c_val << 7 ) | ( parse_buf[i]  & 0x7F );			
-			}
-			//if (debug) printf("I2C_REPLY value: SlaveAddres %u = %d\n", slaveAddress, i2c_val);
+void Firmata::handleCapabilityResponse(const firmata_view_t& msg)
+{
+	int pin, i, n;
+	for (pin=0; pin < 128; pin++) {
+		pin_info[pin].supported_modes = 0;
+	}
+	for (i=0, n=0, pin=0; i<msg.len && pin<128; i++) {
+		if (msg.data[i] == 127) {
+			pin++;
+			n = 0;
+			continue;
+		}
+		if (n == 0) {
+			// first byte is supported mode
+			pin_info[pin].supported_modes |= (1ULL<<(msg.data[i] & 0x3F));
+			if (debug) printf("PIN:%u modes:%04x\n",pin,(short)pin_info[pin].supported_modes);
+		}
+		n = n ^ 1;
+	}
+	capabilitiesReported = true;
+}
+
+// Also builds the channel to pin reverse map so analog samples don't need to
+// search pin_info.
+void Firmata::handleAnalogMappingResponse(const firmata_view_t& msg)
+{
+	for (int ch=0; ch<16; ch++) analog_pin[ch] = 127;
+	for (int pin=0; pin<msg.len && pin<128; pin++) {
+		pin_info[pin].analog_channel = msg.data[pin];
+		if (msg.data[pin] < 16) analog_pin[msg.data[pin]] = pin;
+	}
+	analogMappingReported = true;
+}
 
+void Firmata::handlePinStateResponse(const firmata_view_t& msg)
+{
+	if (msg.len < 3) return;
+	int pin = msg.data[0];
+	pin_info[pin].mode = msg.data[1];
+	pin_info[pin].value = msg.data[2];
+	if (msg.len > 3) pin_info[pin].value |= (msg.data[3] << 7);
+	if (msg.len > 4) pin_info[pin].value |= (msg.data[4] << 14);
+	if (pin < FIRMATA_SURVEY_PINS) pinStatesReported |= (1u << pin);
+	if (debug) printf("PIN:%u. Mode:%u. Value:%lu\n",pin,pin_info[pin].mode,pin_info[pin].value);
+}
+
+void Firmata::handleStringData(const firmata_view_t& msg)
+{
+	if (msg.truncated && debug) printf("FIRMATA_STRING_DATA TOO LARGE. Truncated to %d chars\n",msg.text_len);
+	strncpy(string_buffer, msg.text, sizeof(string_buffer)-1);
+	string_buffer[sizeof(string_buffer)-1] = 0;
+	if (completeRequest(msg.text)) return;
+	firmata_msg_t out;
+	out.command = FIRMATA_STRING_DATA;
+	out.port = 0;
+	out.value = 0;
+	out.len = 0;
+	strncpy(out.text, msg.text, sizeof(out.text)-1);
+	out.text[sizeof(out.text)-1] = 0;
+	publish(out);
+}
+
+void Firmata::handleExtendedAnalog(const firmata_view_t& msg)
+{
+	//TODO Testting
+	if (msg.len < 2) return;
+	if ( (msg.len - 1) > 8 ) printf("Extended analog max precision uint64_bit");
+	int pin=(msg.data[0] & 0x7F);   //UP to 128 analogs
+	if (pin_info[pin].mode == FIRMATA_MODE_INPUT) {
+		int analog_val = (msg.data[1] & 0x7F);
+		for (int i=2;i < msg.len ; i++) {
+			analog_val = ( analog_val << 7 ) | ( msg.data[i]  & 0x7F );
 		}
-		return;
+		pin_info[pin].value = analog_val;
+		if (debug) printf("Extended analog: pin %d = %d\n", pin, analog_val);
+	}
+}
+
+void Firmata::handleI2cReply(const firmata_view_t& msg)
+{
+	//TODO Testting
+	if (msg.len < 3) return;
+	if ( (msg.len - 2) > 8 ) printf("I2C_REPLY max precision uint64_bit (8 bytes)");
+	int slaveAddress=(msg.data[0] & 0x7F);
+	slaveAddress = (slaveAddress <<7 ) | (msg.data[1] & 0x7F);
+	long i2c_val = (msg.data[2] & 0x7F);
+	for (int i=2;i < msg.len ; i++) {
+		i2c_val = ( i2c_val << 7 ) | ( msg.data[i]  & 0x7F );
 	}
+	//if (debug) printf("I2C_REPLY value: SlaveAddres %u = %d\n", slaveAddress, i2c_val);
 }
 
 int Firmata::OnIdle()
@@ -411,5 +637,362 @@ int Firmata::OnIdle()
 	} else if (r < 0) {
 		return r;
 	}
+	return 0;
+}
+
+// Queue a decoded message for the consumer and wake anyone blocked in
+// waitMessage() or polling eventFd().
+void Firmata::publish(const firmata_msg_t& msg)
+{
+	if (!messages.push(msg)) {
+		if (debug) printf("Firmata message queue full, dropping message 0x%02X\n", msg.command);
+		return;
+	}
+	signalEvent();
+}
+
+void Firmata::signalEvent()
+{
+	if (event_fd >= 0) {
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			perror("Firmata::signalEvent():write():");
+		}
+	}
+}
+
+bool Firmata::linkLost()
+{
+	return linkDown;
+}
+
+uint64_t Firmata::bytesReceived()
+{
+	return rxBytes;
+}
+
+uint64_t Firmata::bytesSent()
+{
+	return txBytes;
+}
+
+bool Firmata::popMessage(firmata_msg_t& msg)
+{
+	return messages.pop(msg);
+}
+
+// Block until a message is available or timeout_ms elapses.
+// Returns 1 with msg filled in, 0 on timeout, <0 on error.
+int Firmata::waitMessage(firmata_msg_t& msg, int timeout_ms)
+{
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (true) {
+		if (popMessage(msg)) return 1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed >= timeout_ms) return 0;
+		struct pollfd pfd;
+		pfd.fd = event_fd;
+		pfd.events = POLLIN;
+		int r = poll(&pfd, 1, timeout_ms - elapsed);
+		if (r < 0 && errno != EINTR) {
+			perror("Firmata::waitMessage():poll():");
+			return -1;
+		}
+		if (r > 0) {
+			uint64_t count;
+			if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+				perror("Firmata::waitMessage():read():");
+			}
+		}
+	}
+}
+
+// Readable whenever a decoded message has been queued. Suitable for an
+// external event loop; drain with popMessage().
+int Firmata::eventFd()
+{
+	return event_fd;
+}
+
+int Firmata::startReader()
+{
+	if (readerRunning) return 0;
+	readerRunning = true;
+	reader = std::thread(&Firmata::readerLoop, this);
+	return 0;
+}
+
+int Firmata::startReader(FirmataIoLoop& loop)
+{
+	if (readerRunning) return 0;
+	readerRunning = true;
+	ioLoop = &loop;
+	loop.add(this);
+	return 0;
+}
+
+void Firmata::stopReader()
+{
+	if (!readerRunning) return;
+	readerRunning = false;
+	if (ioLoop) {
+		ioLoop->remove(this);
+		ioLoop = NULL;
+		return;
+	}
+	arduino->wake();
+	if (reader.joinable()) reader.join();
+}
+
+void Firmata::readerLoop()
+{
+	while (readerRunning) {
+		// Sleeps until bytes arrive; stopReader() wakes it
+		if (readAvailable() < 0) break;
+	}
+}
+
+// Read and parse whatever the port has, waiting for it unless called from
+// a FirmataIoLoop that has already seen the port become readable.
+int Firmata::readAvailable()
+{
+	uint8_t buf[1024];
+	int r = arduino->readPort(buf, sizeof(buf), ioLoop ? 0 : -1);
+	if (r > 0) {
+		Parse(buf, r);
+	} else if (r < 0) {
+		// Port error, e.g. the USB device went away. Nothing more will arrive on this fd.
+		perror("Firmata::readAvailable():readPort():");
+		linkDown = true;
+		signalEvent();
+	}
+	return r;
+}
+
+FirmataIoLoop::FirmataIoLoop()
+{
+	running = false;
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd < 0) perror("FirmataIoLoop:eventfd():");
+}
+
+FirmataIoLoop::~FirmataIoLoop()
+{
+	running = false;
+	wake();
+	if (thread.joinable()) thread.join();
+	if (wakeFd >= 0) close(wakeFd);
+}
+
+// The thread starts with the first board and runs until the loop is destroyed
+void FirmataIoLoop::add(Firmata* board)
+{
+	std::lock_guard<std::mutex> lock(boardsLock);
+	boards.push_back(board);
+	if (!running) {
+		running = true;
+		thread = std::thread(&FirmataIoLoop::run, this);
+	}
+	wake();
+}
+
+void FirmataIoLoop::remove(Firmata* board)
+{
+	// Boards are only read with the lock held, so once we have it the board is ours again
+	std::lock_guard<std::mutex> lock(boardsLock);
+	boards.erase(std::remove(boards.begin(), boards.end(), board), boards.end());
+	wake();
+}
+
+void FirmataIoLoop::wake()
+{
+	if (wakeFd >= 0) {
+		uint64_t one = 1;
+		if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("FirmataIoLoop::wake():write():");
+	}
+}
+
+void FirmataIoLoop::run()
+{
+	vector<struct pollfd> fds;
+	vector<Firmata*> polled;
+	while (running) {
+		fds.clear();
+		polled.clear();
+		{
+			std::lock_guard<std::mutex> lock(boardsLock);
+			for (size_t i = 0; i < boards.size(); i++) {
+				struct pollfd pfd = { boards[i]->arduino->portFd(), POLLIN, 0 };
+				fds.push_back(pfd);
+				polled.push_back(boards[i]);
+			}
+		}
+		struct pollfd pfd = { wakeFd, POLLIN, 0 };
+		fds.push_back(pfd);
+		// Sleeps until a port has bytes; add(), remove() and the destructor wake it
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) continue;
+			perror("FirmataIoLoop::run():poll():");
+			break;
+		}
+		if (fds.back().revents & POLLIN) {
+			uint64_t n;
+			if (read(wakeFd, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("FirmataIoLoop::run():read(wake):");
+		}
+		std::lock_guard<std::mutex> lock(boardsLock);
+		for (size_t i = 0; i < polled.size(); i++) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			// Skip a board removed while we were polling
+			vector<Firmata*>::iterator it = std::find(boards.begin(), boards.end(), polled[i]);
+			if (it == boards.end()) continue;
+			if ((*it)->readAvailable() < 0) boards.erase(it);
+		}
+	}
+}
+
+void Firmata::expectReplies(const char* cmd, const vector<string>& replies)
+{
+	std::lock_guard<std::mutex> lock(requestLock);
+	expectedReplies[cmd] = replies;
+}
+
+// Register the request before sending so a fast reply can't race past it.
+firmata_request_t Firmata::sendRequest(const char* cmd)
+{
+	firmata_request_t req;
+	{
+		std::lock_guard<std::mutex> lock(requestLock);
+		pendingRequests.push_back(pending_request_t());
+		pending_request_t& pending = pendingRequests.back();
+		pending.id = ++nextRequestId;
+		pending.cmd = cmd;
+		req.id = pending.id;
+		req.reply = pending.reply.get_future().share();
+	}
+	if (sendStringData((char*)cmd) != 0) {
+		cancelRequest(req.id);
+	}
+	return req;
+}
+
+// Returns false on timeout or if the request could not be sent. A request
+// that times out is forgotten; a later reply is then treated as unsolicited.
+// One that arrives while the request is being forgotten is still returned.
+bool Firmata::waitReply(const firmata_request_t& req, std::chrono::milliseconds timeout, string& reply)
+{
+	if (req.reply.wait_for(timeout) != std::future_status::ready) {
+		cancelRequest(req.id);
+		// The reader may have matched the reply after the wait gave up, leaving nothing to cancel
+		if (req.reply.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) return false;
+	}
+	reply = req.reply.get();
+	return !reply.empty();
+}
+
+bool Firmata::request(const char* cmd, std::chrono::milliseconds timeout, string& reply)
+{
+	return waitReply(sendRequest(cmd), timeout, reply);
+}
+
+// Called from the parser with each STRING_DATA message. Returns true if it
+// answered an outstanding request.
+bool Firmata::completeRequest(const char* text)
+{
+	std::lock_guard<std::mutex> lock(requestLock);
+	for (std::list<pending_request_t>::iterator it = pendingRequests.begin(); it != pendingRequests.end(); ++it) {
+		map<string, vector<string> >::const_iterator expected = expectedReplies.find(it->cmd);
+		bool match = (expected == expectedReplies.end());  // no reply set registered: take the next string
+		if (!match) {
+			for (size_t i=0; i < expected->second.size(); i++) {
+				if (expected->second[i] == text) {
+					match = true;
+					break;
+				}
+			}
+		}
+		if (match) {
+			it->reply.set_value(text);
+			pendingRequests.erase(it);
+			signalEvent();
+			return true;
+		}
+	}
+	return false;
+}
+
+firmata_sysex_request_t Firmata::sendSysexRequest(uint8_t id, const uint8_t* data, int len, uint8_t replyId)
+{
+	firmata_sysex_request_t req;
+	{
+		std::lock_guard<std::mutex> lock(requestLock);
+		pendingSysexRequests.push_back(pending_sysex_request_t());
+		pending_sysex_request_t& pending = pendingSysexRequests.back();
+		pending.id = ++nextRequestId;
+		pending.replyId = replyId;
+		req.id = pending.id;
+		req.reply = pending.reply.get_future().share();
+	}
+	if (sendSysex(id, data, len) != 0) {
+		cancelSysexRequest(req.id);
+	}
+	return req;
+}
+
+bool Firmata::waitSysexReply(const firmata_sysex_request_t& req, std::chrono::milliseconds timeout, vector<uint8_t>& reply)
+{
+	if (req.reply.wait_for(timeout) != std::future_status::ready) {
+		cancelSysexRequest(req.id);
+		// The reader may have matched the reply after the wait gave up, leaving nothing to cancel
+		if (req.reply.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) return false;
+	}
+	reply = req.reply.get();
+	return !reply.empty();
+}
+
+bool Firmata::requestSysex(uint8_t id, const uint8_t* data, int len, uint8_t replyId, std::chrono::milliseconds timeout, vector<uint8_t>& reply)
+{
+	return waitSysexReply(sendSysexRequest(id, data, len, replyId), timeout, reply);
 }
 
+// Called from the parser with each custom sysex. Returns true if it answered
+// an outstanding request.
+bool Firmata::completeSysexRequest(const firmata_view_t& msg)
+{
+	if (msg.len == 0) return false;
+	std::lock_guard<std::mutex> lock(requestLock);
+	for (std::list<pending_sysex_request_t>::iterator it = pendingSysexRequests.begin(); it != pendingSysexRequests.end(); ++it) {
+		if (it->replyId == msg.sysex_id) {
+			it->reply.set_value(vector<uint8_t>(msg.data, msg.data + msg.len));
+			pendingSysexRequests.erase(it);
+			signalEvent();
+			return true;
+		}
+	}
+	return false;
+}
+
+void Firmata::cancelSysexRequest(unsigned id)
+{
+	std::lock_guard<std::mutex> lock(requestLock);
+	for (std::list<pending_sysex_request_t>::iterator it = pendingSysexRequests.begin(); it != pendingSysexRequests.end(); ++it) {
+		if (it->id == id) {
+			it->reply.set_value(vector<uint8_t>());
+			pendingSysexRequests.erase(it);
+			return;
+		}
+	}
+}
+
+void Firmata::cancelRequest(unsigned id)
+{
+	std::lock_guard<std::mutex> lock(requestLock);
+	for (std::list<pending_request_t>::iterator it = pendingRequests.begin(); it != pendingRequests.end(); ++it) {
+		if (it->id == id) {
+			it->reply.set_value("");
+			pendingRequests.erase(it);
+			return;
+		}
+	}
+}
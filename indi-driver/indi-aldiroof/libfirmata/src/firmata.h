@@ -11,10 +11,23 @@
    Firmata C++ library. 
 */
 
+#ifndef FIRMATA_H
+#define FIRMATA_H
 
 #include <vector>
+#include <list>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <functional>
 #include <stdint.h>
 #include <arduino.h>
+#include <spscqueue.h>
+#include <firmataparser.h>
 
 #define FIRMATA_MAX_DATA_BYTES            32 // max number of data bytes in non-Sysex messages
 //#define FIRMATA_DEFAULT_BAUD          115200
@@ -74,7 +87,20 @@
 #define FIRMATA_I2C_10BIT_ADDRESS_MODE_MASK B00100000
 
 
-#define MAX_STRING_DATA_LEN   164
+#define MAX_STRING_DATA_LEN   FIRMATA_MAX_TEXT_BYTES
+#define FIRMATA_MAX_FRAME_BYTES (MAX_STRING_DATA_LEN*2+3) // largest message we ever send
+#define FIRMATA_MSG_QUEUE_LEN   64   // decoded messages buffered between reader thread and consumer
+#define FIRMATA_MSG_SYSEX_BYTES 16   // custom sysex payload carried by a queued message
+#define FIRMATA_CUSTOM_SYSEX_MAX 0x0F // ids 0x00-0x0F are free for custom commands
+#define FIRMATA_HANDSHAKE_TIMEOUT_MS 3000 // give up on a board that hasn't answered by then
+#define FIRMATA_HANDSHAKE_RETRY_MS    250 // resend the firmware query this often while waiting
+#define FIRMATA_SURVEY_PINS            20 // pins asked for their state during the handshake
+
+// connect handshake states
+#define FIRMATA_HS_FIRMWARE   0 // waiting for the firmware name
+#define FIRMATA_HS_SURVEY     1 // waiting for capability, analog mapping and pin state replies
+#define FIRMATA_HS_DONE       2
+#define FIRMATA_HS_FAILED     3
 
 using namespace std;
 
@@ -85,12 +111,61 @@ typedef struct {
 	uint64_t value;
 } pin_t;
 
+// A decoded message handed from the reader thread to the consumer.
+typedef struct {
+	uint8_t command;                 // FIRMATA_STRING_DATA, FIRMATA_DIGITAL_MESSAGE or FIRMATA_START_SYSEX
+	uint8_t port;                    // digital port number, or the id of a custom sysex
+	uint16_t value;                  // digital port value
+	char text[MAX_STRING_DATA_LEN];  // string payload
+	uint8_t data[FIRMATA_MSG_SYSEX_BYTES]; // custom sysex payload
+	uint8_t len;
+} firmata_msg_t;
+
+// An outstanding STRING_DATA command waiting for its reply.
+typedef struct {
+	unsigned id;
+	std::shared_future<string> reply;
+} firmata_request_t;
+
+// An outstanding custom sysex command waiting for a reply sysex.
+typedef struct {
+	unsigned id;
+	std::shared_future<vector<uint8_t> > reply;
+} firmata_sysex_request_t;
+
+
 
+// A complete outgoing message assembled in one contiguous buffer so it can be
+// handed to the serial port with a single write.
+class FirmataFrame {
+	public:
+		FirmataFrame();
+		void reset();
+		int put(unsigned char data);
+		int putTwo7bitBytes(int value);
+		int putStringData(const char* data);
+		const unsigned char* data() const;
+		int size() const;
+	private:
+		unsigned char buf[FIRMATA_MAX_FRAME_BYTES];
+		int len;
+};
+
+// Called with each decoded sysex message for an id registered with attachSysex()
+typedef std::function<void(const firmata_view_t& msg)> firmata_sysex_callback_t;
+
+class FirmataIoLoop;
 
 class Firmata {
 	public:
 		Firmata();
 		Firmata(const char* _serialPort);
+		// Fail if the board hasn't reported its firmware within timeout_ms.
+		// surveyPins=false skips the capability/pin state survey for firmware
+		// that doesn't expose its pins.
+		Firmata(const char* _serialPort, int timeout_ms, bool surveyPins);
+		// lowLatency: see Arduino::setLowLatency()
+		Firmata(const char* _serialPort, int timeout_ms, bool surveyPins, int baud, bool lowLatency = false);
 		~Firmata();
 
 
@@ -107,20 +182,108 @@ class Firmata {
 		int systemReset();
 		int closePort();
 		int flushPort();
+		// Switch the host side of the link to another rate, e.g. once the
+		// board has agreed to it. Safe while the reader is running.
+		int setBaud(int baud);
+		int getBaud();
 		//int getSysExData();
 		int sendStringData(char* data);
+		int sendSysex(uint8_t id, const uint8_t* data, int len);
+		int sendFrame(const FirmataFrame& frame);
 		pin_t pin_info[128];
 		void print_state();
 		char firmata_name[140];
 		char string_buffer[MAX_STRING_DATA_LEN];
 		int OnIdle();
 		bool portOpen;
+		int handshakeState;
+		// Background reader. While running, OnIdle() must not be called.
+		int startReader();
+		// Read on a loop shared with other boards instead of a thread of our own
+		int startReader(FirmataIoLoop& loop);
+		void stopReader();
+		bool popMessage(firmata_msg_t& msg);
+		int waitMessage(firmata_msg_t& msg, int timeout_ms);
+		int eventFd();
+		// Set once a read or write on the port fails. The event fd is
+		// signalled when that happens; the Firmata object can't recover and
+		// should be deleted and recreated.
+		bool linkLost();
+		// Request/response over STRING_DATA. Replies are matched to the oldest
+		// outstanding request whose command lists them in expectReplies();
+		// anything unmatched is published to the message queue as before.
+		// A reply signals the event fd too, so a caller polling it can send a
+		// request, carry on, and collect the reply with a zero timeout.
+		void expectReplies(const char* cmd, const vector<string>& replies);
+		firmata_request_t sendRequest(const char* cmd);
+		bool waitReply(const firmata_request_t& req, std::chrono::milliseconds timeout, string& reply);
+		bool request(const char* cmd, std::chrono::milliseconds timeout, string& reply);
+		void attachSysex(uint8_t id, firmata_sysex_callback_t callback);
+		// Request/response over custom sysex ids (0x00-0x0F). The oldest
+		// outstanding request waiting for replyId takes the next sysex with
+		// that id; replies must carry at least one data byte. Custom sysex
+		// nobody is waiting for, and that has no handler attached, is
+		// published to the message queue.
+		firmata_sysex_request_t sendSysexRequest(uint8_t id, const uint8_t* data, int len, uint8_t replyId);
+		bool waitSysexReply(const firmata_sysex_request_t& req, std::chrono::milliseconds timeout, vector<uint8_t>& reply);
+		bool requestSysex(uint8_t id, const uint8_t* data, int len, uint8_t replyId, std::chrono::milliseconds timeout, vector<uint8_t>& reply);
+		// Bytes moved over the port since it was opened, for link statistics.
+		// Safe to read from any thread.
+		uint64_t bytesReceived();
+		uint64_t bytesSent();
         private:
-		int parse_count;
-		int parse_command_len;
-		uint8_t parse_buf[4096];
+		FirmataParser parser;
 		void Parse(const uint8_t *buf, int len);
-		void DoMessage(void);
+		void DoMessage(const firmata_view_t& msg);
+		typedef void (Firmata::*firmata_handler_t)(const firmata_view_t& msg);
+		firmata_handler_t commandHandlers[16];
+		firmata_handler_t sysexHandlers[128];
+		firmata_sysex_callback_t sysexCallbacks[128];
+		uint8_t analog_pin[16];  // analog channel -> pin, 127 if unmapped
+		void initHandlers(void);
+		void handleSysex(const firmata_view_t& msg);
+		void handleAnalogMessage(const firmata_view_t& msg);
+		void handleDigitalMessage(const firmata_view_t& msg);
+		void handleFirmwareReport(const firmata_view_t& msg);
+		void handleCapabilityResponse(const firmata_view_t& msg);
+		void handleAnalogMappingResponse(const firmata_view_t& msg);
+		void handlePinStateResponse(const firmata_view_t& msg);
+		void handleStringData(const firmata_view_t& msg);
+		void handleExtendedAnalog(const firmata_view_t& msg);
+		void handleI2cReply(const firmata_view_t& msg);
+		void publish(const firmata_msg_t& msg);
+		void readerLoop();
+		int readAvailable();
+		friend class FirmataIoLoop;
+		FirmataIoLoop* ioLoop;
+		std::thread reader;
+		std::atomic<bool> readerRunning;
+		std::atomic<bool> linkDown;
+		std::atomic<uint64_t> rxBytes;
+		std::atomic<uint64_t> txBytes;
+		void signalEvent();
+		SpscQueue<firmata_msg_t, FIRMATA_MSG_QUEUE_LEN> messages;
+		int event_fd;
+		typedef struct {
+			unsigned id;
+			string cmd;
+			std::promise<string> reply;
+		} pending_request_t;
+		bool completeRequest(const char* text);
+		void cancelRequest(unsigned id);
+		typedef struct {
+			unsigned id;
+			uint8_t replyId;
+			std::promise<vector<uint8_t> > reply;
+		} pending_sysex_request_t;
+		bool completeSysexRequest(const firmata_view_t& msg);
+		void cancelSysexRequest(unsigned id);
+		void publishSysex(const firmata_view_t& msg);
+		std::mutex requestLock;
+		std::list<pending_request_t> pendingRequests;
+		std::list<pending_sysex_request_t> pendingSysexRequests;
+		map<string, vector<string> > expectedReplies;
+		unsigned nextRequestId;
 	protected:
 
 		Arduino* arduino;
@@ -134,6 +297,33 @@ class Firmata {
 		vector<unsigned char> sysExBuf;
 		char firmwareVersion[FIRMATA_FIRMWARE_VERSION_SIZE];
 		int digitalPortValue[ARDUINO_DIG_PORTS]; /// bitpacked digital pin state
-		int init(const char* _serialPort);
-    		int sendValueAsTwo7bitBytes(int value);
+		int init(const char* _serialPort, int timeout_ms, bool surveyPins, int baud, bool lowLatency);
+		int handshake(int timeout_ms, bool surveyPins);
+		bool handshakeComplete();
+		bool capabilitiesReported;
+		bool analogMappingReported;
+		uint32_t pinStatesReported;
 };
+
+// One reader thread for any number of boards. It polls every added board's
+// port and parses what arrives, just as each board's own reader thread would,
+// so consumers see no difference. A board whose port fails is marked as lost
+// and dropped from the loop.
+class FirmataIoLoop {
+	public:
+		FirmataIoLoop();
+		~FirmataIoLoop();
+		void add(Firmata* board);
+		// Once this returns the loop no longer touches the board
+		void remove(Firmata* board);
+	private:
+		void run();
+		void wake();
+		std::thread thread;
+		std::mutex boardsLock;
+		vector<Firmata*> boards;
+		std::atomic<bool> running;
+		int wakeFd;
+};
+
+#endif // FIRMATA_H
@@ -0,0 +1,144 @@
+/*
+   Firmata C++ library.
+
+   Incremental Firmata stream parser.
+*/
+
+#include <firmataparser.h>
+#include <firmata.h>
+
+FirmataParser::FirmataParser() {
+	reset();
+}
+
+void FirmataParser::reset() {
+	state = IDLE;
+	command = 0;
+	expected = 0;
+	chan_len = 0;
+	sysex_id = 0;
+	raw_prefix = 0;
+	payload_len = 0;
+	text_len = 0;
+	text[0] = 0;
+	pending_lsb = -1;
+	truncated = false;
+}
+
+bool FirmataParser::next(const uint8_t** p, const uint8_t* end, firmata_view_t& msg) {
+	while (*p < end) {
+		uint8_t b = *(*p)++;
+		if (b & 0x80) {
+			// A status byte always starts a new message, abandoning any unfinished one
+			if (b == FIRMATA_END_SYSEX) {
+				if (state == SYSEX_DATA) {
+					finish(msg);
+					return true;
+				}
+				state = IDLE;
+				continue;
+			}
+			if (b == FIRMATA_START_SYSEX) {
+				state = SYSEX_ID;
+				command = b;
+				continue;
+			}
+			uint8_t msn = b & 0xF0;
+			command = b;
+			chan_len = 0;
+			if (msn == FIRMATA_ANALOG_MESSAGE || msn == FIRMATA_DIGITAL_MESSAGE || b == FIRMATA_REPORT_VERSION) {
+				expected = 2;
+			} else if (msn == FIRMATA_REPORT_ANALOG || msn == FIRMATA_REPORT_DIGITAL) {
+				expected = 1;
+			} else {
+				expected = 0;
+			}
+			if (expected == 0) {
+				state = IDLE;
+				finish(msg);
+				return true;
+			}
+			state = CHANNEL_DATA;
+			continue;
+		}
+		switch (state) {
+			case IDLE:
+				break;  // stray data byte
+			case CHANNEL_DATA:
+				chan[chan_len++] = b;
+				if (chan_len == expected) {
+					state = IDLE;
+					finish(msg);
+					return true;
+				}
+				break;
+			case SYSEX_ID:
+				startSysex(b);
+				break;
+			case SYSEX_DATA:
+				addSysexByte(b);
+				break;
+		}
+	}
+	return false;
+}
+
+void FirmataParser::startSysex(uint8_t id) {
+	state = SYSEX_DATA;
+	sysex_id = id;
+	payload_len = 0;
+	text_len = 0;
+	text[0] = 0;
+	pending_lsb = -1;
+	truncated = false;
+	if (id == FIRMATA_STRING_DATA) {
+		raw_prefix = 0;
+	} else if (id == FIRMATA_REPORT_FIRMWARE) {
+		raw_prefix = 2;  // major, minor version
+	} else {
+		raw_prefix = -1; // not a string message
+	}
+}
+
+void FirmataParser::addSysexByte(uint8_t b) {
+	if (raw_prefix < 0 || payload_len < raw_prefix) {
+		if (payload_len < (int)sizeof(payload)) {
+			payload[payload_len++] = b;
+		} else {
+			truncated = true;
+		}
+		return;
+	}
+	if (pending_lsb < 0) {
+		pending_lsb = b;
+		return;
+	}
+	char c = (char)((pending_lsb & 0x7F) | ((b & 0x7F) << 7));
+	pending_lsb = -1;
+	if (text_len < (int)sizeof(text) - 1) {
+		text[text_len++] = c;
+		text[text_len] = 0;
+	} else {
+		truncated = true;
+	}
+}
+
+void FirmataParser::finish(firmata_view_t& msg) {
+	msg.command = (command < FIRMATA_START_SYSEX) ? (command & 0xF0) : command;
+	msg.channel = command & 0x0F;
+	msg.sysex_id = 0;
+	msg.data = chan;
+	msg.len = chan_len;
+	msg.text = "";
+	msg.text_len = 0;
+	msg.truncated = false;
+	if (command == FIRMATA_START_SYSEX) {
+		msg.sysex_id = sysex_id;
+		msg.data = payload;
+		msg.len = payload_len;
+		msg.text = text;
+		msg.text_len = text_len;
+		msg.truncated = truncated;
+		state = IDLE;
+	}
+}
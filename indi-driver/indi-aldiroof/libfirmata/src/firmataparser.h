@@ -0,0 +1,62 @@
+/*
+   Firmata C++ library.
+
+   Incremental Firmata stream parser. Bytes are consumed straight from the
+   caller's read buffer; channel message data and sysex payloads are kept in
+   fixed size buffers inside the parser and STRING_DATA / REPORT_FIRMWARE
+   characters are decoded from their 7-bit pairs as they arrive, so a message
+   is handed out as a view without being copied again. Every length is checked
+   against its buffer: oversized messages are truncated and flagged, never
+   written past the end.
+*/
+
+#ifndef FIRMATAPARSER_H
+#define FIRMATAPARSER_H
+
+#include <stdint.h>
+
+#define FIRMATA_MAX_SYSEX_BYTES  1024 // raw sysex payload kept per message
+#define FIRMATA_MAX_TEXT_BYTES    164 // decoded string kept per message, including the NUL
+
+// A decoded message. Pointers refer to the parser and are only valid until
+// the next call to FirmataParser::next().
+typedef struct {
+	uint8_t command;     // status byte; high nibble only for channel messages
+	uint8_t channel;     // low nibble of a channel message
+	uint8_t sysex_id;    // for command == FIRMATA_START_SYSEX
+	const uint8_t* data; // channel message data or raw sysex payload (7-bit bytes)
+	int len;
+	const char* text;    // decoded string for STRING_DATA / REPORT_FIRMWARE, NUL terminated
+	int text_len;
+	bool truncated;      // payload or text didn't fit and was cut short
+} firmata_view_t;
+
+class FirmataParser {
+	public:
+		FirmataParser();
+		void reset();
+		// Consume bytes from *p up to end until a message completes. Returns
+		// true with msg filled in and *p just past the message, or false once
+		// all input is used up; a partial message is kept for the next call.
+		bool next(const uint8_t** p, const uint8_t* end, firmata_view_t& msg);
+
+	private:
+		enum { IDLE, CHANNEL_DATA, SYSEX_ID, SYSEX_DATA } state;
+		uint8_t command;
+		int expected;
+		uint8_t chan[2];
+		int chan_len;
+		uint8_t sysex_id;
+		int raw_prefix;     // leading raw bytes before the 7-bit pair encoded text
+		uint8_t payload[FIRMATA_MAX_SYSEX_BYTES];
+		int payload_len;
+		char text[FIRMATA_MAX_TEXT_BYTES];
+		int text_len;
+		int pending_lsb;    // first half of a 7-bit pair, -1 if none
+		bool truncated;
+		void startSysex(uint8_t id);
+		void addSysexByte(uint8_t b);
+		void finish(firmata_view_t& msg);
+};
+
+#endif // FIRMATAPARSER_H
@@ -0,0 +1,49 @@
+/*
+   Firmata C++ library.
+
+   Single producer / single consumer lock-free queue. The serial reader thread
+   is the only producer and the driver is the only consumer, so head and tail
+   each have exactly one writer and plain acquire/release ordering is enough.
+*/
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+template <typename T, size_t N>
+class SpscQueue {
+	public:
+		SpscQueue() : head(0), tail(0) {}
+
+		// Producer side. Returns false (and drops the item) when full.
+		bool push(const T& item) {
+			size_t t = tail.load(std::memory_order_relaxed);
+			size_t next = (t + 1) % N;
+			if (next == head.load(std::memory_order_acquire)) return false;
+			items[t] = item;
+			tail.store(next, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer side. Returns false when empty.
+		bool pop(T& item) {
+			size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) return false;
+			item = items[h];
+			head.store((h + 1) % N, std::memory_order_release);
+			return true;
+		}
+
+		bool empty() const {
+			return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+		}
+
+	private:
+		T items[N];
+		std::atomic<size_t> head;
+		std::atomic<size_t> tail;
+};
+
+#endif // SPSCQUEUE_H
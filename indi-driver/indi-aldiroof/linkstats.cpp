@@ -0,0 +1,66 @@
+#include "linkstats.h"
+
+#include <string.h>
+
+// Bucket upper bounds in microseconds
+static const long bucketLimitUs[LATENCY_BUCKETS] = {
+    50, 100, 200, 500,
+    1000, 2000, 5000, 10000,
+    20000, 50000, 100000, 200000,
+    500000, 1000000, 2000000, 5000000
+};
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    memset(buckets, 0, sizeof(buckets));
+    samples = 0;
+    maxMs = 0;
+}
+
+void LatencyHistogram::add(std::chrono::steady_clock::duration d)
+{
+    long us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    int i = 0;
+    while (i < LATENCY_BUCKETS && us > bucketLimitUs[i])
+        i++;
+    buckets[i]++;
+    samples++;
+    if (us / 1000.0 > maxMs)
+        maxMs = us / 1000.0;
+}
+
+double LatencyHistogram::percentile(double p) const
+{
+    if (samples == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(p / 100.0 * samples);
+    if (rank >= samples)
+        rank = samples - 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen > rank)
+        {
+            // Never report more than was actually seen
+            double limitMs = bucketLimitUs[i] / 1000.0;
+            return limitMs < maxMs ? limitMs : maxMs;
+        }
+    }
+    return maxMs;
+}
+
+double LatencyHistogram::max() const
+{
+    return maxMs;
+}
+
+unsigned long LatencyHistogram::count() const
+{
+    return samples;
+}
@@ -0,0 +1,31 @@
+#ifndef LinkStats_H
+#define LinkStats_H
+
+#include <chrono>
+
+/*
+ * Fixed bucket latency histogram for the serial link. Adding a sample is a
+ * bucket search and an increment, cheap enough for every QUERY and timer
+ * tick. Buckets step 1-2-5 from 50us to 5s; percentiles are reported as the
+ * upper bound of the bucket they fall in, so they are accurate to that step.
+ */
+#define LATENCY_BUCKETS 16
+
+class LatencyHistogram
+{
+    public:
+        LatencyHistogram();
+        void reset();
+        void add(std::chrono::steady_clock::duration d);
+        // In milliseconds, 0 if there are no samples
+        double percentile(double p) const;
+        double max() const;
+        unsigned long count() const;
+
+    private:
+        unsigned long buckets[LATENCY_BUCKETS + 1];  // the last one holds everything above 5s
+        unsigned long samples;
+        double maxMs;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef RoofProtocol_H
+#define RoofProtocol_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary command set spoken by SimpleDigitalFirmataRoofController alongside
+ * the original STRING_DATA commands. Commands are a single opcode in a custom
+ * sysex and every reply or pushed state change is a packed status byte
+ * followed by the firmware's feature bits:
+ *
+ *   host -> board   F0 ROOF_SYSEX_COMMAND opcode F7
+ *   board -> host   F0 ROOF_SYSEX_STATUS  status features F7
+ *
+ * The feature bits (ROOF_FEATURE_*) say which of the later opcodes the
+ * firmware handles. The first binary firmware sent the status byte alone and
+ * knows only opcodes up to ROOF_OP_QUERY, so no features byte means none.
+ *
+ * ROOF_OP_QUERY is answered with a status. Once the board has seen a binary
+ * command it pushes state changes as status frames instead of strings.
+ * Firmware that predates this ignores the sysex, so the driver probes with a
+ * QUERY at connect and stays on strings if no status comes back.
+ *
+ * A binary host is also sent every debounced limit switch edge, as the board
+ * latched it in its pin change interrupt:
+ *
+ *   board -> host   F0 ROOF_SYSEX_EDGE edge t0..t4 a0..a2 F7
+ *
+ * t is the board's millis() at the edge, a is how many ms before sending
+ * the frame that was (saturating), both least significant 7 bits first. The
+ * age lets the host place the edge on its own clock without syncing clocks.
+ *
+ * The link starts at ROOF_DEFAULT_BAUD. A binary host can move it to a
+ * faster rate, the rate going as three 7-bit bytes, least significant first:
+ *
+ *   host -> board   F0 ROOF_SYSEX_BAUD r0 r1 r2 F7    at the current rate
+ *   board -> host   F0 ROOF_SYSEX_BAUD r0 r1 r2 F7    the rate it is moving to,
+ *                                                     its current rate if refused
+ *   host -> board   F0 ROOF_SYSEX_BAUD r0 r1 r2 F7    at the new rate
+ *   board -> host   F0 ROOF_SYSEX_BAUD r0 r1 r2 F7    at the new rate, confirmed
+ *
+ * A board that doesn't get the confirming request at the new rate within
+ * ROOF_BAUD_TRIAL_MS goes back to ROOF_DEFAULT_BAUD, as does a board reset by
+ * the port being opened.
+ *
+ * The sketch has its own copy of these values; keep them in step.
+ */
+#define ROOF_SYSEX_COMMAND      0x01
+#define ROOF_SYSEX_STATUS       0x02
+#define ROOF_SYSEX_EDGE         0x03
+#define ROOF_SYSEX_BAUD         0x04
+
+#define ROOF_DEFAULT_BAUD       57600
+#define ROOF_BAUD_TRIAL_MS      2000
+#define ROOF_BAUD_BYTES         3
+
+#define ROOF_OP_OPEN            0x01
+#define ROOF_OP_CLOSE           0x02
+#define ROOF_OP_ABORT           0x03
+#define ROOF_OP_SHUTTER_OPEN    0x04
+#define ROOF_OP_SHUTTER_CLOSE   0x05
+#define ROOF_OP_QUERY           0x06
+#define ROOF_OP_STOP            0x07    // stop the roof only, ABORT stops the shutter as well. Needs ROOF_FEATURE_STOP.
+
+// Status byte
+#define ROOF_STATUS_OPEN_LIMIT      0x01    // fully open limit switch made
+#define ROOF_STATUS_CLOSED_LIMIT    0x02    // fully closed limit switch made
+#define ROOF_STATUS_SHUTTER_MASK    0x0C
+#define ROOF_STATUS_SHUTTER_CLOSED  0x00
+#define ROOF_STATUS_SHUTTER_OPEN    0x04
+#define ROOF_STATUS_SHUTTER_MOVING  0x08    // state unknown until the actuator run completes
+#define ROOF_STATUS_MOTOR_ON        0x10    // roof relays energised
+
+// Features byte
+#define ROOF_FEATURE_STOP           0x01    // ROOF_OP_STOP
+
+// Edge byte
+#define ROOF_EDGE_OPEN_LIMIT        0x01    // the switch that changed, as in the status byte
+#define ROOF_EDGE_CLOSED_LIMIT      0x02
+#define ROOF_EDGE_MADE              0x04    // switch closed, otherwise released
+#define ROOF_EDGE_CUT               0x08    // the board cut the roof relays on this edge
+#define ROOF_EDGE_BYTES             9       // edge byte, time and age
+#define ROOF_EDGE_AGE_MAX           0x1FFFFF
+
+// Feature bits from a ROOF_SYSEX_STATUS frame's data
+static inline uint8_t roofFeatures(const uint8_t *data, size_t len)
+{
+    return len >= 2 ? data[1] & 0x7F : 0;
+}
+
+// The string protocol's QUERY reply for a status byte. As with the string protocol the open switch wins if both are made.
+static inline const char *roofStatusString(uint8_t status)
+{
+    if (status & ROOF_STATUS_OPEN_LIMIT) return "OPEN";
+    if (status & ROOF_STATUS_CLOSED_LIMIT) return "CLOSED";
+    return "UNKNOWN";
+}
+
+// The SHUTTERQUERY reply for a status byte
+static inline const char *shutterStatusString(uint8_t status)
+{
+    switch (status & ROOF_STATUS_SHUTTER_MASK)
+    {
+        case ROOF_STATUS_SHUTTER_OPEN: return "SHUTTEROPEN";
+        case ROOF_STATUS_SHUTTER_CLOSED: return "SHUTTERCLOSED";
+    }
+    return "SHUTTERUNKNOWN";
+}
+
+#endif
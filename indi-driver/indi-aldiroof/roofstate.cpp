@@ -0,0 +1,104 @@
+#include "roofstate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ROOFSTATE_READ_TRIES    100
+
+uint64_t roofstate_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+const roofstate_shm_t *roofstate_open(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(roofstate_shm_t)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, sizeof(roofstate_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? NULL : (const roofstate_shm_t *)map;
+}
+
+int roofstate_read(const roofstate_shm_t *shm, roofstate_t *state)
+{
+    if (shm->magic != ROOFSTATE_MAGIC || shm->version != ROOFSTATE_VERSION || shm->size != sizeof(roofstate_shm_t))
+        return -1;
+    for (int i = 0; i < ROOFSTATE_READ_TRIES; i++) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;   // writer part way through
+        memcpy(state, (const void *)&shm->state, sizeof(*state));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+    return -1;
+}
+
+void roofstate_close(const roofstate_shm_t *shm)
+{
+    if (shm != NULL) munmap((void *)shm, sizeof(roofstate_shm_t));
+}
+
+roofstate_shm_t *roofstate_create(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "roofstate_create(%s): %s\n", name, strerror(errno));
+        return NULL;
+    }
+    // shm_open applies the umask
+    fchmod(fd, 0644);
+    if (ftruncate(fd, sizeof(roofstate_shm_t)) != 0) {
+        fprintf(stderr, "roofstate_create(%s): ftruncate: %s\n", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, sizeof(roofstate_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "roofstate_create(%s): mmap: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    roofstate_shm_t *shm = (roofstate_shm_t *)map;
+    // Left behind by a writer that died mid update, or by another version: start afresh. Readers see the magic last.
+    __atomic_store_n(&shm->magic, 0, __ATOMIC_RELAXED);
+    memset(&shm->state, 0, sizeof(shm->state));
+    shm->version = ROOFSTATE_VERSION;
+    shm->size = sizeof(roofstate_shm_t);
+    shm->seq = 0;
+    __atomic_store_n(&shm->magic, ROOFSTATE_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+void roofstate_publish(roofstate_shm_t *shm, roofstate_t *state)
+{
+    if (shm == NULL) return;
+    state->updated_ns = roofstate_now_ns();
+    state->writer_pid = getpid();
+    uint32_t seq = shm->seq;
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&shm->state, state, sizeof(*state));
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void roofstate_destroy(roofstate_shm_t *shm, const char *name)
+{
+    if (shm == NULL) return;
+    munmap(shm, sizeof(roofstate_shm_t));
+    shm_unlink(name);
+}
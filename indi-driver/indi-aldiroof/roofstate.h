@@ -0,0 +1,89 @@
+#ifndef RoofState_H
+#define RoofState_H
+
+#include <stdint.h>
+
+/*
+ * Roof state published in POSIX shared memory for local readers. The driver
+ * (or aldiroofd) rewrites it whenever it learns something and at least once
+ * per idle poll; any number of processes can map it read only and take a
+ * consistent copy without locks and without going near the serial link.
+ *
+ * The writer bumps seq to an odd value, updates the state and bumps it to
+ * even again. A reader copies the state between two reads of seq and retries
+ * if they differ or are odd.
+ *
+ * Times are CLOCK_MONOTONIC in ns, comparable with the reader's own
+ * CLOCK_MONOTONIC. updated_ns older than a few idle polls means the writer
+ * has stopped.
+ *
+ * The segment is "/aldiroof", or "/aldiroof_<n>" for each of several roofs
+ * run from one driver (ALDIROOF_PORTS). On Linux it is /dev/shm/aldiroof.
+ */
+#define ROOFSTATE_NAME      "/aldiroof"
+#define ROOFSTATE_MAGIC     0x54535241  // "ARST"
+#define ROOFSTATE_VERSION   1
+
+// flags
+#define ROOFSTATE_OPEN_LIMIT    0x01    // fully open limit switch made
+#define ROOFSTATE_CLOSED_LIMIT  0x02    // fully closed limit switch made
+#define ROOFSTATE_VALID         0x04    // the limit switches are from a current reply, not yet invalidated by a command
+#define ROOFSTATE_LINK_UP       0x08    // the serial link to the arduino is open
+#define ROOFSTATE_PARKED        0x10    // set by the driver only, aldiroofd doesn't park
+
+// motion
+#define ROOFSTATE_IDLE          0
+#define ROOFSTATE_OPENING       1
+#define ROOFSTATE_CLOSING       2
+
+// shutter
+#define ROOFSTATE_SHUTTER_UNKNOWN   0
+#define ROOFSTATE_SHUTTER_OPEN      1
+#define ROOFSTATE_SHUTTER_CLOSED    2
+#define ROOFSTATE_SHUTTER_MOVING    3
+
+typedef struct {
+    uint64_t updated_ns;        // when the writer last published
+    uint64_t state_ns;          // when the arduino last reported the limit switches
+    uint32_t flags;
+    uint8_t motion;
+    uint8_t shutter;
+    uint16_t reserved16;
+    uint32_t reply_timeouts;    // consecutive unanswered QUERYs, 0 on a healthy link
+    uint32_t query_rtt_us;      // last QUERY round trip
+    uint32_t reconnects;        // link re-opened since connecting
+    uint32_t writer_pid;
+} roofstate_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              // sizeof(roofstate_shm_t)
+    uint32_t seq;               // odd while the writer is part way through an update
+    roofstate_t state;
+} roofstate_shm_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reader. Map the segment read only, NULL if no writer has created it.
+const roofstate_shm_t *roofstate_open(const char *name);
+// Take a consistent copy. Returns 0, or -1 if the segment isn't a roof state of this version or the writer kept it busy.
+int roofstate_read(const roofstate_shm_t *shm, roofstate_t *state);
+void roofstate_close(const roofstate_shm_t *shm);
+// Nanoseconds on the clock the state's times are taken from
+uint64_t roofstate_now_ns(void);
+
+// Writer. Create (or take over) the segment, readable by everyone.
+roofstate_shm_t *roofstate_create(const char *name);
+// Fills in updated_ns and writer_pid
+void roofstate_publish(roofstate_shm_t *shm, roofstate_t *state);
+// Unmap and remove the name. Readers that have it mapped keep the last state published.
+void roofstate_destroy(roofstate_shm_t *shm, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * aldiroof_state: print the roof state the driver or aldiroofd publishes in shared memory (roofstate.h).
+ *
+ *   aldiroof_state [shared memory name]
+ *
+ * The default name is /aldiroof, or /aldiroof_<n> for one of several roofs run from the driver.
+ * Prints one name=value per line for scripts to pick out. Exits 0 when the state is current: the link
+ * is up and the writer published within the last STALE_S seconds; 2 when it is stale or the link is
+ * down; 1 when nothing is published.
+ */
+#include "roofstate.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define STALE_S     30      // Three idle polls without an update
+
+static const char *motionName(uint8_t motion)
+{
+    switch (motion)
+    {
+        case ROOFSTATE_IDLE: return "IDLE";
+        case ROOFSTATE_OPENING: return "OPENING";
+        case ROOFSTATE_CLOSING: return "CLOSING";
+    }
+    return "?";
+}
+
+static const char *shutterName(uint8_t shutter)
+{
+    switch (shutter)
+    {
+        case ROOFSTATE_SHUTTER_UNKNOWN: return "UNKNOWN";
+        case ROOFSTATE_SHUTTER_OPEN: return "OPEN";
+        case ROOFSTATE_SHUTTER_CLOSED: return "CLOSED";
+        case ROOFSTATE_SHUTTER_MOVING: return "MOVING";
+    }
+    return "?";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))) {
+        fprintf(stderr, "Usage: %s [shared memory name]\n", argv[0]);
+        return 1;
+    }
+    const char *name = argc > 1 ? argv[1] : ROOFSTATE_NAME;
+    const roofstate_shm_t *shm = roofstate_open(name);
+    if (shm == NULL) {
+        fprintf(stderr, "%s: no roof state published\n", name);
+        return 1;
+    }
+    roofstate_t state;
+    int rv = roofstate_read(shm, &state);
+    roofstate_close(shm);
+    if (rv != 0) {
+        fprintf(stderr, "%s: not a roof state, or written by a different version\n", name);
+        return 1;
+    }
+
+    uint64_t now = roofstate_now_ns();
+    const char *roof = state.flags & ROOFSTATE_OPEN_LIMIT ? "OPEN" : state.flags & ROOFSTATE_CLOSED_LIMIT ? "CLOSED" : "UNKNOWN";
+    printf("roof=%s\n", roof);
+    printf("state_valid=%d\n", (state.flags & ROOFSTATE_VALID) != 0);
+    printf("motion=%s\n", motionName(state.motion));
+    printf("shutter=%s\n", shutterName(state.shutter));
+    printf("parked=%d\n", (state.flags & ROOFSTATE_PARKED) != 0);
+    printf("link_up=%d\n", (state.flags & ROOFSTATE_LINK_UP) != 0);
+    printf("reply_timeouts=%u\n", state.reply_timeouts);
+    printf("query_rtt_us=%u\n", state.query_rtt_us);
+    printf("reconnects=%u\n", state.reconnects);
+    if (state.state_ns != 0)
+        printf("state_age_ms=%" PRIu64 "\n", (now - state.state_ns) / 1000000);
+    printf("updated_age_ms=%" PRIu64 "\n", (now - state.updated_ns) / 1000000);
+    printf("writer_pid=%u\n", state.writer_pid);
+
+    bool current = (state.flags & ROOFSTATE_LINK_UP) && now - state.updated_ns < (uint64_t)STALE_S * 1000000000;
+    return current ? 0 : 2;
+}
@@ -0,0 +1,55 @@
+#include "scheduler.h"
+
+DeadlineScheduler::DeadlineScheduler()
+{
+    cancelAll();
+}
+
+void DeadlineScheduler::arm(int slot, clock::duration delay)
+{
+    deadline[slot] = clock::now() + delay;
+    active[slot] = true;
+}
+
+void DeadlineScheduler::cancel(int slot)
+{
+    active[slot] = false;
+}
+
+void DeadlineScheduler::cancelAll()
+{
+    for (int i = 0; i < SCHEDULER_SLOTS; i++)
+        active[i] = false;
+}
+
+bool DeadlineScheduler::armed(int slot) const
+{
+    return active[slot];
+}
+
+bool DeadlineScheduler::expired(int slot, clock::time_point now) const
+{
+    return active[slot] && now >= deadline[slot];
+}
+
+double DeadlineScheduler::remaining(int slot, clock::time_point now) const
+{
+    return std::chrono::duration<double>(deadline[slot] - now).count();
+}
+
+int DeadlineScheduler::nextDelayMs(clock::time_point now) const
+{
+    int next = -1;
+    for (int i = 0; i < SCHEDULER_SLOTS; i++)
+    {
+        if (!active[i])
+            continue;
+        // Round up so the timer never fires just short of the deadline
+        long ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline[i] - now + std::chrono::microseconds(999)).count();
+        if (ms < 0)
+            ms = 0;
+        if (next < 0 || ms < next)
+            next = (int)ms;
+    }
+    return next;
+}
@@ -0,0 +1,36 @@
+#ifndef DeadlineScheduler_H
+#define DeadlineScheduler_H
+
+#include <chrono>
+
+/*
+ * A fixed set of named deadlines on the monotonic clock. The driver keeps one
+ * INDI timer armed for whichever deadline comes first and, when it fires,
+ * handles every entry that has expired. Wall clock steps (NTP, manual date
+ * changes) can't shorten or stretch any of them.
+ */
+#define SCHEDULER_SLOTS 8
+
+class DeadlineScheduler
+{
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        DeadlineScheduler();
+        void arm(int slot, clock::duration delay);
+        void cancel(int slot);
+        void cancelAll();
+        bool armed(int slot) const;
+        // True if the slot is armed and its deadline has passed. The slot stays armed until cancelled or re-armed.
+        bool expired(int slot, clock::time_point now) const;
+        // Seconds until the deadline, negative once it has passed
+        double remaining(int slot, clock::time_point now) const;
+        // Milliseconds until the earliest armed deadline, 0 if one has already passed, -1 if none are armed
+        int nextDelayMs(clock::time_point now) const;
+
+    private:
+        clock::time_point deadline[SCHEDULER_SLOTS];
+        bool active[SCHEDULER_SLOTS];
+};
+
+#endif
@@ -0,0 +1,394 @@
+/*
+   Virtual SimpleDigitalFirmataRoofController.
+*/
+
+#include <roofsim.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+void roofsim_default_config(roofsim_config_t* cfg) {
+	cfg->travel_time = ROOFSIM_TRAVEL_TIME;
+	cfg->speed = 1.0;
+	cfg->start_position = 0.0;
+	cfg->jam_position = -1.0;
+	cfg->drop_rate = 0.0;
+	cfg->features = ROOF_FEATURE_STOP;
+	cfg->verbose = false;
+}
+
+RoofSim::RoofSim(const roofsim_config_t& _cfg) {
+	cfg = _cfg;
+	master = -1;
+	slave = -1;
+	slave_name[0] = 0;
+	now = 0;
+	pos = cfg.start_position;
+	motor = STOPPED;
+	motor_start = 0;
+	shutterMotor = SHUTTER_STOPPED;
+	shutter_start = 0;
+	shutter_closed = true;
+	reported_roof = NULL;
+	pending_roof = NULL;
+	pending_roof_time = 0;
+	settled_roof = NULL;
+	reported_shutter = NULL;
+	binary_host = false;
+	reported_status = -1;
+	link_baud = ROOF_DEFAULT_BAUD;
+	limits = statusFor(roofStateString()) & (ROOF_STATUS_OPEN_LIMIT | ROOF_STATUS_CLOSED_LIMIT);
+	clock_gettime(CLOCK_MONOTONIC, &last_poll);
+}
+
+RoofSim::~RoofSim() {
+	if (slave >= 0) close(slave);
+	if (master >= 0) close(master);
+}
+
+// Create the pty. The slave end is kept open here too so the master doesn't
+// see EIO between driver connections, and is put in raw mode so nothing is
+// echoed back before the driver configures the port itself.
+int RoofSim::openPty() {
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (master < 0) {
+		perror("RoofSim::openPty():posix_openpt():");
+		return(-1);
+	}
+	if (grantpt(master) < 0 || unlockpt(master) < 0) {
+		perror("RoofSim::openPty():unlockpt():");
+		close(master);
+		master = -1;
+		return(-1);
+	}
+	strncpy(slave_name, ptsname(master), sizeof(slave_name)-1);
+	slave_name[sizeof(slave_name)-1] = 0;
+	slave = open(slave_name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror("RoofSim::openPty():open():");
+		close(master);
+		master = -1;
+		return(-1);
+	}
+	struct termios term;
+	tcgetattr(slave, &term);
+	cfmakeraw(&term);
+	tcsetattr(slave, TCSANOW, &term);
+	sendFirmwareReport();  // the sketch announces itself on boot
+	return(0);
+}
+
+const char* RoofSim::slaveName() {
+	return slave_name;
+}
+
+int RoofSim::fd() {
+	return master;
+}
+
+int RoofSim::run(volatile bool* stop, int tick_ms) {
+	while (!*stop) {
+		if (poll(tick_ms) < 0) return(-1);
+	}
+	return(0);
+}
+
+int RoofSim::poll(int timeout_ms) {
+	struct pollfd pfd;
+	pfd.fd = master;
+	pfd.events = POLLIN;
+	int r = ::poll(&pfd, 1, timeout_ms);
+	if (r < 0 && errno != EINTR) {
+		perror("RoofSim::poll():poll():");
+		return(-1);
+	}
+	if (r > 0 && (pfd.revents & POLLIN)) {
+		uint8_t buf[1024];
+		int n = read(master, buf, sizeof(buf));
+		if (n > 0) receive(buf, n);
+	}
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	double elapsed = (t.tv_sec - last_poll.tv_sec) + (t.tv_nsec - last_poll.tv_nsec) / 1e9;
+	last_poll = t;
+	step(elapsed * cfg.speed);
+	return(0);
+}
+
+void RoofSim::receive(const uint8_t* buf, int len) {
+	uint8_t kept[1024];
+	int n = 0;
+	for (int i=0; i < len && n < (int)sizeof(kept); i++) {
+		if (!dropped()) kept[n++] = buf[i];
+	}
+	const uint8_t* p = kept;
+	firmata_view_t msg;
+	while (parser.next(&p, kept + n, msg)) {
+		handleMessage(msg);
+	}
+}
+
+void RoofSim::step(double dt) {
+	now += dt;
+
+	bool cut = false;
+	if (motor != STOPPED) {
+		double run = now - motor_start;
+		// Relays only close once the dwell after switching everything off is over
+		double moving = run - ROOFSIM_RELAY_DWELL;
+		if (moving > 0) {
+			double d = std::min(dt, moving) / cfg.travel_time;
+			if (motor == OPENING) {
+				double limit = (cfg.jam_position >= 0 && pos <= cfg.jam_position) ? cfg.jam_position : 1.0;
+				pos = std::min(pos + d, limit);
+			} else {
+				double limit = (cfg.jam_position >= 0 && pos >= cfg.jam_position) ? cfg.jam_position : 0.0;
+				pos = std::max(pos - d, limit);
+			}
+		}
+		// monitorRoofLimitSwitches() and roofMotorSafetyTimeoutCutout()
+		if (moving > 1.0 && ((motor == OPENING && pos >= 1.0) || (motor == CLOSING && pos <= 0.0))) {
+			motor = STOPPED;
+			cut = true;
+		} else if (moving > ROOFSIM_MOTOR_TIMEOUT) {
+			if (cfg.verbose) printf("roofsim: motor safety timeout at position %.2f\n", pos);
+			motor = STOPPED;
+		}
+	}
+
+	// linearActuatorTimedCutout()
+	if (shutterMotor != SHUTTER_STOPPED && now - shutter_start > ROOFSIM_SHUTTER_TIME) {
+		shutter_closed = (shutterMotor == SHUTTER_CLOSING);
+		shutterMotor = SHUTTER_STOPPED;
+	}
+
+	// The sketch's pin change interrupt. Edges are sent as they happen, so their age is 0.
+	uint8_t now_limits = statusFor(roofStateString()) & (ROOF_STATUS_OPEN_LIMIT | ROOF_STATUS_CLOSED_LIMIT);
+	uint8_t changed = now_limits ^ limits;
+	limits = now_limits;
+	for (uint8_t bit = ROOF_STATUS_OPEN_LIMIT; bit <= ROOF_STATUS_CLOSED_LIMIT; bit <<= 1) {
+		if (!(changed & bit) || !binary_host) continue;
+		uint8_t edge = bit;
+		if (now_limits & bit) edge |= ROOF_EDGE_MADE | (cut ? ROOF_EDGE_CUT : 0);
+		sendEdge(edge);
+	}
+
+	reportStateChanges();
+}
+
+void RoofSim::handleMessage(const firmata_view_t& msg) {
+	if (msg.command != FIRMATA_START_SYSEX) return;
+	if (msg.sysex_id == FIRMATA_REPORT_FIRMWARE) {
+		sendFirmwareReport();
+	} else if (msg.sysex_id == FIRMATA_STRING_DATA) {
+		binary_host = false;
+		handleCommand(msg.text);
+	} else if (msg.sysex_id == ROOF_SYSEX_COMMAND && msg.len >= 1) {
+		if (!binary_host) {
+			binary_host = true;
+			reported_status = -1;
+		}
+		handleOpcode(msg.data[0]);
+	} else if (msg.sysex_id == ROOF_SYSEX_BAUD && msg.len >= ROOF_BAUD_BYTES) {
+		// A pty has no line rate, so every rate the sketch supports is simply agreed to
+		static const int supported[] = { 57600, 115200, 230400, 250000, 500000, 1000000 };
+		int baud = msg.data[0] | (msg.data[1] << 7) | (msg.data[2] << 14);
+		if (std::find(supported, supported + sizeof(supported)/sizeof(supported[0]), baud) == supported + sizeof(supported)/sizeof(supported[0])) {
+			baud = link_baud;
+		}
+		if (cfg.verbose) printf("roofsim %.3f: link rate %d\n", now, baud);
+		link_baud = baud;
+		FirmataFrame frame;
+		frame.put(FIRMATA_START_SYSEX);
+		frame.put(ROOF_SYSEX_BAUD);
+		for (int i=0; i < ROOF_BAUD_BYTES; i++) frame.put((baud >> (7 * i)) & 0x7F);
+		frame.put(FIRMATA_END_SYSEX);
+		sendFrame(frame);
+	}
+}
+
+// sysexCallback() in the sketch
+void RoofSim::handleOpcode(uint8_t op) {
+	static const char* commands[] = { NULL, "OPEN", "CLOSE", "ABORT", "SHUTTEROPEN", "SHUTTERCLOSE", NULL, "STOP" };
+	if (op == ROOF_OP_QUERY) {
+		if (cfg.verbose) printf("roofsim %.3f: binary QUERY\n", now);
+		sendStatus(status());
+	} else if (op == ROOF_OP_STOP && (cfg.features < 0 || !(cfg.features & ROOF_FEATURE_STOP))) {
+		if (cfg.verbose) printf("roofsim %.3f: binary STOP not supported, ignored\n", now);
+	} else if (op >= ROOF_OP_OPEN && op <= ROOF_OP_STOP) {
+		handleCommand(commands[op]);
+	}
+}
+
+// stringCallback() in the sketch
+void RoofSim::handleCommand(const char* cmd) {
+	if (cfg.verbose) printf("roofsim %.3f: %s\n", now, cmd);
+	if (strcmp(cmd, "OPEN") == 0) {
+		if (motor != OPENING) {
+			motor = OPENING;
+			motor_start = now;
+		}
+	} else if (strcmp(cmd, "CLOSE") == 0) {
+		if (motor != CLOSING) {
+			motor = CLOSING;
+			motor_start = now;
+		}
+	} else if (strcmp(cmd, "ABORT") == 0) {
+		motor = STOPPED;
+		shutterMotor = SHUTTER_STOPPED;
+	} else if (strcmp(cmd, "STOP") == 0) {
+		motor = STOPPED;
+	} else if (strcmp(cmd, "SHUTTEROPEN") == 0) {
+		if (shutterMotor != SHUTTER_OPENING) {
+			shutterMotor = SHUTTER_OPENING;
+			shutter_start = now;
+		}
+	} else if (strcmp(cmd, "SHUTTERCLOSE") == 0) {
+		if (shutterMotor != SHUTTER_CLOSING) {
+			shutterMotor = SHUTTER_CLOSING;
+			shutter_start = now;
+		}
+	} else if (strcmp(cmd, "SHUTTERQUERY") == 0) {
+		sendString(shutterStateString());
+	} else if (strcmp(cmd, "QUERY") == 0) {
+		sendString(roofStateString());
+	}
+}
+
+void RoofSim::reportStateChanges() {
+	const char* roof = roofStateString();
+	if (roof != pending_roof) {
+		pending_roof = roof;
+		pending_roof_time = now;
+	}
+	if (now - pending_roof_time >= ROOFSIM_LIMIT_SETTLE) {
+		settled_roof = pending_roof;
+	}
+	if (binary_host) {
+		uint8_t s = statusFor(settled_roof);
+		if (s != reported_status) {
+			reported_status = s;
+			sendStatus(s);
+		}
+		return;
+	}
+	if (settled_roof != reported_roof) {
+		reported_roof = settled_roof;
+		sendString(reported_roof);
+	}
+	const char* shutter = shutterStateString();
+	if (shutter != reported_shutter) {
+		reported_shutter = shutter;
+		sendString(reported_shutter);
+	}
+}
+
+const char* RoofSim::roofStateString() {
+	if (pos >= 1.0) return "OPEN";
+	if (pos <= 0.0) return "CLOSED";
+	return "UNKNOWN";
+}
+
+const char* RoofSim::shutterStateString() {
+	if (shutterMotor == SHUTTER_STOPPED) {
+		return shutter_closed ? "SHUTTERCLOSED" : "SHUTTEROPEN";
+	}
+	return "SHUTTERUNKNOWN";
+}
+
+uint8_t RoofSim::status() {
+	return statusFor(roofStateString());
+}
+
+uint8_t RoofSim::statusFor(const char* roof) {
+	uint8_t s = 0;
+	if (roof != NULL && strcmp(roof, "OPEN") == 0) s |= ROOF_STATUS_OPEN_LIMIT;
+	if (roof != NULL && strcmp(roof, "CLOSED") == 0) s |= ROOF_STATUS_CLOSED_LIMIT;
+	if (shutterMotor != SHUTTER_STOPPED) {
+		s |= ROOF_STATUS_SHUTTER_MOVING;
+	} else if (!shutter_closed) {
+		s |= ROOF_STATUS_SHUTTER_OPEN;
+	}
+	if (motor != STOPPED) s |= ROOF_STATUS_MOTOR_ON;
+	return s;
+}
+
+void RoofSim::sendStatus(uint8_t status) {
+	FirmataFrame frame;
+	frame.put(FIRMATA_START_SYSEX);
+	frame.put(ROOF_SYSEX_STATUS);
+	frame.put(status);
+	if (cfg.features >= 0) frame.put(cfg.features & 0x7F);
+	frame.put(FIRMATA_END_SYSEX);
+	sendFrame(frame);
+}
+
+void RoofSim::sendEdge(uint8_t edge) {
+	uint32_t ms = (uint32_t)(now * 1000);
+	FirmataFrame frame;
+	frame.put(FIRMATA_START_SYSEX);
+	frame.put(ROOF_SYSEX_EDGE);
+	frame.put(edge);
+	for (int i=0; i < 5; i++) frame.put((ms >> (7 * i)) & 0x7F);
+	for (int i=0; i < 3; i++) frame.put(0);
+	frame.put(FIRMATA_END_SYSEX);
+	sendFrame(frame);
+}
+
+void RoofSim::sendFirmwareReport() {
+	FirmataFrame frame;
+	frame.put(FIRMATA_START_SYSEX);
+	frame.put(FIRMATA_REPORT_FIRMWARE);
+	frame.put(2);
+	frame.put(5);
+	for (const char* c = ROOFSIM_FIRMWARE_NAME; *c; c++) {
+		frame.putTwo7bitBytes((unsigned char)*c);
+	}
+	frame.put(FIRMATA_END_SYSEX);
+	sendFrame(frame);
+}
+
+void RoofSim::sendString(const char* str) {
+	FirmataFrame frame;
+	frame.putStringData(str);
+	sendFrame(frame);
+}
+
+void RoofSim::sendFrame(const FirmataFrame& frame) {
+	if (master < 0) return;
+	uint8_t buf[FIRMATA_MAX_FRAME_BYTES];
+	int n = 0;
+	for (int i=0; i < frame.size(); i++) {
+		if (!dropped()) buf[n++] = frame.data()[i];
+	}
+	if (n > 0 && write(master, buf, n) < 0 && errno != EAGAIN) {
+		perror("RoofSim::sendFrame():write():");
+	}
+}
+
+bool RoofSim::dropped() {
+	return cfg.drop_rate > 0 && (double)rand() / RAND_MAX < cfg.drop_rate;
+}
+
+double RoofSim::position() {
+	return pos;
+}
+
+void RoofSim::setPosition(double position) {
+	pos = position;
+}
+
+void RoofSim::setJam(double position) {
+	cfg.jam_position = position;
+}
+
+bool RoofSim::roofMoving() {
+	return motor != STOPPED;
+}
@@ -0,0 +1,104 @@
+/*
+   Virtual SimpleDigitalFirmataRoofController.
+
+   Speaks the same Firmata dialect as the arduino sketch over a pseudo
+   terminal so the driver and libfirmata can be exercised without hardware:
+   firmware report, OPEN/CLOSE/ABORT/QUERY and SHUTTER* string commands, their
+   binary sysex equivalents (roofprotocol.h), pushed limit switch /
+   shutter state changes, link rate negotiation and, to a binary host, limit
+   switch edge frames. The roof is modelled as a
+   position between 0 (closed) and 1 (open) moved by the hoist, with the
+   sketch's relay dwell and safety cut outs. Faults (a jam part way along,
+   dropped bytes) can be injected, and simulated time can run faster than
+   real time.
+*/
+
+#ifndef ROOFSIM_H
+#define ROOFSIM_H
+
+#include <stdint.h>
+#include <firmata.h>
+#include <roofprotocol.h>
+
+#define ROOFSIM_FIRMWARE_NAME   "SimpleDigitalFirmataRoofController"
+#define ROOFSIM_TRAVEL_TIME     17.0  // seconds from fully closed to fully open
+#define ROOFSIM_SHUTTER_TIME    40.0  // the sketch runs the shutter actuator this long
+#define ROOFSIM_RELAY_DWELL      1.0  // the sketch's motorOff() delay before a direction change
+#define ROOFSIM_MOTOR_TIMEOUT   30.0  // the sketch's roof motor safety cut out
+#define ROOFSIM_LIMIT_SETTLE    0.05  // limit switch settle time before a state change is pushed
+
+typedef struct {
+	double travel_time;   // seconds, closed to open
+	double speed;         // simulated seconds per real second
+	double start_position;// 0 = closed, 1 = open
+	double jam_position;  // roof sticks here while moving, <0 for no jam
+	double drop_rate;     // probability of losing each byte in either direction
+	int features;         // ROOF_FEATURE_* in status frames, <0 to send the status byte alone and ignore STOP like the first binary firmware
+	bool verbose;
+} roofsim_config_t;
+
+void roofsim_default_config(roofsim_config_t* cfg);
+
+class RoofSim {
+	public:
+		RoofSim(const roofsim_config_t& cfg);
+		~RoofSim();
+		int openPty();
+		const char* slaveName();
+		int fd();
+		// Read and answer host traffic and advance the model until *stop is
+		// set. tick_ms bounds how long one poll of the pty may block.
+		int run(volatile bool* stop, int tick_ms);
+		// One pass of run(): service the pty for up to timeout_ms, then
+		// advance the model by the real time elapsed times the speed.
+		int poll(int timeout_ms);
+		// Advance the model by dt simulated seconds.
+		void step(double dt);
+		void receive(const uint8_t* buf, int len);
+
+		double position();
+		void setPosition(double position);
+		void setJam(double position);
+		bool roofMoving();
+		const char* roofStateString();
+		const char* shutterStateString();
+		uint8_t status();
+
+	private:
+		enum { STOPPED, OPENING, CLOSING } motor;
+		enum { SHUTTER_STOPPED, SHUTTER_OPENING, SHUTTER_CLOSING } shutterMotor;
+		roofsim_config_t cfg;
+		int master;
+		int slave;
+		char slave_name[128];
+		FirmataParser parser;
+		double now;            // simulated seconds since start
+		double pos;
+		double motor_start;    // when the current motor command was given
+		double shutter_start;
+		bool shutter_closed;
+		const char* reported_roof;
+		const char* pending_roof;
+		double pending_roof_time;
+		const char* settled_roof;
+		const char* reported_shutter;
+		bool binary_host;      // the host has used the binary protocol, push status frames
+		int reported_status;
+		uint8_t limits;        // limit switch bits at the end of the last step
+		int link_baud;         // rate agreed with the host, only reported
+		struct timespec last_poll;
+
+		void handleMessage(const firmata_view_t& msg);
+		void handleCommand(const char* cmd);
+		void handleOpcode(uint8_t op);
+		uint8_t statusFor(const char* roof);
+		void sendStatus(uint8_t status);
+		void sendEdge(uint8_t edge);
+		void sendFirmwareReport();
+		void sendString(const char* str);
+		void sendFrame(const FirmataFrame& frame);
+		void reportStateChanges();
+		bool dropped();
+};
+
+#endif // ROOFSIM_H
@@ -0,0 +1,70 @@
+/*
+   indi_aldiroof_sim: run a virtual roof controller on a pseudo terminal.
+
+   Point the driver's serial port at the printed device (or at the symlink
+   given with -l) instead of /dev/ttyACM0.
+*/
+
+#include <roofsim.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static volatile bool stop = false;
+
+static void onSignal(int) {
+	stop = true;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,"Usage: %s [-t travel seconds] [-s speed factor] [-p start position 0..1]\n"
+		"          [-j jam position 0..1] [-d byte drop rate 0..1] [-f features, -1 for none]\n"
+		"          [-l symlink] [-v]\n",prog);
+}
+
+int main(int argc, char** argv) {
+	roofsim_config_t cfg;
+	roofsim_default_config(&cfg);
+	const char* link = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:s:p:j:d:f:l:vh")) != -1) {
+		switch (opt) {
+			case 't': cfg.travel_time = atof(optarg); break;
+			case 's': cfg.speed = atof(optarg); break;
+			case 'p': cfg.start_position = atof(optarg); break;
+			case 'j': cfg.jam_position = atof(optarg); break;
+			case 'd': cfg.drop_rate = atof(optarg); break;
+			case 'f': cfg.features = atoi(optarg); break;
+			case 'l': link = optarg; break;
+			case 'v': cfg.verbose = true; break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (cfg.travel_time <= 0 || cfg.speed <= 0) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	RoofSim sim(cfg);
+	if (sim.openPty() != 0) {
+		exit(1);
+	}
+	if (link != NULL) {
+		unlink(link);
+		if (symlink(sim.slaveName(), link) != 0) {
+			perror("symlink");
+			exit(1);
+		}
+	}
+	printf("Roof simulator on %s%s%s\n", sim.slaveName(), link ? " -> " : "", link ? link : "");
+	fflush(stdout);
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	int rv = sim.run(&stop, 5);
+	if (link != NULL) unlink(link);
+	return rv == 0 ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#include "telemetry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+uint8_t telemetry_command_code(const char *cmd)
+{
+    if (strcmp(cmd, "OPEN") == 0) return TELEMETRY_CMD_OPEN;
+    if (strcmp(cmd, "CLOSE") == 0) return TELEMETRY_CMD_CLOSE;
+    if (strcmp(cmd, "ABORT") == 0) return TELEMETRY_CMD_ABORT;
+    if (strcmp(cmd, "QUERY") == 0) return TELEMETRY_CMD_QUERY;
+    if (strcmp(cmd, "SHUTTEROPEN") == 0) return TELEMETRY_CMD_SHUTTER_OPEN;
+    if (strcmp(cmd, "SHUTTERCLOSE") == 0) return TELEMETRY_CMD_SHUTTER_CLOSE;
+    if (strcmp(cmd, "STOP") == 0) return TELEMETRY_CMD_STOP;
+    return TELEMETRY_CMD_OTHER;
+}
+
+const char *telemetry_event_name(uint8_t event)
+{
+    switch (event)
+    {
+        case TELEMETRY_COMMAND: return "COMMAND";
+        case TELEMETRY_QUERY: return "QUERY";
+        case TELEMETRY_PUSH: return "PUSH";
+        case TELEMETRY_MOTION_END: return "MOTION_END";
+        case TELEMETRY_LINK: return "LINK";
+        case TELEMETRY_EDGE: return "EDGE";
+        case TELEMETRY_WEATHER: return "WEATHER";
+    }
+    return "?";
+}
+
+const char *telemetry_command_name(uint8_t command)
+{
+    switch (command)
+    {
+        case TELEMETRY_CMD_NONE: return "";
+        case TELEMETRY_CMD_OPEN: return "OPEN";
+        case TELEMETRY_CMD_CLOSE: return "CLOSE";
+        case TELEMETRY_CMD_ABORT: return "ABORT";
+        case TELEMETRY_CMD_QUERY: return "QUERY";
+        case TELEMETRY_CMD_SHUTTER_OPEN: return "SHUTTEROPEN";
+        case TELEMETRY_CMD_SHUTTER_CLOSE: return "SHUTTERCLOSE";
+        case TELEMETRY_CMD_STOP: return "STOP";
+    }
+    return "OTHER";
+}
+
+const char *telemetry_outcome_name(uint8_t outcome)
+{
+    switch (outcome)
+    {
+        case TELEMETRY_OK: return "OK";
+        case TELEMETRY_FAILED: return "FAILED";
+        case TELEMETRY_OPENED: return "OPENED";
+        case TELEMETRY_CLOSED: return "CLOSED";
+        case TELEMETRY_ABORTED: return "ABORTED";
+        case TELEMETRY_TIMED_OUT: return "TIMED_OUT";
+        case TELEMETRY_LOST: return "LOST";
+        case TELEMETRY_RESTORED: return "RESTORED";
+        case TELEMETRY_MADE: return "MADE";
+        case TELEMETRY_RELEASED: return "RELEASED";
+        case TELEMETRY_CUT: return "CUT";
+    }
+    return "?";
+}
+
+TelemetryLog::TelemetryLog()
+{
+    header = NULL;
+    records = NULL;
+    mapSize = 0;
+}
+
+TelemetryLog::~TelemetryLog()
+{
+    close();
+}
+
+bool TelemetryLog::open(const char *path, uint32_t capacity)
+{
+    close();
+    int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "TelemetryLog::open(%s): %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t size = sizeof(telemetry_header_t) + (size_t)capacity * sizeof(telemetry_record_t);
+    off_t current = lseek(fd, 0, SEEK_END);
+    // Size the file up front so appends never have to extend it
+    if (current != (off_t)size && ftruncate(fd, size) != 0) {
+        fprintf(stderr, "TelemetryLog::open(%s): ftruncate: %s\n", path, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "TelemetryLog::open(%s): mmap: %s\n", path, strerror(errno));
+        return false;
+    }
+    header = (telemetry_header_t *)map;
+    records = (telemetry_record_t *)((uint8_t *)map + sizeof(telemetry_header_t));
+    mapSize = size;
+    if (header->magic != TELEMETRY_MAGIC || header->version != TELEMETRY_VERSION ||
+        header->record_size != sizeof(telemetry_record_t) || header->capacity != capacity)
+    {
+        // New file, or one written with another layout: start an empty ring
+        memset(map, 0, size);
+        header->magic = TELEMETRY_MAGIC;
+        header->version = TELEMETRY_VERSION;
+        header->record_size = sizeof(telemetry_record_t);
+        header->capacity = capacity;
+        header->next = 0;
+    }
+    return true;
+}
+
+void TelemetryLog::close()
+{
+    if (header == NULL) return;
+    msync(header, mapSize, MS_ASYNC);
+    munmap(header, mapSize);
+    header = NULL;
+    records = NULL;
+    mapSize = 0;
+}
+
+bool TelemetryLog::isOpen() const
+{
+    return header != NULL;
+}
+
+void TelemetryLog::append(telemetry_record_t &rec)
+{
+    if (header == NULL) return;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    rec.seq = (uint32_t)header->next;
+    records[header->next % header->capacity] = rec;
+    // Only count the record once it is all there, and count it before the slot can be reused for a later one.
+    // A reader that sees any of a record's stores then sees next past it, see telemetrydump.cpp.
+    __sync_synchronize();
+    header->next++;
+    __sync_synchronize();
+}
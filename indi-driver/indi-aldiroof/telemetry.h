@@ -0,0 +1,106 @@
+#ifndef Telemetry_H
+#define Telemetry_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Roof telemetry ring file. A fixed header followed by a ring of fixed size
+ * records, mapped into the driver with mmap so appending a record is a few
+ * stores into shared memory: no allocation and no system call on the timer
+ * path. The kernel writes the pages back, so the history survives a driver
+ * crash. Once the ring is full the oldest records are overwritten.
+ *
+ * Read it with aldiroof_telemetry, which dumps the records as CSV.
+ */
+#define TELEMETRY_MAGIC     0x464D5241  // "ARMF"
+#define TELEMETRY_VERSION   1
+#define TELEMETRY_RECORDS   65536       // 2MB of history. Idle polls are only recorded when they find a change, so this is months of typical use
+
+// Events
+#define TELEMETRY_COMMAND       1   // command written to the arduino
+#define TELEMETRY_QUERY         2   // QUERY round trip
+#define TELEMETRY_PUSH          3   // state change pushed by the arduino
+#define TELEMETRY_MOTION_END    4   // motion finished, see outcome. command is the shutter command for a shutter run
+#define TELEMETRY_LINK          5   // serial link lost or restored
+#define TELEMETRY_EDGE          6   // limit switch edge latched by the arduino, limits holds the switch that changed rather than the roof state
+#define TELEMETRY_WEATHER       7   // weather alert acted on, rtt_us is the time from the alert arriving to the first close command written
+
+// Commands
+#define TELEMETRY_CMD_NONE      0
+#define TELEMETRY_CMD_OPEN      1
+#define TELEMETRY_CMD_CLOSE     2
+#define TELEMETRY_CMD_ABORT     3
+#define TELEMETRY_CMD_QUERY     4
+#define TELEMETRY_CMD_OTHER     5
+#define TELEMETRY_CMD_SHUTTER_OPEN  6
+#define TELEMETRY_CMD_SHUTTER_CLOSE 7
+#define TELEMETRY_CMD_STOP      8
+
+// Outcomes
+#define TELEMETRY_OK            0
+#define TELEMETRY_FAILED        1   // write failed or no reply
+#define TELEMETRY_OPENED        2
+#define TELEMETRY_CLOSED        3
+#define TELEMETRY_ABORTED       4
+#define TELEMETRY_TIMED_OUT     5   // motor cut out by the safety timeout
+#define TELEMETRY_LOST          6
+#define TELEMETRY_RESTORED      7
+#define TELEMETRY_MADE          8
+#define TELEMETRY_RELEASED      9
+#define TELEMETRY_CUT           10  // made, and the arduino cut the roof relays on it
+
+// Limit switch bits
+#define TELEMETRY_LIMIT_OPEN    0x01
+#define TELEMETRY_LIMIT_CLOSED  0x02
+#define TELEMETRY_LIMIT_VALID   0x04    // the arduino had reported a state
+
+#define TELEMETRY_NO_TEMPERATURE INT16_MIN
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;          // records in the ring
+    uint64_t next;              // sequence number of the next record, its slot is next % capacity
+    uint8_t reserved[40];       // pad to 64 bytes
+} telemetry_header_t;
+
+typedef struct {
+    uint64_t time_us;           // wall clock, to line up with INDI logs
+    uint32_t seq;               // low bits of the sequence number, tells an overwritten or torn slot apart
+    uint32_t rtt_us;            // QUERY round trip or serial write time
+    uint32_t elapsed_ms;        // time into the current motion at the event, 0 at rest
+    uint8_t event;
+    uint8_t command;
+    uint8_t limits;
+    uint8_t outcome;
+    int16_t temperature;        // outside temperature in 0.1C, TELEMETRY_NO_TEMPERATURE if unknown
+    uint16_t reserved16;
+    uint32_t board_ms;          // arduino millis() at a limit switch edge
+} telemetry_record_t;
+
+uint8_t telemetry_command_code(const char *cmd);
+const char *telemetry_event_name(uint8_t event);
+const char *telemetry_command_name(uint8_t command);
+const char *telemetry_outcome_name(uint8_t outcome);
+
+class TelemetryLog
+{
+    public:
+        TelemetryLog();
+        ~TelemetryLog();
+        // Map the ring file, creating or reinitialising it if it doesn't hold a ring of this layout and size
+        bool open(const char *path, uint32_t capacity);
+        void close();
+        bool isOpen() const;
+        // Fills in time_us and seq
+        void append(telemetry_record_t &rec);
+
+    private:
+        telemetry_header_t *header;
+        telemetry_record_t *records;
+        size_t mapSize;
+};
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * aldiroof_telemetry: dump the driver's telemetry ring file as CSV, oldest record first.
+ *
+ *   aldiroof_telemetry [ring file]
+ *
+ * The default file is the driver's default, ~/.indi/aldiroof_telemetry.bin. When the driver runs
+ * several roofs (ALDIROOF_PORTS) each writes its own, ~/.indi/aldiroof_telemetry_<n>.bin.
+ * Safe to run while the driver is writing; a record overwritten mid dump is skipped.
+ */
+#include "telemetry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int main(int argc, char *argv[])
+{
+    char defaultPath[512];
+    const char *path = argc > 1 ? argv[1] : NULL;
+    if (path == NULL) {
+        const char *home = getenv("HOME");
+        snprintf(defaultPath, sizeof(defaultPath), "%s/.indi/aldiroof_telemetry.bin", home ? home : ".");
+        path = defaultPath;
+    }
+    if (argc > 2 || (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))) {
+        fprintf(stderr, "Usage: %s [ring file]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(telemetry_header_t)) {
+        fprintf(stderr, "%s: not a telemetry file\n", path);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+        return 1;
+    }
+    const telemetry_header_t *header = (const telemetry_header_t *)map;
+    const telemetry_record_t *records = (const telemetry_record_t *)((const uint8_t *)map + sizeof(telemetry_header_t));
+    if (header->magic != TELEMETRY_MAGIC || header->version != TELEMETRY_VERSION ||
+        header->record_size != sizeof(telemetry_record_t) || header->capacity == 0 ||
+        sizeof(telemetry_header_t) + (size_t)header->capacity * sizeof(telemetry_record_t) > (size_t)st.st_size)
+    {
+        fprintf(stderr, "%s: not a telemetry file, or written by a different version\n", path);
+        return 1;
+    }
+
+    printf("seq,time,event,command,open,closed,state_known,outcome,rtt_us,elapsed_ms,temperature,board_ms\n");
+    uint64_t next = header->next;
+    uint64_t first = next > header->capacity ? next - header->capacity : 0;
+    for (uint64_t seq = first; seq < next; seq++) {
+        telemetry_record_t rec = records[seq % header->capacity];
+        // The writer fills slot next % capacity before counting it, so once next reaches seq + capacity the copy may be
+        // part of a later record
+        __sync_synchronize();
+        if (rec.seq != (uint32_t)seq || seq + header->capacity <= header->next)
+            continue;   // overwritten since the dump started
+        time_t secs = rec.time_us / 1000000;
+        struct tm tm;
+        char stamp[32];
+        gmtime_r(&secs, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        printf("%" PRIu64 ",%s.%03uZ,%s,%s,%d,%d,%d,%s,%u,%u,", seq, stamp, (unsigned)(rec.time_us % 1000000 / 1000),
+               telemetry_event_name(rec.event), telemetry_command_name(rec.command),
+               (rec.limits & TELEMETRY_LIMIT_OPEN) != 0, (rec.limits & TELEMETRY_LIMIT_CLOSED) != 0,
+               (rec.limits & TELEMETRY_LIMIT_VALID) != 0, telemetry_outcome_name(rec.outcome),
+               rec.rtt_us, rec.elapsed_ms);
+        if (rec.temperature != TELEMETRY_NO_TEMPERATURE)
+            printf("%.1f", rec.temperature / 10.0);
+        printf(",");
+        if (rec.event == TELEMETRY_EDGE)
+            printf("%u", rec.board_ms);
+        printf("\n");
+    }
+    munmap(map, st.st_size);
+    return 0;
+}
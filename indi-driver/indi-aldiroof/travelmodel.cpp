@@ -0,0 +1,79 @@
+#include "travelmodel.h"
+
+#include <math.h>
+#include <string.h>
+
+TravelModel::TravelModel()
+{
+    memset(bands, 0, sizeof(bands));
+}
+
+int TravelModel::band(double temperature)
+{
+    if (temperature < 0)
+        return 0;
+    if (temperature < 15)
+        return 1;
+    return 2;
+}
+
+const char *TravelModel::bandName(int band)
+{
+    static const char *names[TRAVEL_BANDS] = { "COLD", "MILD", "WARM" };
+    return names[band];
+}
+
+void TravelModel::add(int dir, double temperature, double seconds)
+{
+    // Without a temperature the run still counts, in the band a typical night falls in
+    travel_stats_t &s = bands[dir][isnan(temperature) ? 1 : band(temperature)];
+    if (s.n < TRAVEL_WINDOW)
+    {
+        s.n += 1;
+    }
+    else
+    {
+        // Forget one run's worth of spread so the variance stays a per-run figure
+        s.m2 *= (TRAVEL_WINDOW - 1.0) / TRAVEL_WINDOW;
+    }
+    double delta = seconds - s.mean;
+    s.mean += delta / s.n;
+    s.m2 += delta * (seconds - s.mean);
+}
+
+// Chan et al. parallel combination of the per band statistics
+travel_stats_t TravelModel::pooled(int dir) const
+{
+    travel_stats_t p = { 0, 0, 0 };
+    for (int b = 0; b < TRAVEL_BANDS; b++)
+    {
+        const travel_stats_t &s = bands[dir][b];
+        if (s.n <= 0)
+            continue;
+        double n = p.n + s.n;
+        double delta = s.mean - p.mean;
+        p.mean += delta * s.n / n;
+        p.m2 += s.m2 + delta * delta * p.n * s.n / n;
+        p.n = n;
+    }
+    return p;
+}
+
+bool TravelModel::predict(int dir, double temperature, double &mean, double &sd) const
+{
+    travel_stats_t s = { 0, 0, 0 };
+    if (!isnan(temperature))
+        s = bands[dir][band(temperature)];
+    if (s.n < TRAVEL_MIN_SAMPLES)
+        s = pooled(dir);
+    if (s.n < TRAVEL_MIN_SAMPLES)
+        return false;
+    mean = s.mean;
+    sd = sqrt(s.m2 / (s.n - 1));
+    return true;
+}
+
+travel_stats_t &TravelModel::stats(int dir, int band)
+{
+    return bands[dir][band];
+}
@@ -0,0 +1,41 @@
+#ifndef TravelModel_H
+#define TravelModel_H
+
+/*
+ * Running model of how long the roof takes to travel from one limit switch to
+ * the other, per direction and per outside temperature band (the hoist and
+ * rails are noticeably slower in the cold). Each band keeps a Welford mean and
+ * variance whose sample count is capped, so old runs are gradually forgotten
+ * and the model follows slow changes in the mechanism.
+ */
+#define TRAVEL_OPEN         0
+#define TRAVEL_CLOSE        1
+#define TRAVEL_BANDS        3       // below 0C, 0 to 15C, above 15C
+#define TRAVEL_MIN_SAMPLES  5       // runs needed before a band is trusted
+#define TRAVEL_WINDOW       50      // sample count cap, roughly the number of runs remembered
+
+typedef struct {
+    double n;
+    double mean;
+    double m2;      // sum of squared differences from the mean
+} travel_stats_t;
+
+class TravelModel
+{
+    public:
+        TravelModel();
+        static int band(double temperature);
+        static const char *bandName(int band);
+        // temperature is NAN when no weather device is reporting
+        void add(int dir, double temperature, double seconds);
+        // Mean and standard deviation for the band, or all bands pooled when the temperature is unknown or the band is still
+        // untrained. Returns false if there are fewer than TRAVEL_MIN_SAMPLES runs to go on.
+        bool predict(int dir, double temperature, double &mean, double &sd) const;
+        travel_stats_t &stats(int dir, int band);
+
+    private:
+        travel_stats_t bands[2][TRAVEL_BANDS];
+        travel_stats_t pooled(int dir) const;
+};
+
+#endif
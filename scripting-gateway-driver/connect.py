@@ -1,12 +1,10 @@
 #!/usr/bin/python
-from firmatacontroller import FirmataRoofController
-from pyfirmata import Arduino, util
-import pyfirmata
+from roofdcontroller import connect
 import os
 
 
 def main():
-    rc = FirmataRoofController('/dev/ttyACM0')
+    rc = connect('/dev/ttyACM0')
     rc.disconnect()
     try:
         os.remove('/tmp/roofstate.p')
@@ -1,10 +1,8 @@
 #!/usr/bin/python
-from firmatacontroller import FirmataRoofController
-from pyfirmata import Arduino, util
-import pyfirmata
+from roofdcontroller import connect
 
 def main():
-    rc = FirmataRoofController('/dev/ttyACM0')
+    rc = connect('/dev/ttyACM0')
     rc.move('OPEN', until='OPEN')
     rc.disconnect()
     try:
@@ -0,0 +1,71 @@
+import os
+import socket
+import time
+
+SOCKET_PATH = '/tmp/aldiroofd.sock'
+
+class RoofDaemonController():
+    '''
+    Same interface as FirmataRoofController, but talks to the aldiroofd daemon, which keeps the serial port open,
+    instead of opening the port (and resetting the arduino) itself.
+    '''
+
+    NAME = "RoofDaemonController"
+
+    def __init__(self, path=SOCKET_PATH):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.settimeout(5)
+        self.sock.connect(path)
+        self.replies = self.sock.makefile('r')
+        self.state = 'UNKNOWN'
+
+    def disconnect(self):
+        self.replies.close()
+        self.sock.close()
+
+    def request(self, request):
+        self.sock.sendall((request + '\n').encode('ascii'))
+        reply = self.replies.readline().split()
+        if not reply or reply[0] != 'OK':
+            raise IOError('aldiroofd: {}'.format(' '.join(reply)))
+        return reply[1:]
+
+    def send_arduino_command(self, cmd):
+        # The daemon already has the state the arduino pushed, no need to ask it
+        if cmd == 'QUERY':
+            self.state = self.request('STATUS')[0]
+        else:
+            self.request(cmd)
+
+    def abort(self):
+        self.send_arduino_command('ABORT')
+
+    def move(self, direction_cmd, until):
+        self.abort()
+        self.send_arduino_command('QUERY')
+        if self.state == until:
+            print('already {}'.format(until))
+            return
+        self.send_arduino_command(direction_cmd)
+        i = 1
+        while i < 40:
+            time.sleep(0.5)
+            self.send_arduino_command('QUERY')
+            if self.state == until:
+                self.abort()
+                return
+            i+=1
+        self.abort()
+
+
+def connect(port='/dev/ttyACM0', path=SOCKET_PATH):
+    '''
+    The aldiroofd daemon if it is running, otherwise the board on port directly.
+    '''
+    if os.path.exists(path):
+        try:
+            return RoofDaemonController(path)
+        except socket.error:
+            pass
+    from firmatacontroller import FirmataRoofController
+    return FirmataRoofController(port)
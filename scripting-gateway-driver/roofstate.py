@@ -0,0 +1,59 @@
+import mmap
+import os
+import struct
+import time
+
+SHM_PATH = '/dev/shm/aldiroof'
+MAGIC = 0x54535241
+VERSION = 1
+# roofstate_shm_t from the driver's roofstate.h: magic, version, size, seq, then roofstate_t
+HEADER = struct.Struct('=IIII')
+STATE = struct.Struct('=QQIBBHIIII')
+OPEN_LIMIT = 0x01
+CLOSED_LIMIT = 0x02
+VALID = 0x04
+LINK_UP = 0x08
+IDLE = 0
+STALE_S = 30
+READ_TRIES = 100
+
+def read_shared_state(path=SHM_PATH):
+    '''
+    The roof state the INDI driver or aldiroofd publishes in shared memory: 'OPEN', 'CLOSED' or 'UNKNOWN'.
+    None only if neither is running, i.e. there is no segment or it hasn't been updated for STALE_S. While a writer
+    is running it owns the serial port, so a state it can't vouch for (moving, just commanded, link down) is 'UNKNOWN'
+    rather than a reason to open the port.
+    '''
+    monotonic = getattr(time, 'monotonic', None)
+    if monotonic is None:
+        return None
+    try:
+        with open(path, 'rb') as f:
+            shm = mmap.mmap(f.fileno(), HEADER.size + STATE.size, mmap.MAP_SHARED, mmap.PROT_READ)
+    except (IOError, OSError, ValueError):
+        return None
+    try:
+        magic, version, size, _ = HEADER.unpack_from(shm, 0)
+        if magic != MAGIC or version != VERSION or size != HEADER.size + STATE.size:
+            return None
+        for _ in range(READ_TRIES):
+            seq = HEADER.unpack_from(shm, 0)[3]
+            if seq & 1:
+                continue
+            state = STATE.unpack_from(shm, HEADER.size)
+            if HEADER.unpack_from(shm, 0)[3] == seq:
+                break
+        else:
+            return None
+    finally:
+        shm.close()
+    updated_ns, flags, motion = state[0], state[2], state[3]
+    if monotonic() - updated_ns / 1e9 > STALE_S:
+        return None
+    if not flags & LINK_UP or not flags & VALID or motion != IDLE:
+        return 'UNKNOWN'
+    if flags & OPEN_LIMIT:
+        return 'OPEN'
+    if flags & CLOSED_LIMIT:
+        return 'CLOSED'
+    return 'UNKNOWN'
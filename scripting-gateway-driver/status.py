@@ -3,9 +3,8 @@
 import sys
 import pickle
 import time
-from firmatacontroller import FirmataRoofController
-from pyfirmata import Arduino, util
-import pyfirmata
+from roofdcontroller import connect
+from roofstate import read_shared_state
 
 OPEN='0 1 0'
 CLOSED='1 0 0'
@@ -24,7 +23,7 @@ def retrieve_cached_state():
         return None
 
 def query_firmware():
-    rc = FirmataRoofController('/dev/ttyACM0')
+    rc = connect('/dev/ttyACM0')
     rc.send_arduino_command('QUERY')
     rc.disconnect()
     return rc.state
@@ -48,7 +47,13 @@ def main(path):
     '''
     Queries the roof and writes a 3 digit string to the temp file passed. 3 digits represent park-state, shutter state and azimuth.
     Since this is not a rotating dome, the azimuth is hard coded to 0.
+    While the driver or aldiroofd is running, the state it publishes in shared memory is used as is: it owns the port,
+    and opening it here would reset the arduino.
     '''
+    state = read_shared_state()
+    if state!=None:
+        write_to_indi_tempfile(path, state)
+        return
     state = retrieve_cached_state()
     if state==None or state=='CLOSED':
         state = query_firmware()